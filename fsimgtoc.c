@@ -21,7 +21,7 @@ print(FILE *f, long size, FILE *out)
 	long last = 0;
 	long printed = 0;
 
-	fprintf(out, "unsigned char ospfs_data[%ld] = {\n", size);
+	fprintf(out, "unsigned char ospfs_data[%ld] __initdata = {\n", size);
 	c = getc(f);
 	while (c != EOF) {
 		if (c == 0 && designated_initializers)
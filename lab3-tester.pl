@@ -193,6 +193,36 @@ close FOO;
     
     # 32
     # remove a symbolic link
+
+    # 33
+    # find the hole and the data after it with SEEK_HOLE and SEEK_DATA
+    [ "dd bs=4096 count=1 if=/dev/zero of=test/sparse.txt 2>/dev/null && dd bs=4096 seek=2 count=1 if=/dev/zero of=test/sparse.txt conv=notrunc 2>/dev/null && perl -e 'open F, \"<\", \"test/sparse.txt\" or die; print sysseek(F, 0, 4) + 0, \" \", sysseek(F, 4096, 3) + 0' ; rm -f test/sparse.txt",
+      '4096 8192'
+    ],
+
+    # 34
+    # punch a hole: it reads back as zeroes and the size stays the same
+    [ 'yes | head -c 8192 > test/punch.txt && fallocate -p -o 1024 -l 4096 test/punch.txt && dd if=test/punch.txt bs=1024 skip=1 count=4 2>/dev/null | cmp -n 4096 - /dev/zero && stat -c %s test/punch.txt ; rm -f test/punch.txt',
+      '8192'
+    ],
+
+    # 35
+    # set the modification time, then check that a write updates it
+    [ 'echo hi > test/times.txt && touch -d @1000000000 test/times.txt && stat -c %Y test/times.txt && echo more >> test/times.txt && test $(stat -c %Y test/times.txt) -gt 1000000000 && echo newer ; rm -f test/times.txt',
+      '1000000000 newer'
+    ],
+
+    # 36
+    # set, read back and remove an extended attribute
+    [ 'setfattr -n user.color -v blue test/hello.txt && getfattr --only-values -n user.color test/hello.txt && setfattr -x user.color test/hello.txt && getfattr -d test/hello.txt',
+      'blue'
+    ],
+
+    # 37
+    # many small appends through one open file
+    [ 'for i in $(seq 1 2000); do echo "line $i"; done > test/appends.txt && seq -f "line %g" 1 2000 | cmp - test/appends.txt && echo ok ; rm -f test/appends.txt',
+      'ok'
+    ],
 );
 
 my($ntest) = 0;
@@ -56,7 +56,8 @@
  *****************************************************************************/
 
 // OSPFS's superblock.
-#define OSPFS_MAGIC 0x013101AE  // Related vaguely to '\11\1!'
+#define OSPFS_MAGIC 0x013101AF  // Related vaguely to '\11\1!'
+#define OSPFS_MAGIC_V1 0x013101AE  // Older images, with 64-byte inodes
 
 #define OSPFS_FREEMAP_BLK  2  // First block in free block
                               // bitmap
@@ -66,14 +67,33 @@ typedef struct ospfs_super {
 	uint32_t os_nblocks;   // Number of blocks on disk
 	uint32_t os_ninodes;   // Number of inodes on disk
 	uint32_t os_firstinob; // First inode block
+	uint32_t os_orphan;    // First orphan inode, or 0 (see below)
+	uint32_t os_feature_compat;    // OSPFS_FEATURE_COMPAT_* in use
+	uint32_t os_feature_incompat;  // OSPFS_FEATURE_INCOMPAT_* in use
+	uint32_t os_feature_ro_compat; // OSPFS_FEATURE_RO_COMPAT_* in use
 } ospfs_super_t;
 
+// Feature flags.  Layout changes since timestamps are recorded in the
+// superblock instead of changing the magic number, so existing images can
+// adopt them without being rebuilt.  A feature's class says what software
+// that doesn't know about it may do with an image that uses it:
+//   COMPAT	read and write the image anyway;
+//   RO_COMPAT	only read it (writing could corrupt it);
+//   INCOMPAT	not touch it at all (it can't even read it correctly).
+#define OSPFS_FEATURE_COMPAT_XATTR	0x0001	// Extended attribute blocks
+#define OSPFS_FEATURE_INCOMPAT_INLINE	0x0001	// Inline file data
+
+// The features this version of OSPFS understands.
+#define OSPFS_FEATURE_COMPAT_SUPP	OSPFS_FEATURE_COMPAT_XATTR
+#define OSPFS_FEATURE_INCOMPAT_SUPP	OSPFS_FEATURE_INCOMPAT_INLINE
+#define OSPFS_FEATURE_RO_COMPAT_SUPP	0
+
 
 /*****************************************************************************
  * INODES
  *
  *   Inodes are represented by 'struct ospfs_inode'.
- *   This structure is 64 bytes long, so 16 inodes fit in an inode block.
+ *   This structure is 128 bytes long, so 8 inodes fit in an inode block.
  *
  *   Each inode stores the block numbers of the blocks that contain that
  *   file's data.  If the file is less than 10KB big, the block pointers are
@@ -86,8 +106,18 @@ typedef struct ospfs_super {
  *   Inode number 0 is illegal, and inode number 1 is reserved for the root
  *   directory.
  *
+ *   A regular file's data may instead be stored inline, in the inode itself
+ *   (see INLINE DATA below).  'oi_format' says which.
+ *
+ *   Regular files and directories may also have an extended attribute
+ *   block, 'oi_xattr' (see EXTENDED ATTRIBUTES below).
+ *
+ *   Every inode ends with its access, modification and change times, in
+ *   seconds and nanoseconds since the Unix epoch (so they run out in 2106).
+ *   They are at the same place in symbolic link inodes.
+ *
  *****************************************************************************/
-#define OSPFS_INODESIZE		64
+#define OSPFS_INODESIZE		128
 #define OSPFS_BLKINODES		(OSPFS_BLKSIZE / OSPFS_INODESIZE)
 
 // Number of direct block pointers in 'struct ospfs_inode'.
@@ -107,22 +137,70 @@ typedef struct ospfs_super {
 #define OSPFS_FTYPE_DIR		1  // Directory
 #define OSPFS_FTYPE_SYMLINK	2  // Symbolic link
 
+#define OSPFS_FTYPE_ORPHAN	3  // Unlinked, blocks not yet freed
+
+// Data layout constants for 'struct ospfs_inode's 'oi_format' member.
+#define OSPFS_FORMAT_BLOCKS	0  // Data in blocks named by the block pointers
+#define OSPFS_FORMAT_INLINE	1  // Data in place of the block pointers
+
 // Inode number for the root directory.
 #define OSPFS_ROOT_INO		1
 
+// An unlinked file whose blocks haven't been freed yet is an "orphan".
+// Its link count is 0, but it is not free: its type is OSPFS_FTYPE_ORPHAN,
+// and it is on a singly-linked list that starts at the superblock's
+// 'os_orphan' and continues through each orphan's 'oi_mode'.  Orphans are
+// reclaimed in the background, and any left on the list at mount time are
+// reclaimed then.
+
+typedef struct ospfs_time {
+	uint32_t ot_sec;		    // Seconds since 1970
+	uint32_t ot_nsec;		    // Nanoseconds
+} ospfs_time_t;
+
+// Offset of the timestamps in an inode.
+#define OSPFS_INODE_TIMES	(OSPFS_INODESIZE - 3 * 8)
+
 // OSPFS's inode structure.
 typedef struct ospfs_inode {
 	uint32_t oi_size;                   // File size
 	uint32_t oi_ftype;                  // OSPFS_FTYPE_* constant
-	uint32_t oi_nlink;                  // Link count (0 means free)
+	uint32_t oi_nlink;                  // Link count (0 means free,
+					    // unless an orphan)
 	uint32_t oi_mode;		    // File permissions mode
 	
 	uint32_t oi_direct[OSPFS_NDIRECT];  // Direct block pointers
 	uint32_t oi_indirect;               // Indirect block
 	uint32_t oi_indirect2;		    // Doubly indirect block
+	uint32_t oi_xattr;		    // Extended attribute block, or 0
+	uint32_t oi_format;		    // OSPFS_FORMAT_* constant
+
+	uint32_t oi_unused[(OSPFS_INODE_TIMES - 72) / 4];	// Zero
+	ospfs_time_t oi_atime;		    // Last access
+	ospfs_time_t oi_mtime;		    // Last change to the contents
+	ospfs_time_t oi_ctime;		    // Last change to the inode
 } ospfs_inode_t;
 
 
+/*****************************************************************************
+ * INLINE DATA
+ *
+ *   A regular file of at most OSPFS_INLINE_MAX bytes may keep its data in
+ *   the inode, in the space the block pointers (oi_direct, oi_indirect and
+ *   oi_indirect2) would otherwise take up.  Its 'oi_format' is then
+ *   OSPFS_FORMAT_INLINE, it has no data blocks at all, and reading it costs
+ *   no access beyond the inode.  Bytes past the end of the file are zero.
+ *
+ *   Images only contain inline files once OSPFS_FEATURE_INCOMPAT_INLINE is
+ *   set.  Files are converted lazily: a small file becomes inline when its
+ *   last open file is closed, or on request (OSPFS_IOC_UPGRADE), and goes
+ *   back to blocks as soon as it grows too big.
+ *
+ *****************************************************************************/
+
+#define OSPFS_INLINE_MAX	(4 * (OSPFS_NDIRECT + 2))
+
+
 /*****************************************************************************
  * SYMBOLIC LINK INODES
  *
@@ -149,16 +227,20 @@ typedef struct ospfs_inode {
  *                         |  't' | '\0' | ........... |
  *                         +------+------+             |
  *                         | ......................... |
- *                         | .. 42 bytes of padding .. |
+ *                         | .. 82 bytes of padding .. |
  *                         | ......................... |
  *                         +------+------+------+------+
+ *        oi_atime =====>  |   as in ordinary inodes   |
+ *        oi_mtime =====>  |       (8 bytes each)      |
+ *        oi_ctime =====>  |                           |
+ *                         +------+------+------+------+
  *
  *   We use a separate type of inode structure to represent this, namely
  *   'struct ospfs_symlink_inode'.
  *
  *****************************************************************************/
 // Maximum length of a symbolic link.
-#define OSPFS_MAXSYMLINKLEN	(OSPFS_INODESIZE - 13)
+#define OSPFS_MAXSYMLINKLEN	(OSPFS_INODE_TIMES - 13)
 
 typedef struct ospfs_symlink_inode {
 	uint32_t oi_size;		    // File size
@@ -167,6 +249,10 @@ typedef struct ospfs_symlink_inode {
 	uint32_t oi_nlink;		    // Link count (0 means free)
 
 	char oi_symlink[OSPFS_MAXSYMLINKLEN + 1]; // Destination file
+
+	ospfs_time_t oi_atime;		    // Timestamps, as in ospfs_inode_t
+	ospfs_time_t oi_mtime;
+	ospfs_time_t oi_ctime;
 } ospfs_symlink_inode_t;
 
 
@@ -193,4 +279,204 @@ typedef struct ospfs_direntry {
 	char od_name[OSPFS_MAXNAMELEN + 1];	// File name
 } ospfs_direntry_t;
 
+
+/*****************************************************************************
+ * EXTENDED ATTRIBUTES
+ *
+ *   A regular file's or directory's extended attributes all live in one
+ *   block, named by the inode's 'oi_xattr' (0 if it has none), so reading
+ *   them costs a single block access.  The block holds a packed list of
+ *   entries, each a 'struct ospfs_xattr_entry' followed by the attribute's
+ *   full name (with its namespace prefix, like "user.", and no terminating
+ *   null) and then its value, padded to a multiple of 4 bytes.  An entry
+ *   with 'oxe_namelen' 0, or the end of the block, ends the list.
+ *
+ *   Symbolic links have no room for 'oi_xattr' and cannot have extended
+ *   attributes.
+ *
+ *****************************************************************************/
+
+typedef struct ospfs_xattr_entry {
+	uint8_t oxe_namelen;		// Name length, 0 at the end of the list
+	uint8_t oxe_unused;		// Zero
+	uint16_t oxe_valuelen;		// Value length
+} ospfs_xattr_entry_t;
+
+// Bytes an entry takes up in the attribute block.
+#define OSPFS_XATTR_ENTRYSIZE(namelen, valuelen) \
+	((sizeof(ospfs_xattr_entry_t) + (namelen) + (valuelen) + 3) & ~3)
+
+
+/*****************************************************************************
+ * WORKLOAD TRACES
+ *
+ *   When tracing is enabled (/sys/module/ospfs/parameters/trace), the module
+ *   records every file system operation into a ring buffer, which user
+ *   space drains by reading /proc/fs/ospfs/trace.  The result is a stream
+ *   of 'struct ospfs_trace_rec's that the 'ospfstrace' tool can replay
+ *   against a fresh image.
+ *
+ *   Records hold inode numbers, offsets and sizes only -- never file names
+ *   or contents -- so traces from production images can be shared safely.
+ *   The meaning of 'otr_dir', 'otr_off' and 'otr_len' depends on 'otr_op':
+ *
+ *	op		otr_dir		otr_off		otr_len
+ *	CREATE		directory	file mode	name length
+ *	UNLINK		directory	0		name length
+ *	LINK		directory	0		name length
+ *	SYMLINK		directory	target length	name length
+ *	OPEN		0		open flags	0
+ *	READ, WRITE	0		file offset	bytes transferred
+ *	TRUNCATE	0		new size	0
+ *	READDIR		0		f_pos		0
+ *
+ *****************************************************************************/
+
+#define OSPFS_TRACE_CREATE	1
+#define OSPFS_TRACE_UNLINK	2
+#define OSPFS_TRACE_LINK	3
+#define OSPFS_TRACE_SYMLINK	4
+#define OSPFS_TRACE_OPEN	5
+#define OSPFS_TRACE_READ	6
+#define OSPFS_TRACE_WRITE	7
+#define OSPFS_TRACE_TRUNCATE	8
+#define OSPFS_TRACE_READDIR	9
+#define OSPFS_TRACE_NOPS	10
+
+typedef struct ospfs_trace_rec {
+	uint64_t otr_time;	// Nanoseconds since the module was loaded
+	uint32_t otr_op;	// OSPFS_TRACE_* constant
+	uint32_t otr_ino;	// Inode the operation applies to
+	uint32_t otr_dir;	// Containing directory, for namespace operations
+	uint32_t otr_len;	// See table above
+	uint64_t otr_off;	// See table above
+} ospfs_trace_rec_t;
+
+
+/*****************************************************************************
+ * IOCTLS
+ *
+ *   Directories (and, for OSPFS_IOC_COPYRANGE and OSPFS_IOC_UPGRADE,
+ *   regular files) accept
+ *   these ioctls, which do in one call what would otherwise take a
+ *   system call (and often a directory scan) per entry or per chunk.
+ *
+ *   OSPFS_IOC_READDIRPLUS
+ *	Lists a directory together with each entry's inode attributes, in
+ *	one pass over the directory blocks.  Fill in 'orp_entries' and
+ *	'orp_count' (the array's capacity) and set 'orp_cookie' to 0 for the
+ *	first call.  On return, 'orp_count' entries have been filled in and
+ *	'orp_cookie' says where the next call should resume; 'orp_eof' is set
+ *	once the whole directory has been listed.
+ *
+ *   OSPFS_IOC_CREATEBATCH
+ *	Creates many regular files, with optional initial contents, in one
+ *	call.  Each of the 'obc_count' entries at 'obc_entries' names a file
+ *	(not NUL-terminated), its permission bits, and 'oce_size' bytes of
+ *	data at 'oce_data'.  Entries are created in order; each one's
+ *	'oce_result' is set to the new inode number or to a negative error
+ *	code (-EEXIST, -ENAMETOOLONG, ...), and a failed entry does not stop
+ *	the rest.  Running out of space does: 'obc_done' says how many
+ *	entries were looked at, and 'obc_created' how many files were made.
+ *	The new files' inodes and data blocks are allocated contiguously.
+ *	Needs write and search permission on the directory, like create.
+ *
+ *   OSPFS_IOC_RMTREE
+ *	Removes the entry named by 'ort_name' and 'ort_namelen' and, if it is
+ *	a directory, everything under it.  With 'ort_namelen' 0, empties the
+ *	directory the ioctl is made on instead.  'ort_removed' is set to the
+ *	number of entries removed.  Fails with -EBUSY, before removing
+ *	anything, if something in the tree is open, is a working directory,
+ *	or is mounted on.  Each directory entries are removed from needs the
+ *	permissions unlink would; one that lacks them stops the walk there
+ *	with -EACCES or -EPERM, leaving what was not yet removed.
+ *
+ *   OSPFS_IOC_COPYRANGE
+ *	Made on the destination file, which must be open for writing.
+ *	Copies 'ocr_len' bytes at 'ocr_src_off' in the OSPFS file open as
+ *	'ocr_src_fd' to 'ocr_dst_off', block to block inside the kernel.
+ *	Missing destination blocks are allocated together, in one run if
+ *	the disk allows.  When the two offsets are equal modulo the block
+ *	size, source holes stay holes.  'ocr_copied' is set to the number
+ *	of bytes copied.  This is less than 'ocr_len' if the source ends
+ *	first, or if space runs out.
+ *
+ *   OSPFS_IOC_UPGRADE
+ *	Converts a regular file to the best data layout the image's features
+ *	allow now, instead of when it is next closed (see INLINE DATA).  The
+ *	file must be open for writing.  Returns the file's OSPFS_FORMAT_*
+ *	afterwards, or -EBUSY if another open file shares its inode.  Takes
+ *	no argument.
+ *
+ *   Pointers are passed as uint64_t so 32- and 64-bit callers agree.
+ *
+ *****************************************************************************/
+
+#ifdef __KERNEL__
+# include <linux/ioctl.h>
+#else
+# include <sys/ioctl.h>
+#endif
+
+#define OSPFS_IOC_MAGIC		'O'
+
+typedef struct ospfs_dirent_plus {
+	uint32_t odp_ino;			// Inode number
+	uint32_t odp_ftype;			// OSPFS_FTYPE_* constant
+	uint32_t odp_size;			// oi_size
+	uint32_t odp_mode;			// oi_mode (0777 for symlinks)
+	uint32_t odp_nlink;			// oi_nlink
+	char odp_name[OSPFS_MAXNAMELEN + 1];	// File name
+} ospfs_dirent_plus_t;
+
+struct ospfs_readdirplus {
+	uint64_t orp_entries;	// In: user pointer to ospfs_dirent_plus_t[]
+	uint64_t orp_cookie;	// In/out: resume position (0 to start)
+	uint32_t orp_count;	// In: array capacity; out: entries returned
+	uint32_t orp_eof;	// Out: nonzero if the listing is complete
+};
+
+#define OSPFS_IOC_READDIRPLUS	_IOWR(OSPFS_IOC_MAGIC, 1, struct ospfs_readdirplus)
+
+typedef struct ospfs_create_ent {
+	uint64_t oce_name;	// In: user pointer to the name
+	uint64_t oce_data;	// In: user pointer to initial contents
+	uint32_t oce_namelen;	// In: name length
+	uint32_t oce_mode;	// In: permission bits
+	uint32_t oce_size;	// In: bytes of initial contents
+	int32_t oce_result;	// Out: inode number, or -(error code)
+} ospfs_create_ent_t;
+
+struct ospfs_createbatch {
+	uint64_t obc_entries;	// In: user pointer to ospfs_create_ent_t[]
+	uint32_t obc_count;	// In: number of entries
+	uint32_t obc_done;	// Out: entries processed
+	uint32_t obc_created;	// Out: files created
+	uint32_t obc_pad;
+};
+
+#define OSPFS_IOC_CREATEBATCH	_IOWR(OSPFS_IOC_MAGIC, 2, struct ospfs_createbatch)
+
+struct ospfs_rmtree {
+	uint64_t ort_name;	// In: user pointer to the name
+	uint32_t ort_namelen;	// In: name length, or 0 for the directory itself
+	uint32_t ort_pad;
+	uint64_t ort_removed;	// Out: entries removed
+};
+
+#define OSPFS_IOC_RMTREE	_IOWR(OSPFS_IOC_MAGIC, 3, struct ospfs_rmtree)
+
+struct ospfs_copyrange {
+	int32_t ocr_src_fd;	// In: source file descriptor
+	uint32_t ocr_pad;
+	uint64_t ocr_src_off;	// In: source offset
+	uint64_t ocr_dst_off;	// In: destination offset
+	uint64_t ocr_len;	// In: bytes to copy
+	uint64_t ocr_copied;	// Out: bytes copied
+};
+
+#define OSPFS_IOC_COPYRANGE	_IOWR(OSPFS_IOC_MAGIC, 4, struct ospfs_copyrange)
+
+#define OSPFS_IOC_UPGRADE	_IO(OSPFS_IOC_MAGIC, 5)
+
 #endif
@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <sys/types.h>
+
+#include "ospfsimg.h"
+
+/****************************************************************************
+ * ospfsage
+ *
+ *   Ages an OSPFS image by running a random churn of creates, appends,
+ *   truncates and deletes against it through the ospfsimg core, then
+ *   reports how fragmented the result is.  Images straight out of
+ *   ospfsformat are perfectly contiguous; aged ones give allocator and
+ *   layout changes a realistic starting point.
+ *
+ *   The churn keeps disk utilization near a target: below it, creates and
+ *   appends dominate; above it, truncates and deletes do.  Aging stops
+ *   after a fixed number of operations or once the average number of
+ *   extents per file reaches a target, whichever comes first.
+ *
+ *   The report covers every regular file in the image:
+ *     - extents per file (maximal runs of physically consecutive blocks),
+ *     - the total seek distance of reading every file in order, and
+ *     - measured sequential read throughput, reading each file's blocks
+ *	 in logical order straight from the image file.
+ *
+ ****************************************************************************/
+
+struct Agefile {
+	uint32_t ino;
+	char name[16];
+};
+
+struct ospfs_image *img;
+struct Agefile *files;
+int nfiles;
+unsigned long nextname;
+int verbose = 0;
+
+// Churn parameters
+unsigned long maxops = 10000;
+double fill = 0.75;		// Target fraction of data blocks in use
+double target_extents = 0;	// Stop once this fragmented (0 = never)
+uint32_t meansize = 16384;	// Mean size of new files and appends * 4
+int weight[4] = { 3, 4, 1, 2 };	// create, append, truncate, delete
+
+enum { OP_CREATE, OP_APPEND, OP_TRUNCATE, OP_DELETE };
+
+uint8_t pattern[OSPFS_BLKSIZE];
+
+uint32_t
+randsize(uint32_t mean)
+{
+	// Roughly exponential, so most files are small and a few are big
+	double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+	double x = -(double) mean * log(u);
+	return x > OSPFS_MAXFILESIZE / 4 ? OSPFS_MAXFILESIZE / 4 : (uint32_t) x + 1;
+}
+
+double
+utilization(void)
+{
+	uint32_t ndata = img->super->os_nblocks - img->firstdatab;
+	return 1.0 - (double) ospfsimg_nfree(img) / ndata;
+}
+
+int
+append(uint32_t ino, uint32_t n)
+{
+	ospfs_inode_t *oi = ospfsimg_inode(img, ino);
+	uint32_t off = oi->oi_size;
+	while (n > 0) {
+		uint32_t m = n < sizeof(pattern) ? n : sizeof(pattern);
+		ssize_t r = ospfsimg_write(img, ino, pattern, m, off);
+		if (r < 0)
+			return r;
+		off += m;
+		n -= m;
+	}
+	return 0;
+}
+
+// Take over files left by an earlier run, so images can be aged in steps.
+void
+adopt(void)
+{
+	ospfs_inode_t *dir_oi = ospfsimg_inode(img, OSPFS_ROOT_INO);
+	uint32_t off;
+
+	for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
+		uint32_t b = ospfsimg_blockno(img, dir_oi, off / OSPFS_BLKSIZE);
+		ospfs_direntry_t *od;
+		char *end;
+		unsigned long n;
+		if (!b)
+			continue;
+		od = (ospfs_direntry_t *) ((uint8_t *) ospfsimg_block(img, b) + off % OSPFS_BLKSIZE);
+		if (!od->od_ino || strncmp(od->od_name, "age", 3) != 0)
+			continue;
+		n = strtoul(od->od_name + 3, &end, 10);
+		if (*end || end == od->od_name + 3 || strlen(od->od_name) >= sizeof(files->name))
+			continue;
+		files = realloc(files, (nfiles + 1) * sizeof(*files));
+		if (!files) {
+			perror("realloc");
+			abort();
+		}
+		files[nfiles].ino = od->od_ino;
+		strcpy(files[nfiles].name, od->od_name);
+		nfiles++;
+		if (n >= nextname)
+			nextname = n + 1;
+	}
+}
+
+// Run one churn operation.  Returns 0 on success, -ENOSPC if the disk or
+// inode table filled up.
+int
+churn(void)
+{
+	int total = 0, op, i, r;
+	double u = utilization();
+
+	for (op = 0; op < 4; op++)
+		total += weight[op];
+	r = rand() % (total ? total : 1);
+	for (op = 0; op < 3 && r >= weight[op]; op++)
+		r -= weight[op];
+
+	if (u > fill && (op == OP_CREATE || op == OP_APPEND))
+		op = (rand() % 2) ? OP_DELETE : OP_TRUNCATE;
+	if (nfiles == 0)
+		op = OP_CREATE;
+
+	if (op == OP_CREATE) {
+		struct Agefile *f;
+		files = realloc(files, (nfiles + 1) * sizeof(*files));
+		if (!files) {
+			perror("realloc");
+			abort();
+		}
+		f = &files[nfiles];
+		snprintf(f->name, sizeof(f->name), "age%lu", nextname++);
+		if ((r = ospfsimg_create(img, OSPFS_ROOT_INO, f->name, 0666)) < 0)
+			return r;
+		f->ino = r;
+		nfiles++;
+		return append(f->ino, randsize(meansize));
+	}
+
+	i = rand() % nfiles;
+	if (op == OP_APPEND)
+		return append(files[i].ino, randsize(meansize / 4));
+	else if (op == OP_TRUNCATE) {
+		ospfs_inode_t *oi = ospfsimg_inode(img, files[i].ino);
+		return ospfsimg_change_size(img, oi, oi->oi_size ? rand() % oi->oi_size : 0);
+	} else {
+		r = ospfsimg_unlink(img, OSPFS_ROOT_INO, files[i].name);
+		files[i] = files[--nfiles];
+		return r;
+	}
+}
+
+
+/****************************************************************************
+ * FRAGMENTATION REPORT
+ */
+
+struct Report {
+	uint32_t nfiles;	// Regular files with at least one block
+	uint64_t nblocks;	// Data blocks in those files
+	uint64_t nextents;
+	uint32_t maxextents;
+	uint64_t seekdist;	// Sum of |jumps| between consecutive blocks
+	double seconds;		// Time to read all files sequentially
+};
+
+void
+measure(const char *imgname, struct Report *rep, int timed)
+{
+	uint32_t ino, n, b, prev, *order = NULL;
+	size_t norder = 0, i;
+	int fd, policy;
+	char buf[OSPFS_BLKSIZE];
+	struct timespec t0, t1;
+
+	memset(rep, 0, sizeof(*rep));
+	if (timed && !(order = malloc(img->super->os_nblocks * sizeof(*order)))) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (ino = OSPFS_ROOT_INO; ino < img->super->os_ninodes; ino++) {
+		ospfs_inode_t *oi = ospfsimg_inode(img, ino);
+		uint32_t extents = 0;
+		if (oi->oi_nlink == 0 || oi->oi_ftype != OSPFS_FTYPE_REG || oi->oi_size == 0)
+			continue;
+
+		prev = 0;
+		for (n = 0; n * OSPFS_BLKSIZE < oi->oi_size; n++) {
+			b = ospfsimg_blockno(img, oi, n);
+			if (!b)
+				continue;
+			if (b != prev + 1) {
+				extents++;
+				if (prev)
+					rep->seekdist += b > prev ? b - prev : prev - b;
+			}
+			if (order)
+				order[norder++] = b;
+			prev = b;
+			rep->nblocks++;
+		}
+		if (extents == 0)
+			continue;
+		rep->nfiles++;
+		rep->nextents += extents;
+		if (extents > rep->maxextents)
+			rep->maxextents = extents;
+	}
+	if (!timed)
+		return;
+
+	// Pages stay cached while 'img' maps them, and the timing would only
+	// measure the page cache; so unmap the image, drop its pages, and
+	// read the blocks in file order straight from the file
+	policy = img->policy;
+	ospfsimg_close(img);
+	if ((fd = open(imgname, O_RDONLY)) < 0) {
+		perror(imgname);
+		exit(1);
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < norder; i++)
+		if (pread(fd, buf, sizeof(buf), (off_t) order[i] * OSPFS_BLKSIZE) < 0) {
+			perror("pread");
+			exit(1);
+		}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	rep->seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	close(fd);
+	free(order);
+
+	if (!(img = ospfsimg_open(imgname, 1))) {
+		fprintf(stderr, "%s: %s\n", imgname, strerror(errno));
+		exit(1);
+	}
+	img->policy = policy;
+}
+
+double
+avgextents(const struct Report *rep)
+{
+	return rep->nfiles ? (double) rep->nextents / rep->nfiles : 0;
+}
+
+void
+printreport(const struct Report *rep)
+{
+	printf("utilization        %.1f%%\n", utilization() * 100);
+	printf("files              %u (%" PRIu64 " blocks)\n", rep->nfiles, rep->nblocks);
+	printf("extents per file   %.2f average, %u max\n", avgextents(rep), rep->maxextents);
+	printf("seek distance      %" PRIu64 " blocks (%.1f per file)\n", rep->seekdist,
+	       rep->nfiles ? (double) rep->seekdist / rep->nfiles : 0.0);
+	printf("sequential read    %.1f MB/s (%.3f s)\n",
+	       rep->seconds > 0 ? rep->nblocks * OSPFS_BLKSIZE / 1048576.0 / rep->seconds : 0.0,
+	       rep->seconds);
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "Usage: ospfsage [-V] [-s SEED] [-n OPS] [-u FILL%%] [-e EXTENTS]\n\
+                [-m MEANSIZE] [-w C,A,T,D] [-a firstfit|nextfit] fs.img\n\
+  Ages fs.img in place by running up to OPS random operations (0 = report\n\
+  only), keeping about FILL%% of data blocks in use, then reports\n\
+  fragmentation.  Aging stops early once files average EXTENTS extents.\n\
+  C,A,T,D weight creates, appends, truncates and deletes.\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned int seed = 1;
+	int policy = OSPFSIMG_FIRSTFIT;
+	unsigned long op;
+	struct Report rep;
+	char *s;
+	int r;
+
+    option:
+	if (argc > 1 && strcmp(argv[1], "-V") == 0) {
+		argc--, argv++, verbose = 1;
+		goto option;
+	}
+	if (argc > 2 && argv[1][0] == '-' && argv[1][1] && !argv[1][2]) {
+		switch (argv[1][1]) {
+		case 's':
+			seed = strtoul(argv[2], &s, 0);
+			break;
+		case 'n':
+			maxops = strtoul(argv[2], &s, 0);
+			break;
+		case 'u':
+			fill = strtod(argv[2], &s) / 100;
+			break;
+		case 'e':
+			target_extents = strtod(argv[2], &s);
+			break;
+		case 'm':
+			meansize = strtoul(argv[2], &s, 0);
+			break;
+		case 'w':
+			if (sscanf(argv[2], "%d,%d,%d,%d", &weight[0], &weight[1],
+				   &weight[2], &weight[3]) != 4)
+				usage();
+			s = "";
+			break;
+		case 'a':
+			if (strcmp(argv[2], "firstfit") == 0)
+				policy = OSPFSIMG_FIRSTFIT;
+			else if (strcmp(argv[2], "nextfit") == 0)
+				policy = OSPFSIMG_NEXTFIT;
+			else
+				usage();
+			s = "";
+			break;
+		default:
+			usage();
+		}
+		if (*s)
+			usage();
+		argc -= 2, argv += 2;
+		goto option;
+	}
+	if (argc != 2)
+		usage();
+
+	if (!(img = ospfsimg_open(argv[1], 1))) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		exit(1);
+	}
+	img->policy = policy;
+	adopt();
+	srand(seed);
+	memset(pattern, 0x5A, sizeof(pattern));
+
+	for (op = 0; op < maxops; op++) {
+		r = churn();
+		if (r < 0 && r != -ENOSPC) {
+			fprintf(stderr, "operation %lu: %s\n", op, strerror(-r));
+			exit(1);
+		}
+		if (target_extents > 0 && op % 100 == 99) {
+			measure(argv[1], &rep, 0);
+			if (verbose)
+				fprintf(stderr, "%lu ops: %.1f%% full, %.2f extents per file\n",
+					op + 1, utilization() * 100, avgextents(&rep));
+			if (avgextents(&rep) >= target_extents) {
+				op++;
+				break;
+			}
+		}
+	}
+
+	printf("%lu operations\n", op);
+	measure(argv[1], &rep, 1);
+	printreport(&rep);
+	ospfsimg_close(img);
+	return 0;
+}
@@ -1,6 +1,7 @@
 #define _BSD_EXTENSION
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <inttypes.h>
@@ -8,6 +9,7 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/types.h>
 #include <dirent.h>
 
@@ -30,6 +32,9 @@ uint32_t ninodes;
 uint32_t nbitblock;
 uint32_t nextb;
 uint32_t nextinode;
+uint32_t inodesleft;	// Inodes still to be allocated (an upper bound)
+uint32_t inodespread;	// Free inodes to leave before each top-level directory
+struct ospfs_inode *rootdirino;
 int verbose = 0;
 int link_contents = 0;
 
@@ -149,6 +154,14 @@ swizzleinode(struct ospfs_inode *inode)
 		swizzle(&inode->oi_direct[i]);
 	swizzle(&inode->oi_indirect);
 	swizzle(&inode->oi_indirect2);
+	swizzle(&inode->oi_xattr);
+	swizzle(&inode->oi_format);
+	swizzle(&inode->oi_atime.ot_sec);
+	swizzle(&inode->oi_atime.ot_nsec);
+	swizzle(&inode->oi_mtime.ot_sec);
+	swizzle(&inode->oi_mtime.ot_nsec);
+	swizzle(&inode->oi_ctime.ot_sec);
+	swizzle(&inode->oi_ctime.ot_nsec);
 }
 
 void
@@ -173,6 +186,10 @@ swizzleblock(struct Block *b)
 		swizzle(&s->os_nblocks);
 		swizzle(&s->os_ninodes);
 		swizzle(&s->os_firstinob);
+		swizzle(&s->os_orphan);
+		swizzle(&s->os_feature_compat);
+		swizzle(&s->os_feature_incompat);
+		swizzle(&s->os_feature_ro_compat);
 		break;
 	case BLOCK_DIR:
 		for (i = 0; i < OSPFS_BLKSIZE; i += OSPFS_DIRENTRY_SIZE) {
@@ -368,10 +385,86 @@ allocinode(uint32_t *ino, struct Block **ib)
 	}
 
 	*ino = nextinode++;
+	if (inodesleft)
+		inodesleft--;
 	*ib = getblk(super.os_firstinob + *ino / OSPFS_BLKINODES, 0, BLOCK_INODES);
 	return &(*ib)->u.ino[*ino % OSPFS_BLKINODES];
 }
 
+// Copy the host file's timestamps into an inode (of any type), or stamp it
+// with the current time if 'st' is NULL.
+void
+settimes(struct ospfs_inode *ino, const struct stat *st)
+{
+	struct timespec now;
+	const struct timespec *a = &now, *m = &now, *c = &now;
+
+	if (st) {
+		a = &st->st_atim;
+		m = &st->st_mtim;
+		c = &st->st_ctim;
+	} else
+		clock_gettime(CLOCK_REALTIME, &now);
+	ino->oi_atime.ot_sec = a->tv_sec;
+	ino->oi_atime.ot_nsec = a->tv_nsec;
+	ino->oi_mtime.ot_sec = m->tv_sec;
+	ino->oi_mtime.ot_nsec = m->tv_nsec;
+	ino->oi_ctime.ot_sec = c->tv_sec;
+	ino->oi_ctime.ot_nsec = c->tv_nsec;
+}
+
+// Start a new top-level directory in a fresh inode block, leaving free
+// inodes behind the previous one.  Files later created in a directory get
+// inodes near the directory's, so each directory needs room to grow.
+void
+spreadinodes(void)
+{
+	uint32_t next = nextinode + inodespread;
+	next = (next + OSPFS_BLKINODES - 1) / OSPFS_BLKINODES * OSPFS_BLKINODES;
+	if (next + inodesleft > ninodes)
+		next = ninodes - inodesleft;
+	if (next > nextinode)
+		nextinode = next;
+}
+
+int
+skipdir(const char *name)
+{
+	return strcmp(name, ".") == 0 || strcmp(name, "..") == 0
+		|| strcmp(name, "CVS") == 0 || strcmp(name, ".svn") == 0
+		|| strcmp(name, ".git") == 0;
+}
+
+// Count the inodes needed for directory 'name' (not including itself).
+// Hard links are counted once per link, so this is an upper bound.
+// Sets '*ndirs' to the number of subdirectories.
+uint32_t
+countinodes(const char *name, uint32_t *ndirs)
+{
+	DIR *dir;
+	struct dirent *ent;
+	struct stat s;
+	char pathbuf[PATH_MAX];
+	uint32_t n = 0, ignore;
+
+	*ndirs = 0;
+	if ((dir = opendir(name)) == NULL)
+		return 0;
+	while ((ent = readdir(dir)) != NULL) {
+		snprintf(pathbuf, sizeof(pathbuf), "%s/%s", name, ent->d_name);
+		if (lstat(pathbuf, &s) < 0)
+			continue;
+		if (S_ISREG(s.st_mode) || S_ISLNK(s.st_mode))
+			n++;
+		else if (S_ISDIR(s.st_mode) && !skipdir(ent->d_name)) {
+			n += 1 + countinodes(pathbuf, &ignore);
+			(*ndirs)++;
+		}
+	}
+	closedir(dir);
+	return n;
+}
+
 struct ospfs_direntry *
 allocdirentry(struct ospfs_inode *dirino, const char *name, struct Block **dirb, int indent)
 {
@@ -435,6 +528,7 @@ writefile(struct ospfs_inode *dirino, const char *name, unsigned long host_ino,
 	int i, n, nblk, hardlink_ino;
 	struct Block *dirb, *inob, *b, *bindir;
 	unsigned char md5_digest[MD5_DIGEST_SIZE];
+	struct stat st;
 
 	if ((fd = open(name, O_RDONLY)) < 0) {
 		fprintf(stderr, "open %s:", name);
@@ -497,6 +591,7 @@ writefile(struct ospfs_inode *dirino, const char *name, unsigned long host_ino,
 	if (!hardlink_ino) {
 		ino->oi_ftype = OSPFS_FTYPE_REG;
 		ino->oi_mode = mode;
+		settimes(ino, fstat(fd, &st) == 0 ? &st : NULL);
 		if (verbose)
 			fprintf(stderr, "%*s%s, directory block %d, inode %d\n", indent, "", last, dirb->bno, de->od_ino);
 
@@ -530,7 +625,7 @@ writefile(struct ospfs_inode *dirino, const char *name, unsigned long host_ino,
 }
 
 void
-addsymlink(struct ospfs_inode *dirino, const char *name, const char *linkbuf, unsigned long host_ino, int indent)
+addsymlink(struct ospfs_inode *dirino, const char *name, const char *linkbuf, unsigned long host_ino, const struct stat *st, int indent)
 {
 	const char *last;
 	struct ospfs_direntry *de;
@@ -568,6 +663,7 @@ addsymlink(struct ospfs_inode *dirino, const char *name, const char *linkbuf, un
 
 	if (!hardlink_ino) {
 		sino->oi_ftype = OSPFS_FTYPE_SYMLINK;
+		settimes((struct ospfs_inode *) sino, st);
 		if (verbose)
 			fprintf(stderr, "%*s%s, directory block %d, inode %d\n", indent, "", last, dirb->bno, de->od_ino);
 
@@ -584,6 +680,7 @@ writesymlink(struct ospfs_inode *dirino, const char *name, unsigned long host_in
 {
 	char linkbuf[OSPFS_MAXSYMLINKLEN + 1];
 	ssize_t linklen;
+	struct stat st;
 
 	if ((linklen = readlink(name, linkbuf, OSPFS_MAXSYMLINKLEN + 1)) == -1) {
 		fprintf(stderr, "readlink %s:", name);
@@ -595,7 +692,7 @@ writesymlink(struct ospfs_inode *dirino, const char *name, unsigned long host_in
 	}
 
 	linkbuf[linklen] = '\0';
-	addsymlink(dirino, name, linkbuf, host_ino, indent);
+	addsymlink(dirino, name, linkbuf, host_ino, lstat(name, &st) == 0 ? &st : NULL, indent);
 }
 
 void
@@ -625,6 +722,8 @@ writedirectory(struct ospfs_inode *parentdirino, char *name, int root, int inden
 			last = name;
 
 		dirod = allocdirentry(parentdirino, last, &dirb, indent);
+		if (parentdirino == rootdirino)
+			spreadinodes();
 		dirino = allocinode(&dirod->od_ino, &inob);
 		parentdirino->oi_nlink++;
 		dirino->oi_ftype = OSPFS_FTYPE_DIR;
@@ -636,6 +735,7 @@ writedirectory(struct ospfs_inode *parentdirino, char *name, int root, int inden
 			fprintf(stderr, "%*s%s, directory block %d, inode %d\n", indent, "", last, dirb->bno, dirod->od_ino);
 	} else
 		dirino = parentdirino;
+	settimes(dirino, fstat(dirfd(dir), &s) == 0 ? &s : NULL);
 
 	strcpy(pathbuf, name);
 	namelen = strlen(pathbuf);
@@ -645,7 +745,6 @@ writedirectory(struct ospfs_inode *parentdirino, char *name, int root, int inden
 	}
 
 	while ((ent = readdir(dir)) != NULL) {
-		int ent_namlen = strlen(ent->d_name);
 		strcpy(pathbuf + namelen, ent->d_name);
 
 		// don't depend on unreliable parts of the dirent structure
@@ -655,12 +754,7 @@ writedirectory(struct ospfs_inode *parentdirino, char *name, int root, int inden
 		if (S_ISREG(s.st_mode)) {
 			unsigned long host_ino = (s.st_nlink > 1 ? s.st_ino : 0);
 			writefile(dirino, pathbuf, host_ino, indent + 2, s.st_mode & 0777);
-		} else if (S_ISDIR(s.st_mode)
-			   && (ent_namlen > 1 || ent->d_name[0] != '.')
-			   && (ent_namlen > 2 || ent->d_name[0] != '.' || ent->d_name[1] != '.')
-			   && (ent_namlen > 3 || ent->d_name[0] != 'C' || ent->d_name[1] != 'V' || ent->d_name[2] != 'S')
-			   && (ent_namlen > 4 || ent->d_name[0] != '.' || ent->d_name[1] != 's' || ent->d_name[2] != 'v' || ent->d_name[3] != 'n')
-			   && (ent_namlen > 4 || ent->d_name[0] != '.' || ent->d_name[1] != 'g' || ent->d_name[2] != 'i' || ent->d_name[3] != 't'))
+		} else if (S_ISDIR(s.st_mode) && !skipdir(ent->d_name))
 			writedirectory(dirino, pathbuf, 0, indent + 2, s.st_mode & 0777);
 		else if (S_ISLNK(s.st_mode)) {
 			unsigned long host_ino = (s.st_nlink > 1 ? s.st_ino : 0);
@@ -747,6 +841,9 @@ main(int argc, char **argv)
 	uint32_t rootinonumber;
 
 	assert(sizeof(struct ospfs_inode) == OSPFS_INODESIZE);
+	assert(sizeof(struct ospfs_symlink_inode) == OSPFS_INODESIZE);
+	assert(offsetof(struct ospfs_inode, oi_atime) == OSPFS_INODE_TIMES);
+	assert(offsetof(struct ospfs_symlink_inode, oi_atime) == OSPFS_INODE_TIMES);
 
     option:
 	if (argc > 1 && strcmp(argv[1], "-V") == 0) {
@@ -802,9 +899,15 @@ main(int argc, char **argv)
 	rootino->oi_ftype = OSPFS_FTYPE_DIR;
 	rootino->oi_nlink = 1;
 	rootino->oi_mode = 0777;
+	settimes(rootino, NULL);
 	if (strcmp(argv[4], "-r") == 0) {
+		uint32_t ntop;
 		if (argc != 6)
 			usage();
+		rootdirino = rootino;
+		inodesleft = countinodes(argv[5], &ntop);
+		if (ntop && nextinode + inodesleft < ninodes)
+			inodespread = (ninodes - nextinode - inodesleft) / (ntop + 1);
 		writedirectory(rootino, argv[5], 1, 0, 0777);
 	} else {
 		for (i = 4; i < argc; i++)
@@ -812,7 +915,7 @@ main(int argc, char **argv)
 	}
 	while (links) {
 		struct linkrecord *l = links;
-		addsymlink(rootino, l->destination, l->source, 0, 0);
+		addsymlink(rootino, l->destination, l->source, 0, NULL, 0);
 		links = l->next;
 		free(l);
 	}
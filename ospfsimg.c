@@ -0,0 +1,564 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ospfsimg.h"
+#include "md5.h"
+
+/****************************************************************************
+ * ospfsimg
+ *
+ *   User-space OSPFS core; see ospfsimg.h.
+ *
+ ****************************************************************************/
+
+static inline void
+bitvector_set(void *vector, int i)
+{
+	((uint32_t *) vector) [i / 32] |= (1 << (i % 32));
+}
+
+static inline void
+bitvector_clear(void *vector, int i)
+{
+	((uint32_t *) vector) [i / 32] &= ~(1 << (i % 32));
+}
+
+static inline int
+bitvector_test(const void *vector, int i)
+{
+	return (((const uint32_t *) vector) [i / 32] & (1 << (i % 32))) != 0;
+}
+
+static uint32_t
+size2nblocks(uint32_t size)
+{
+	return (size + OSPFS_BLKSIZE - 1) / OSPFS_BLKSIZE;
+}
+
+// Inline files keep their data in place of the block pointers.
+static int
+is_inline(ospfs_inode_t *oi)
+{
+	return oi->oi_ftype != OSPFS_FTYPE_SYMLINK && oi->oi_format == OSPFS_FORMAT_INLINE;
+}
+
+
+// ospfsimg_touch(oi, mtime)
+//	Stamps 'oi's change time, and its modification time too if 'mtime'
+//	is set, with the current time.
+
+void
+ospfsimg_touch(ospfs_inode_t *oi, int mtime)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	oi->oi_ctime.ot_sec = now.tv_sec;
+	oi->oi_ctime.ot_nsec = now.tv_nsec;
+	if (mtime)
+		oi->oi_mtime = oi->oi_ctime;
+}
+
+
+// ospfsimg_open(name, writable)
+//	Maps the image file 'name'.  Returns NULL (with errno set) if the
+//	file cannot be mapped, is not an OSPFS image, or uses features this
+//	code doesn't know (or, for writing, might damage).
+
+struct ospfs_image *
+ospfsimg_open(const char *name, int writable)
+{
+	struct ospfs_image *img;
+	struct stat s;
+
+	if (!(img = calloc(1, sizeof(*img))))
+		return NULL;
+	if ((img->fd = open(name, writable ? O_RDWR : O_RDONLY)) < 0)
+		goto fail;
+	if (fstat(img->fd, &s) < 0)
+		goto fail_close;
+	img->length = s.st_size;
+	if (img->length < 2 * OSPFS_BLKSIZE) {
+		errno = EINVAL;
+		goto fail_close;
+	}
+	img->data = mmap(NULL, img->length,
+			 PROT_READ | (writable ? PROT_WRITE : 0),
+			 MAP_SHARED, img->fd, 0);
+	if (img->data == MAP_FAILED)
+		goto fail_close;
+
+	img->super = (ospfs_super_t *) (img->data + OSPFS_BLKSIZE);
+	if (img->super->os_magic != OSPFS_MAGIC
+	    || (size_t) img->super->os_nblocks * OSPFS_BLKSIZE > img->length
+	    || (img->super->os_feature_incompat & ~OSPFS_FEATURE_INCOMPAT_SUPP)
+	    || (writable && (img->super->os_feature_ro_compat & ~OSPFS_FEATURE_RO_COMPAT_SUPP))) {
+		munmap(img->data, img->length);
+		errno = EINVAL;
+		goto fail_close;
+	}
+	img->firstdatab = img->super->os_firstinob
+		+ (img->super->os_ninodes + OSPFS_BLKINODES - 1) / OSPFS_BLKINODES;
+	img->nextfit = img->firstdatab;
+	return img;
+
+    fail_close:
+	close(img->fd);
+    fail:
+	free(img);
+	return NULL;
+}
+
+void
+ospfsimg_close(struct ospfs_image *img)
+{
+	msync(img->data, img->length, MS_SYNC);
+	munmap(img->data, img->length);
+	close(img->fd);
+	free(img);
+}
+
+void *
+ospfsimg_block(struct ospfs_image *img, uint32_t blockno)
+{
+	return img->data + (size_t) blockno * OSPFS_BLKSIZE;
+}
+
+ospfs_inode_t *
+ospfsimg_inode(struct ospfs_image *img, uint32_t ino)
+{
+	if (ino >= img->super->os_ninodes)
+		return NULL;
+	return (ospfs_inode_t *) ospfsimg_block(img, img->super->os_firstinob) + ino;
+}
+
+
+/****************************************************************************
+ * FREE-BLOCK BITMAP
+ */
+
+int
+ospfsimg_block_free(struct ospfs_image *img, uint32_t blockno)
+{
+	return bitvector_test(ospfsimg_block(img, OSPFS_FREEMAP_BLK), blockno);
+}
+
+uint32_t
+ospfsimg_nfree(struct ospfs_image *img)
+{
+	uint32_t b, n = 0;
+	for (b = img->firstdatab; b < img->super->os_nblocks; b++)
+		n += ospfsimg_block_free(img, b);
+	return n;
+}
+
+// ospfsimg_alloc_block(img)
+//	Allocates a block according to 'img->policy'.  Returns 0 if the disk
+//	is full.  The block is not cleared.
+
+uint32_t
+ospfsimg_alloc_block(struct ospfs_image *img)
+{
+	void *bitmap = ospfsimg_block(img, OSPFS_FREEMAP_BLK);
+	uint32_t nblocks = img->super->os_nblocks;
+	uint32_t start, b;
+
+	start = img->policy == OSPFSIMG_NEXTFIT ? img->nextfit : img->firstdatab;
+	if (start < img->firstdatab || start >= nblocks)
+		start = img->firstdatab;
+
+	b = start;
+	do {
+		if (bitvector_test(bitmap, b)) {
+			bitvector_clear(bitmap, b);
+			img->nextfit = b + 1;
+			return b;
+		}
+		if (++b == nblocks)
+			b = img->firstdatab;
+	} while (b != start);
+	return 0;
+}
+
+void
+ospfsimg_free_block(struct ospfs_image *img, uint32_t blockno)
+{
+	if (blockno < img->firstdatab || blockno >= img->super->os_nblocks)
+		return;
+	bitvector_set(ospfsimg_block(img, OSPFS_FREEMAP_BLK), blockno);
+}
+
+static uint32_t
+alloc_zeroed(struct ospfs_image *img)
+{
+	uint32_t b = ospfsimg_alloc_block(img);
+	if (b)
+		memset(ospfsimg_block(img, b), 0, OSPFS_BLKSIZE);
+	return b;
+}
+
+
+/****************************************************************************
+ * BLOCK MAP
+ */
+
+// bmap_slot(img, oi, n, create)
+//	Returns a pointer to the block pointer for file block 'n', or NULL
+//	if an indirect block on the way is missing and 'create' is 0 (or
+//	cannot be allocated).
+
+static uint32_t *
+bmap_slot(struct ospfs_image *img, ospfs_inode_t *oi, uint32_t n, int create)
+{
+	uint32_t *indirect2;
+
+	if (is_inline(oi))
+		return NULL;
+	if (n < OSPFS_NDIRECT)
+		return &oi->oi_direct[n];
+
+	n -= OSPFS_NDIRECT;
+	if (n < OSPFS_NINDIRECT) {
+		if (!oi->oi_indirect
+		    && (!create || !(oi->oi_indirect = alloc_zeroed(img))))
+			return NULL;
+		return (uint32_t *) ospfsimg_block(img, oi->oi_indirect) + n;
+	}
+
+	n -= OSPFS_NINDIRECT;
+	if (n >= OSPFS_NINDIRECT * OSPFS_NINDIRECT)
+		return NULL;
+	if (!oi->oi_indirect2
+	    && (!create || !(oi->oi_indirect2 = alloc_zeroed(img))))
+		return NULL;
+	indirect2 = (uint32_t *) ospfsimg_block(img, oi->oi_indirect2) + n / OSPFS_NINDIRECT;
+	if (!*indirect2 && (!create || !(*indirect2 = alloc_zeroed(img))))
+		return NULL;
+	return (uint32_t *) ospfsimg_block(img, *indirect2) + n % OSPFS_NINDIRECT;
+}
+
+// ospfsimg_blockno(img, oi, n)
+//	Returns the disk block holding file block 'n' of 'oi', or 0 (always,
+//	for inline files).
+
+uint32_t
+ospfsimg_blockno(struct ospfs_image *img, ospfs_inode_t *oi, uint32_t n)
+{
+	uint32_t *slot;
+	if (oi->oi_ftype == OSPFS_FTYPE_SYMLINK || n >= size2nblocks(oi->oi_size))
+		return 0;
+	slot = bmap_slot(img, oi, n, 0);
+	return slot ? *slot : 0;
+}
+
+// free_indirect(img, oi, nblocks)
+//	Frees indirect blocks that a file of 'nblocks' blocks no longer needs.
+
+static void
+free_indirect(struct ospfs_image *img, ospfs_inode_t *oi, uint32_t nblocks)
+{
+	uint32_t *indirect2, i, keep;
+
+	if (nblocks <= OSPFS_NDIRECT && oi->oi_indirect) {
+		ospfsimg_free_block(img, oi->oi_indirect);
+		oi->oi_indirect = 0;
+	}
+	if (!oi->oi_indirect2)
+		return;
+
+	keep = 0;
+	if (nblocks > OSPFS_NDIRECT + OSPFS_NINDIRECT)
+		keep = (nblocks - OSPFS_NDIRECT - OSPFS_NINDIRECT + OSPFS_NINDIRECT - 1)
+			/ OSPFS_NINDIRECT;
+	indirect2 = ospfsimg_block(img, oi->oi_indirect2);
+	for (i = keep; i < OSPFS_NINDIRECT; i++)
+		if (indirect2[i]) {
+			ospfsimg_free_block(img, indirect2[i]);
+			indirect2[i] = 0;
+		}
+	if (keep == 0) {
+		ospfsimg_free_block(img, oi->oi_indirect2);
+		oi->oi_indirect2 = 0;
+	}
+}
+
+// uninline(img, oi)
+//	Moves inline file 'oi's data out to a new block, as ospfs_uninline
+//	does.  Returns 0 or -ENOSPC.
+
+static int
+uninline(struct ospfs_image *img, ospfs_inode_t *oi)
+{
+	uint32_t b = 0;
+
+	if (oi->oi_size) {
+		if (!(b = alloc_zeroed(img)))
+			return -ENOSPC;
+		memcpy(ospfsimg_block(img, b), oi->oi_direct, oi->oi_size);
+	}
+	memset(oi->oi_direct, 0, OSPFS_INLINE_MAX);
+	oi->oi_direct[0] = b;
+	oi->oi_format = OSPFS_FORMAT_BLOCKS;
+	return 0;
+}
+
+// ospfsimg_change_size(img, oi, new_size)
+//	Grows or shrinks a file, like change_size in ospfsmod.c.  New blocks
+//	are cleared.  On -ENOSPC the file is left unchanged.  Inline files
+//	stay inline while they fit.
+
+int
+ospfsimg_change_size(struct ospfs_image *img, ospfs_inode_t *oi, uint32_t new_size)
+{
+	uint32_t old_size = oi->oi_size;
+	uint32_t old_n, new_n = size2nblocks(new_size);
+	uint32_t n, *slot;
+	int r;
+
+	if (new_size > OSPFS_MAXFILESIZE)
+		return -ENOSPC;
+	if (is_inline(oi)) {
+		if (new_size <= OSPFS_INLINE_MAX) {
+			if (new_size < old_size)
+				memset((uint8_t *) oi->oi_direct + new_size, 0, old_size - new_size);
+			goto done;
+		}
+		if ((r = uninline(img, oi)) < 0)
+			return r;
+	}
+	old_n = size2nblocks(old_size);
+
+	for (n = old_n; n < new_n; n++) {
+		if (!(slot = bmap_slot(img, oi, n, 1))
+		    || !(*slot = alloc_zeroed(img))) {
+			// Give back everything we allocated
+			oi->oi_size = n * OSPFS_BLKSIZE;
+			ospfsimg_change_size(img, oi, old_size);
+			free_indirect(img, oi, old_n);
+			return -ENOSPC;
+		}
+	}
+
+	for (n = old_n; n > new_n; n--)
+		if ((slot = bmap_slot(img, oi, n - 1, 0)) && *slot) {
+			ospfsimg_free_block(img, *slot);
+			*slot = 0;
+		}
+	if (new_n < old_n)
+		free_indirect(img, oi, new_n);
+
+    done:
+	if (new_size != old_size)
+		ospfsimg_touch(oi, 1);
+	oi->oi_size = new_size;
+	return 0;
+}
+
+static ssize_t
+inode_io(struct ospfs_image *img, uint32_t ino, void *buf, size_t n, uint32_t off, int write)
+{
+	ospfs_inode_t *oi = ospfsimg_inode(img, ino);
+	size_t amount = 0;
+	int r;
+
+	if (!oi || oi->oi_nlink == 0 || oi->oi_ftype == OSPFS_FTYPE_SYMLINK)
+		return -EINVAL;
+	if (write && off + n > oi->oi_size
+	    && (r = ospfsimg_change_size(img, oi, off + n)) < 0)
+		return r;
+	if (!write && off + n > oi->oi_size)
+		n = off < oi->oi_size ? oi->oi_size - off : 0;
+
+	if (is_inline(oi)) {
+		uint8_t *data = (uint8_t *) oi->oi_direct + off;
+		if (write)
+			memcpy(data, buf, n);
+		else
+			memcpy(buf, data, n);
+		amount = n;
+		goto done;
+	}
+
+	while (amount < n) {
+		uint32_t b = ospfsimg_blockno(img, oi, off / OSPFS_BLKSIZE);
+		uint32_t blkoff = off % OSPFS_BLKSIZE;
+		size_t m = OSPFS_BLKSIZE - blkoff;
+		uint8_t *data;
+		if (m > n - amount)
+			m = n - amount;
+		if (!b)
+			return -EIO;
+		data = (uint8_t *) ospfsimg_block(img, b) + blkoff;
+		if (write)
+			memcpy(data, (const uint8_t *) buf + amount, m);
+		else
+			memcpy((uint8_t *) buf + amount, data, m);
+		amount += m;
+		off += m;
+	}
+    done:
+	if (write && amount)
+		ospfsimg_touch(oi, 1);
+	return amount;
+}
+
+ssize_t
+ospfsimg_read(struct ospfs_image *img, uint32_t ino, void *buf, size_t n, uint32_t off)
+{
+	return inode_io(img, ino, buf, n, off, 0);
+}
+
+ssize_t
+ospfsimg_write(struct ospfs_image *img, uint32_t ino, const void *buf, size_t n, uint32_t off)
+{
+	return inode_io(img, ino, (void *) buf, n, off, 1);
+}
+
+
+/****************************************************************************
+ * DIRECTORIES
+ */
+
+static ospfs_direntry_t *
+direntry_at(struct ospfs_image *img, ospfs_inode_t *dir_oi, uint32_t off)
+{
+	uint32_t b = ospfsimg_blockno(img, dir_oi, off / OSPFS_BLKSIZE);
+	if (!b)
+		return NULL;
+	return (ospfs_direntry_t *) ((uint8_t *) ospfsimg_block(img, b) + off % OSPFS_BLKSIZE);
+}
+
+ospfs_direntry_t *
+ospfsimg_lookup(struct ospfs_image *img, uint32_t dir_ino, const char *name)
+{
+	ospfs_inode_t *dir_oi = ospfsimg_inode(img, dir_ino);
+	uint32_t off;
+
+	if (!dir_oi || dir_oi->oi_ftype != OSPFS_FTYPE_DIR)
+		return NULL;
+	for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
+		ospfs_direntry_t *od = direntry_at(img, dir_oi, off);
+		if (od && od->od_ino && strcmp(od->od_name, name) == 0)
+			return od;
+	}
+	return NULL;
+}
+
+// ospfsimg_create(img, dir_ino, name, mode)
+//	Creates an empty regular file.  Returns its inode number, or a
+//	negative error code.
+
+int
+ospfsimg_create(struct ospfs_image *img, uint32_t dir_ino, const char *name, uint32_t mode)
+{
+	ospfs_inode_t *dir_oi = ospfsimg_inode(img, dir_ino);
+	ospfs_direntry_t *od = NULL;
+	ospfs_inode_t *oi;
+	uint32_t off, ino;
+	int r;
+
+	if (!dir_oi || dir_oi->oi_ftype != OSPFS_FTYPE_DIR)
+		return -ENOTDIR;
+	if (strlen(name) > OSPFS_MAXNAMELEN)
+		return -ENAMETOOLONG;
+	if (ospfsimg_lookup(img, dir_ino, name))
+		return -EEXIST;
+
+	for (ino = OSPFS_ROOT_INO + 1; ino < img->super->os_ninodes; ino++) {
+		ospfs_inode_t *oi = ospfsimg_inode(img, ino);
+		if (oi->oi_nlink == 0 && oi->oi_ftype != OSPFS_FTYPE_ORPHAN)
+			break;
+	}
+	if (ino == img->super->os_ninodes)
+		return -ENOSPC;
+
+	for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
+		od = direntry_at(img, dir_oi, off);
+		if (od && od->od_ino == 0)
+			break;
+	}
+	if (off >= dir_oi->oi_size) {
+		off = dir_oi->oi_size;
+		if ((r = ospfsimg_change_size(img, dir_oi, off + OSPFS_BLKSIZE)) < 0)
+			return r;
+		od = direntry_at(img, dir_oi, off);
+	}
+
+	oi = ospfsimg_inode(img, ino);
+	memset(oi, 0, sizeof(*oi));
+	oi->oi_ftype = OSPFS_FTYPE_REG;
+	oi->oi_nlink = 1;
+	oi->oi_mode = mode;
+	ospfsimg_touch(oi, 1);
+	oi->oi_atime = oi->oi_mtime;
+
+	memset(od, 0, sizeof(*od));
+	od->od_ino = ino;
+	strcpy(od->od_name, name);
+	ospfsimg_touch(dir_oi, 1);
+	return ino;
+}
+
+int
+ospfsimg_unlink(struct ospfs_image *img, uint32_t dir_ino, const char *name)
+{
+	ospfs_direntry_t *od = ospfsimg_lookup(img, dir_ino, name);
+	ospfs_inode_t *oi;
+
+	if (!od)
+		return -ENOENT;
+	oi = ospfsimg_inode(img, od->od_ino);
+	od->od_ino = 0;
+	ospfsimg_touch(ospfsimg_inode(img, dir_ino), 1);
+	if (--oi->oi_nlink == 0) {
+		if (oi->oi_ftype != OSPFS_FTYPE_SYMLINK) {
+			ospfsimg_change_size(img, oi, 0);
+			if (oi->oi_xattr)
+				ospfsimg_free_block(img, oi->oi_xattr);
+		}
+		memset(oi, 0, sizeof(*oi));
+	} else
+		ospfsimg_touch(oi, 0);
+	return 0;
+}
+
+
+/****************************************************************************
+ * IMAGE DIGESTS
+ */
+
+// ospfsimg_live(img, blockno)
+//	Returns nonzero if block 'blockno' holds anything: it is metadata
+//	(boot sector through the inode table) or allocated.
+
+int
+ospfsimg_live(struct ospfs_image *img, uint32_t blockno)
+{
+	return blockno < img->firstdatab || !ospfsimg_block_free(img, blockno);
+}
+
+// ospfsimg_digest(img, digest)
+//	Computes an MD5 digest of every live block of 'img', in block order.
+//	The free-block bitmap is itself live, so two images have the same
+//	digest exactly when they hold the same blocks with the same contents;
+//	whatever is left in free blocks doesn't count.
+
+void
+ospfsimg_digest(struct ospfs_image *img, uint8_t digest[16])
+{
+	MD5_CONTEXT ctx;
+	uint32_t b;
+
+	md5_init(&ctx);
+	for (b = 0; b < img->super->os_nblocks; b++)
+		if (ospfsimg_live(img, b))
+			md5_update(&ctx, ospfsimg_block(img, b), OSPFS_BLKSIZE);
+	md5_final(digest, &ctx);
+}
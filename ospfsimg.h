@@ -0,0 +1,102 @@
+#ifndef OSPFSIMG_H
+#define OSPFSIMG_H
+#include <sys/types.h>
+#include <inttypes.h>
+#include "ospfs.h"
+
+/****************************************************************************
+ * ospfsimg
+ *
+ *   A user-space implementation of the core OSPFS operations, working
+ *   directly on an image file produced by ospfsformat.  Tools use it to
+ *   examine and modify images without loading the module.  Block mapping,
+ *   allocation and directory handling follow ospfsmod.c, so an image
+ *   changed here looks like one changed by the module.
+ *
+ *   The image is mapped into memory and used in place, which assumes a
+ *   little-endian host (the same assumption ospfsmod.c makes).
+ *
+ ****************************************************************************/
+
+// Block allocation policies.
+#define OSPFSIMG_FIRSTFIT	0  // Lowest free block, as ospfsmod.c does
+#define OSPFSIMG_NEXTFIT	1  // First free block after the last allocation
+
+struct ospfs_image {
+	int fd;
+	uint8_t *data;		// The mapped image
+	size_t length;		// Image length in bytes
+	ospfs_super_t *super;
+	uint32_t firstdatab;	// First block after the inode table
+	int policy;		// OSPFSIMG_* allocation policy
+	uint32_t nextfit;	// Next-fit cursor
+};
+
+struct ospfs_image *ospfsimg_open(const char *name, int writable);
+void ospfsimg_close(struct ospfs_image *img);
+
+void *ospfsimg_block(struct ospfs_image *img, uint32_t blockno);
+ospfs_inode_t *ospfsimg_inode(struct ospfs_image *img, uint32_t ino);
+uint32_t ospfsimg_blockno(struct ospfs_image *img, ospfs_inode_t *oi, uint32_t n);
+void ospfsimg_touch(ospfs_inode_t *oi, int mtime);
+
+int ospfsimg_block_free(struct ospfs_image *img, uint32_t blockno);
+uint32_t ospfsimg_nfree(struct ospfs_image *img);
+uint32_t ospfsimg_alloc_block(struct ospfs_image *img);
+void ospfsimg_free_block(struct ospfs_image *img, uint32_t blockno);
+
+int ospfsimg_change_size(struct ospfs_image *img, ospfs_inode_t *oi, uint32_t new_size);
+ssize_t ospfsimg_read(struct ospfs_image *img, uint32_t ino, void *buf, size_t n, uint32_t off);
+ssize_t ospfsimg_write(struct ospfs_image *img, uint32_t ino, const void *buf, size_t n, uint32_t off);
+
+ospfs_direntry_t *ospfsimg_lookup(struct ospfs_image *img, uint32_t dir_ino, const char *name);
+int ospfsimg_create(struct ospfs_image *img, uint32_t dir_ino, const char *name, uint32_t mode);
+int ospfsimg_unlink(struct ospfs_image *img, uint32_t dir_ino, const char *name);
+
+int ospfsimg_live(struct ospfs_image *img, uint32_t blockno);
+void ospfsimg_digest(struct ospfs_image *img, uint8_t digest[16]);
+
+
+/****************************************************************************
+ * SEND STREAMS
+ *
+ *   ospfssend describes how to turn one image into another as a stream of
+ *   changed blocks; ospfsreceive applies it.  Everything -- superblock,
+ *   bitmap, inodes, directories and file data -- is a block, so changed
+ *   blocks carry metadata operations as well as data.  Blocks that are
+ *   free in the new image are never sent.
+ *
+ *   A stream is a header followed by extents, each a header and then
+ *   'ose_count' blocks of data starting at block 'ose_start'.  An extent
+ *   with 'ose_count' 0 ends the stream.  Fields are in host order, so
+ *   like the images themselves (see above), streams assume little-endian
+ *   hosts.
+ *
+ *   Both images must have the same geometry.  The header carries digests
+ *   (see ospfsimg_digest) of the base image and of the result, so a
+ *   stream is only applied to the image it was made against, and the
+ *   result can be checked.  A full stream has no base and carries every
+ *   live block.
+ */
+
+#define OSPFS_SEND_MAGIC	"OSPFSSND"
+#define OSPFS_SEND_VERSION	1
+
+#define OSPFS_SEND_FULL		0x1	// No base image
+
+struct ospfs_send_header {
+	char osh_magic[8];		// OSPFS_SEND_MAGIC
+	uint32_t osh_version;		// OSPFS_SEND_VERSION
+	uint32_t osh_flags;		// OSPFS_SEND_* flags
+	uint32_t osh_nblocks;		// Geometry of both images
+	uint32_t osh_ninodes;
+	uint8_t osh_base[16];		// Digest of the base image
+	uint8_t osh_result[16];		// Digest of the result
+};
+
+struct ospfs_send_extent {
+	uint32_t ose_start;		// First block
+	uint32_t ose_count;		// Number of blocks (0 ends the stream)
+};
+
+#endif
@@ -8,17 +8,32 @@
 #include "ospfs.h"
 #include <linux/string.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/namei.h>
+#include <linux/falloc.h>
+#include <linux/xattr.h>
+#include <linux/parser.h>
+#include <linux/mount.h>
+#include <linux/seq_file.h>
+#include <linux/kthread.h>
 #include <asm/uaccess.h>
 #include <linux/kernel.h>
 #include <linux/sched.h>
+#include <linux/proc_fs.h>
+#include <linux/ktime.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/prefetch.h>
 
 // Some useful macros...
 #ifndef MIN
 #define MIN(x, y) ((x < y) ? x : y)
 #endif
+#ifndef MAX
+#define MAX(x, y) ((x > y) ? x : y)
+#endif
 
 /****************************************************************************
  * ospfsmod
@@ -38,14 +53,58 @@
 
 // The actual disk data is just an array of raw memory.
 // The initial array is defined in fsimg.c, based on your 'base' directory.
+// It is init data, copied into 'ospfs_chunks' at load; see IMAGE BACKING.
 extern uint8_t ospfs_data[];
 extern uint32_t ospfs_length;
 
+// The image is used in 2MB chunks, which may or may not be consecutive in
+// memory; see IMAGE BACKING.  'ospfs_chunks[c]' holds blocks
+// [c * OSPFS_CHUNK_BLOCKS, (c + 1) * OSPFS_CHUNK_BLOCKS).
+#define OSPFS_CHUNK_SHIFT	11
+#define OSPFS_CHUNK_BLOCKS	(1U << OSPFS_CHUNK_SHIFT)
+#define OSPFS_CHUNK_SIZE	(OSPFS_CHUNK_BLOCKS * OSPFS_BLKSIZE)
+
+static uint8_t **ospfs_chunks;
+
+// The inode table, consecutive in memory even if its blocks are not
+static ospfs_inode_t *ospfs_inode_table;
+
 // A pointer to the superblock; see ospfs.h for details on the struct.
-static ospfs_super_t * const ospfs_super =
-	(ospfs_super_t *) &ospfs_data[OSPFS_BLKSIZE];
+static ospfs_super_t *ospfs_super;
 
 static int change_size(ospfs_inode_t *oi, uint32_t want_size);
+static int ospfs_uninline(ospfs_inode_t *oi);
+static uint32_t *ospfs_bmap_slot(ospfs_inode_t *oi, uint32_t n, int flags);
+struct ospfs_inode_info;
+static struct ospfs_inode_info *ospfs_get_info(ino_t ino, int create);
+static void ospfs_put_info(struct ospfs_inode_info *ii);
+static void ospfs_da_discard(struct ospfs_inode_info *ii, uint32_t from);
+static int ospfs_init_groups(void);
+static void ospfs_destroy_groups(void);
+static void ospfs_free_inode(ino_t ino);
+static void ospfs_free_file(ospfs_inode_t *oi);
+static void ospfs_discard_note(uint32_t n);
+static void ospfs_add_orphan(ino_t ino);
+static struct workqueue_struct *ospfs_wq;
+static void ospfs_queue_reclaim(void);
+static int ospfs_wait_reclaim(void);
+static uint32_t ospfs_orphan_pending(uint32_t *nblocks);
+static void ospfs_start_scrub(void);
+static void ospfs_stop_scrub(void);
+// Mount options, parsed but not yet applied; see MOUNT OPTIONS
+struct ospfs_mount_opts {
+	int alloc;
+	unsigned int prealloc;
+	unsigned int readahead;
+	unsigned int lookup_cache;
+	int dirindex;
+	unsigned long mem_budget;
+	int inline_data;
+};
+static int ospfs_parse_options(char *options, struct ospfs_mount_opts *o);
+static int ospfs_check_features(int rdonly);
+static void ospfs_apply_options(const struct ospfs_mount_opts *o, int rdonly);
+static int ospfs_rdonly;		// Nonzero while the image is mounted read-only
 static ospfs_direntry_t *find_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen);
 
 
@@ -153,7 +212,37 @@ ospfs_size2nblocks(uint32_t size)
 static void *
 ospfs_block(uint32_t blockno)
 {
-	return &ospfs_data[blockno * OSPFS_BLKSIZE];
+	return ospfs_chunks[blockno >> OSPFS_CHUNK_SHIFT]
+		+ (blockno & (OSPFS_CHUNK_BLOCKS - 1)) * OSPFS_BLKSIZE;
+}
+
+
+// ospfs_freemap_test(blockno), ospfs_freemap_set(blockno),
+// ospfs_freemap_clear(blockno)
+//	Bit operations on the free-block bitmap.  It starts at Block 2 and
+//	can span several blocks, which need not be consecutive in memory.
+
+#define OSPFS_BLKBITS		(OSPFS_BLKSIZE * 8)
+
+static inline int
+ospfs_freemap_test(uint32_t blockno)
+{
+	return bitvector_test(ospfs_block(OSPFS_FREEMAP_BLK + blockno / OSPFS_BLKBITS),
+			      blockno % OSPFS_BLKBITS);
+}
+
+static inline void
+ospfs_freemap_set(uint32_t blockno)
+{
+	bitvector_set(ospfs_block(OSPFS_FREEMAP_BLK + blockno / OSPFS_BLKBITS),
+		      blockno % OSPFS_BLKBITS);
+}
+
+static inline void
+ospfs_freemap_clear(uint32_t blockno)
+{
+	bitvector_clear(ospfs_block(OSPFS_FREEMAP_BLK + blockno / OSPFS_BLKBITS),
+			blockno % OSPFS_BLKBITS);
 }
 
 
@@ -166,11 +255,48 @@ ospfs_block(uint32_t blockno)
 static inline ospfs_inode_t *
 ospfs_inode(ino_t ino)
 {
-	ospfs_inode_t *oi;
 	if (ino >= ospfs_super->os_ninodes)
 		return 0;
-	oi = ospfs_block(ospfs_super->os_firstinob);
-	return &oi[ino];
+	return &ospfs_inode_table[ino];
+}
+
+
+// ospfs_inode_ino(oi)
+//	Returns the inode number of inode 'oi'.
+
+static inline uint32_t
+ospfs_inode_ino(const ospfs_inode_t *oi)
+{
+	return oi - ospfs_inode_table;
+}
+
+
+// ospfs_inode_is_free(oi)
+//	Returns nonzero if inode 'oi' is unused.  (Orphans have no links, but
+//	are still in use; see ospfs.h.)
+
+static inline int
+ospfs_inode_is_free(const ospfs_inode_t *oi)
+{
+	return oi->oi_nlink == 0 && oi->oi_ftype != OSPFS_FTYPE_ORPHAN;
+}
+
+
+// ospfs_is_inline(oi), ospfs_inline_data(oi)
+//	Says whether file 'oi' keeps its data in the inode (see INLINE DATA
+//	in ospfs.h), and where.  Symbolic links use that space for their
+//	target, so they never count as inline.
+
+static inline int
+ospfs_is_inline(ospfs_inode_t *oi)
+{
+	return oi->oi_ftype != OSPFS_FTYPE_SYMLINK && oi->oi_format == OSPFS_FORMAT_INLINE;
+}
+
+static inline uint8_t *
+ospfs_inline_data(ospfs_inode_t *oi)
+{
+	return (uint8_t *) oi->oi_direct;
 }
 
 
@@ -181,25 +307,18 @@ ospfs_inode(ino_t ino)
 //   Inputs:  oi     -- pointer to a OSPFS inode
 //	      offset -- byte offset into that inode
 //   Returns: the block number of the block that contains the 'offset'th byte
-//	      of the file
+//	      of the file, or 0 if that part of the file has no block yet
+//	      (a hole, or data still waiting for delayed allocation)
 
 static inline uint32_t
 ospfs_inode_blockno(ospfs_inode_t *oi, uint32_t offset)
 {
-	uint32_t blockno = offset / OSPFS_BLKSIZE;
-	if (offset >= oi->oi_size || oi->oi_ftype == OSPFS_FTYPE_SYMLINK)
+	uint32_t *slot;
+	if (offset >= oi->oi_size || oi->oi_ftype == OSPFS_FTYPE_SYMLINK
+	    || ospfs_is_inline(oi))
 		return 0;
-	else if (blockno >= OSPFS_NDIRECT + OSPFS_NINDIRECT) {
-		uint32_t blockoff = blockno - (OSPFS_NDIRECT + OSPFS_NINDIRECT);
-		uint32_t *indirect2_block = ospfs_block(oi->oi_indirect2);
-		uint32_t *indirect_block = ospfs_block(indirect2_block[blockoff / OSPFS_NINDIRECT]);
-		return indirect_block[blockoff % OSPFS_NINDIRECT];
-	} else if (blockno >= OSPFS_NDIRECT) {
-		uint32_t *indirect_block = ospfs_block(oi->oi_indirect);
-		return indirect_block[blockno - OSPFS_NDIRECT];
-	} else {
-		return oi->oi_direct[blockno];
-	}
+	slot = ospfs_bmap_slot(oi, offset / OSPFS_BLKSIZE, 0);
+	return slot ? *slot : 0;
 }
 
 
@@ -223,6 +342,500 @@ ospfs_inode_data(ospfs_inode_t *oi, uint32_t offset)
 }
 
 
+// ospfs_get_time(t), ospfs_set_time(t, ts)
+//	Convert between on-disk timestamps and the kernel's.
+
+static inline struct timespec
+ospfs_get_time(const ospfs_time_t *t)
+{
+	struct timespec ts;
+	ts.tv_sec = t->ot_sec;
+	ts.tv_nsec = t->ot_nsec;
+	return ts;
+}
+
+static inline void
+ospfs_set_time(ospfs_time_t *t, struct timespec ts)
+{
+	t->ot_sec = ts.tv_sec;
+	t->ot_nsec = ts.tv_nsec;
+}
+
+
+// ospfs_touch(oi, inode, flags)
+//	Sets the times of 'oi' that 'flags' names (S_ATIME, S_MTIME and/or
+//	S_CTIME) to now, and those of 'inode' too, unless it is NULL.  Works
+//	on symbolic link inodes, which keep their times in the same place.
+
+static void
+ospfs_touch(ospfs_inode_t *oi, struct inode *inode, int flags)
+{
+	struct timespec now = CURRENT_TIME;
+
+	if (flags & S_ATIME)
+		ospfs_set_time(&oi->oi_atime, now);
+	if (flags & S_MTIME)
+		ospfs_set_time(&oi->oi_mtime, now);
+	if (flags & S_CTIME)
+		ospfs_set_time(&oi->oi_ctime, now);
+	if (inode) {
+		if (flags & S_ATIME)
+			inode->i_atime = now;
+		if (flags & S_MTIME)
+			inode->i_mtime = now;
+		if (flags & S_CTIME)
+			inode->i_ctime = now;
+	}
+}
+
+
+/*****************************************************************************
+ * WORKLOAD TRACING
+ *
+ *   If the 'trace' module parameter is set, every operation is appended to
+ *   a ring buffer of 'ospfs_trace_rec_t's (see ospfs.h).  Reading
+ *   /proc/fs/ospfs/trace drains the buffer.  If user space falls behind,
+ *   new records are dropped (and counted in 'trace_dropped') rather than
+ *   overwriting old ones, so a drained trace is always a prefix of what
+ *   happened.
+ */
+
+#define OSPFS_TRACE_NREC	4096	// Must be a power of 2
+
+static bool ospfs_trace_enabled = 0;
+module_param_named(trace, ospfs_trace_enabled, bool, 0644);
+MODULE_PARM_DESC(trace, "Record operations to /proc/fs/ospfs/trace");
+
+static unsigned int ospfs_trace_dropped = 0;
+module_param_named(trace_dropped, ospfs_trace_dropped, uint, 0444);
+MODULE_PARM_DESC(trace_dropped, "Trace records lost because the buffer was full");
+
+static ospfs_trace_rec_t ospfs_trace_buf[OSPFS_TRACE_NREC];
+static unsigned int ospfs_trace_head, ospfs_trace_tail;
+static ktime_t ospfs_trace_epoch;
+static DEFINE_SPINLOCK(ospfs_trace_lock);
+
+// ospfs_trace(op, ino, dir, off, len)
+//	Appends a record to the trace buffer, if tracing is enabled.
+//	See the table in ospfs.h for the meaning of the arguments.
+
+static void
+ospfs_trace(uint32_t op, uint32_t ino, uint32_t dir, uint64_t off, uint32_t len)
+{
+	ospfs_trace_rec_t *rec;
+
+	if (!ospfs_trace_enabled)
+		return;
+
+	spin_lock(&ospfs_trace_lock);
+	if (ospfs_trace_head - ospfs_trace_tail == OSPFS_TRACE_NREC) {
+		ospfs_trace_dropped++;
+		spin_unlock(&ospfs_trace_lock);
+		return;
+	}
+	rec = &ospfs_trace_buf[ospfs_trace_head % OSPFS_TRACE_NREC];
+	rec->otr_time = ktime_to_ns(ktime_sub(ktime_get(), ospfs_trace_epoch));
+	rec->otr_op = op;
+	rec->otr_ino = ino;
+	rec->otr_dir = dir;
+	rec->otr_len = len;
+	rec->otr_off = off;
+	ospfs_trace_head++;
+	spin_unlock(&ospfs_trace_lock);
+}
+
+// ospfs_trace_read
+//	The read callback for /proc/fs/ospfs/trace.  Copies out (and removes)
+//	as many whole records as fit in 'count' bytes.
+
+static ssize_t
+ospfs_trace_read(struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
+{
+	ospfs_trace_rec_t rec;
+	size_t amount = 0;
+
+	while (count - amount >= sizeof(rec)) {
+		spin_lock(&ospfs_trace_lock);
+		if (ospfs_trace_tail == ospfs_trace_head) {
+			spin_unlock(&ospfs_trace_lock);
+			break;
+		}
+		rec = ospfs_trace_buf[ospfs_trace_tail % OSPFS_TRACE_NREC];
+		ospfs_trace_tail++;
+		spin_unlock(&ospfs_trace_lock);
+
+		if (copy_to_user(buffer + amount, &rec, sizeof(rec)) != 0)
+			return amount ? amount : -EFAULT;
+		amount += sizeof(rec);
+	}
+
+	*f_pos += amount;
+	return amount;
+}
+
+
+/*****************************************************************************
+ * MEMORY ACCOUNTING
+ *
+ *   Every object OSPFS allocates (beyond the disk image itself) comes from
+ *   one of the slab caches in 'ospfs_caches', through ospfs_cache_alloc
+ *   and ospfs_cache_free.  Each cache counts its live objects, and their
+ *   total size is held to 'mem_budget' bytes.
+ *
+ *   Caches whose objects can be thrown away and rebuilt have a 'shrink'
+ *   callback.  When an allocation would exceed the budget we shrink those
+ *   caches first; if that doesn't help, allocations for shrinkable caches
+ *   fail (callers treat that as a cache miss), while allocations that
+ *   hold real state always go through.  The same callbacks are hooked up
+ *   to the kernel's shrinker, so the caches also give memory back under
+ *   system-wide pressure.
+ *
+ *   Counters live in /sys/fs/ospfs:
+ *	mem_budget, mem_bytes, mem_objects	-- totals (mem_budget is writable)
+ *	<cache>/objects, <cache>/bytes, <cache>/object_size
+ */
+
+// In-memory state for an inode with open files; see DELAYED ALLOCATION.
+typedef struct ospfs_inode_info {
+	ino_t ii_ino;
+	struct hlist_node ii_hash;	// In 'ospfs_info_hash'
+	int ii_count;			// References; protected by ospfs_info_lock
+
+	struct mutex ii_mutex;		// Protects the rest, and file data
+	struct radix_tree_root ii_dirty;	// File block number -> ospfs_dabuf_t
+	uint32_t ii_ndirty;		// Number of buffers in 'ii_dirty'
+	uint32_t ii_nreserved;		// Free blocks reserved for them
+	uint32_t ii_metatop;		// Indirect blocks are reserved for file
+					// blocks below this
+	uint8_t *ii_tail;		// Buffer the last write stopped inside,
+	uint32_t ii_tail_pos;		// and the file offset where it stopped
+} ospfs_inode_info_t;
+
+// A file block written before a disk block was allocated for it.
+typedef struct ospfs_dabuf {
+	uint32_t db_index;		// File block number
+	uint8_t db_data[OSPFS_BLKSIZE];
+} ospfs_dabuf_t;
+
+// Per-open-file state (the 'private_data' of an OSPFS 'struct file').
+typedef struct ospfs_file_info {
+	ino_t fi_ino;			// Inode this file is open on
+	ospfs_inode_info_t *fi_info;	// Its in-memory state (regular files)
+
+	// Readahead state; see ospfs_readahead
+	uint32_t fi_ra_next;		// Block a sequential reader reads next
+	uint32_t fi_ra_end;		// First block not yet prefetched
+	uint32_t fi_ra_window;		// Current window size in blocks
+
+	// Indexed readdir state; see ospfs_diridx_readdir
+	loff_t fi_dirpos;		// Position the last readdir stopped at
+	char fi_dirname[OSPFS_MAXNAMELEN + 1];	// Name of the entry there
+} ospfs_file_info_t;
+
+// A cached directory lookup; see LOOKUP CACHE.
+typedef struct ospfs_lookup_ent {
+	struct hlist_node le_hash;	// In 'ospfs_lookup_hash'
+	struct list_head le_lru;	// In 'ospfs_lookup_lru', newest first
+	uint32_t le_dir;		// Directory inode number
+	uint32_t le_ino;		// Entry's inode number; 0 if no such entry
+	uint32_t le_namehash;		// full_name_hash of 'le_name'
+	uint32_t le_namelen;
+	char le_name[OSPFS_MAXNAMELEN];	// Not null-terminated
+} ospfs_lookup_ent_t;
+
+// A node of a directory's name index; see DIRECTORY INDEX.
+#define OSPFS_BT_ORDER		32	// Keys per node
+
+typedef struct ospfs_btnode {
+	uint32_t bn_leaf;		// 1 for leaves
+	uint32_t bn_nkeys;
+	// Leaves: offsets of directory entries, in name order.
+	// Internal nodes: offset of the first entry under each child.
+	uint32_t bn_key[OSPFS_BT_ORDER];
+	struct ospfs_btnode *bn_child[OSPFS_BT_ORDER];	// Internal nodes only
+} ospfs_btnode_t;
+
+typedef struct ospfs_diridx {
+	ino_t di_ino;			// Directory inode number
+	struct hlist_node di_hash;	// In 'ospfs_diridx_hash', unless dead
+	int di_count;			// References; protected by ospfs_diridx_lock
+	int di_dead;			// Out of date; freed with the last reference
+	ospfs_btnode_t *di_root;
+	uint32_t di_nnodes;
+} ospfs_diridx_t;
+
+static int ospfs_lookup_shrink(int nr);
+static int ospfs_diridx_shrink(int nr);
+
+struct ospfs_cache {
+	const char *name;		// Name under /sys/fs/ospfs
+	const char *slab_name;		// Name in /proc/slabinfo
+	size_t size;			// Object size
+	// Frees up to 'nr' unused objects and returns the number of unused
+	// objects left.  NULL if objects can't be released on demand.
+	int (*shrink)(int nr);
+
+	struct kmem_cache *cachep;
+	atomic_t nobjs;
+	struct kobject *kobj;
+};
+
+#define OSPFS_CACHE_FILE	0
+#define OSPFS_CACHE_INODE	1
+#define OSPFS_CACHE_DABUF	2
+#define OSPFS_CACHE_LOOKUP	3
+#define OSPFS_CACHE_DIRIDX	4
+#define OSPFS_CACHE_DIRNODE	5
+#define OSPFS_NCACHES		6
+
+static struct ospfs_cache ospfs_caches[OSPFS_NCACHES] = {
+	[OSPFS_CACHE_FILE] = {
+		.name = "file", .slab_name = "ospfs_file",
+		.size = sizeof(ospfs_file_info_t)
+	},
+	[OSPFS_CACHE_INODE] = {
+		.name = "inode", .slab_name = "ospfs_inode",
+		.size = sizeof(ospfs_inode_info_t)
+	},
+	[OSPFS_CACHE_DABUF] = {
+		.name = "delalloc", .slab_name = "ospfs_delalloc",
+		.size = sizeof(ospfs_dabuf_t)
+	},
+	[OSPFS_CACHE_LOOKUP] = {
+		.name = "lookup", .slab_name = "ospfs_lookup",
+		.size = sizeof(ospfs_lookup_ent_t),
+		.shrink = ospfs_lookup_shrink
+	},
+	[OSPFS_CACHE_DIRIDX] = {
+		.name = "dirindex", .slab_name = "ospfs_dirindex",
+		.size = sizeof(ospfs_diridx_t)
+	},
+	// Shrinking drops whole unused indexes, headers included
+	[OSPFS_CACHE_DIRNODE] = {
+		.name = "dirnode", .slab_name = "ospfs_dirnode",
+		.size = sizeof(ospfs_btnode_t),
+		.shrink = ospfs_diridx_shrink
+	}
+};
+
+static unsigned long ospfs_mem_budget = 16 << 20;
+static atomic_long_t ospfs_mem_bytes = ATOMIC_LONG_INIT(0);
+
+// ospfs_shrink_caches(nr)
+//	Asks every shrinkable cache to release up to 'nr' unused objects.
+//	Returns the number of releasable objects left.
+
+static int
+ospfs_shrink_caches(int nr)
+{
+	int i, left = 0;
+	for (i = 0; i < OSPFS_NCACHES; i++)
+		if (ospfs_caches[i].shrink)
+			left += ospfs_caches[i].shrink(nr);
+	return left;
+}
+
+// ospfs_cache_alloc(cache, gfp)
+//	Allocates an object from 'ospfs_caches[cache]', charging it against
+//	the memory budget.  Returns NULL if memory is short, or if the cache is
+//	shrinkable and the budget is used up.
+
+static void *
+ospfs_cache_alloc(int cache, gfp_t gfp)
+{
+	struct ospfs_cache *c = &ospfs_caches[cache];
+	void *obj;
+
+	if (atomic_long_read(&ospfs_mem_bytes) + c->size > ospfs_mem_budget) {
+		ospfs_shrink_caches(32);
+		if (c->shrink
+		    && atomic_long_read(&ospfs_mem_bytes) + c->size > ospfs_mem_budget)
+			return NULL;
+	}
+
+	if ((obj = kmem_cache_alloc(c->cachep, gfp))) {
+		atomic_inc(&c->nobjs);
+		atomic_long_add(c->size, &ospfs_mem_bytes);
+	}
+	return obj;
+}
+
+static void
+ospfs_cache_free(int cache, void *obj)
+{
+	struct ospfs_cache *c = &ospfs_caches[cache];
+	kmem_cache_free(c->cachep, obj);
+	atomic_dec(&c->nobjs);
+	atomic_long_sub(c->size, &ospfs_mem_bytes);
+}
+
+// ospfs_shrink(nr_to_scan, gfp_mask)
+//	The kernel's memory-pressure callback.
+
+static int
+ospfs_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	// The cache locks may be held by an allocation that got us here
+	if (nr_to_scan && !(gfp_mask & __GFP_FS))
+		return -1;
+	return ospfs_shrink_caches(nr_to_scan);
+}
+
+static struct shrinker ospfs_shrinker = {
+	.shrink = ospfs_shrink,
+	.seeks = DEFAULT_SEEKS
+};
+
+
+// sysfs attributes
+
+static struct kobject *ospfs_kobj;
+
+static struct ospfs_cache *
+ospfs_kobj_cache(struct kobject *kobj)
+{
+	int i;
+	for (i = 0; i < OSPFS_NCACHES; i++)
+		if (ospfs_caches[i].kobj == kobj)
+			return &ospfs_caches[i];
+	return NULL;
+}
+
+static ssize_t
+ospfs_attr_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct ospfs_cache *c = ospfs_kobj_cache(kobj);
+	const char *name = attr->attr.name;
+	unsigned long objs = 0;
+	int i;
+
+	if (c && strcmp(name, "objects") == 0)
+		return sprintf(buf, "%d\n", atomic_read(&c->nobjs));
+	else if (c && strcmp(name, "bytes") == 0)
+		return sprintf(buf, "%lu\n", (unsigned long) atomic_read(&c->nobjs) * c->size);
+	else if (c && strcmp(name, "object_size") == 0)
+		return sprintf(buf, "%lu\n", (unsigned long) c->size);
+	else if (strcmp(name, "mem_budget") == 0)
+		return sprintf(buf, "%lu\n", ospfs_mem_budget);
+	else if (strcmp(name, "mem_bytes") == 0)
+		return sprintf(buf, "%ld\n", atomic_long_read(&ospfs_mem_bytes));
+	else if (strcmp(name, "mem_objects") == 0) {
+		for (i = 0; i < OSPFS_NCACHES; i++)
+			objs += atomic_read(&ospfs_caches[i].nobjs);
+		return sprintf(buf, "%lu\n", objs);
+	}
+	return -EINVAL;
+}
+
+// ospfs_set_mem_budget(budget)
+//	Changes the memory budget, shrinking the caches right away if they
+//	are over the new one.
+
+static void
+ospfs_set_mem_budget(unsigned long budget)
+{
+	ospfs_mem_budget = budget;
+	while (atomic_long_read(&ospfs_mem_bytes) > ospfs_mem_budget
+	       && ospfs_shrink_caches(64) > 0)
+		/* keep going */;
+}
+
+static ssize_t
+ospfs_attr_store(struct kobject *kobj, struct kobj_attribute *attr,
+		 const char *buf, size_t count)
+{
+	char *end;
+	unsigned long budget = simple_strtoul(buf, &end, 0);
+
+	if (end == buf || (*end && *end != '\n'))
+		return -EINVAL;
+	ospfs_set_mem_budget(budget);
+	return count;
+}
+
+static struct kobj_attribute ospfs_attr_mem_budget =
+	__ATTR(mem_budget, 0644, ospfs_attr_show, ospfs_attr_store);
+static struct kobj_attribute ospfs_attr_mem_bytes =
+	__ATTR(mem_bytes, 0444, ospfs_attr_show, NULL);
+static struct kobj_attribute ospfs_attr_mem_objects =
+	__ATTR(mem_objects, 0444, ospfs_attr_show, NULL);
+static struct kobj_attribute ospfs_attr_objects =
+	__ATTR(objects, 0444, ospfs_attr_show, NULL);
+static struct kobj_attribute ospfs_attr_bytes =
+	__ATTR(bytes, 0444, ospfs_attr_show, NULL);
+static struct kobj_attribute ospfs_attr_object_size =
+	__ATTR(object_size, 0444, ospfs_attr_show, NULL);
+
+static struct attribute *ospfs_mem_attrs[] = {
+	&ospfs_attr_mem_budget.attr,
+	&ospfs_attr_mem_bytes.attr,
+	&ospfs_attr_mem_objects.attr,
+	NULL
+};
+
+static struct attribute *ospfs_cache_attrs[] = {
+	&ospfs_attr_objects.attr,
+	&ospfs_attr_bytes.attr,
+	&ospfs_attr_object_size.attr,
+	NULL
+};
+
+static struct attribute_group ospfs_mem_attr_group = { .attrs = ospfs_mem_attrs };
+static struct attribute_group ospfs_cache_attr_group = { .attrs = ospfs_cache_attrs };
+
+static void ospfs_destroy_caches(void);
+
+// ospfs_init_caches
+//	Creates the slab caches and their sysfs directories at module load.
+
+static int
+ospfs_init_caches(void)
+{
+	struct ospfs_cache *c;
+	int i;
+
+	if (!(ospfs_kobj = kobject_create_and_add("ospfs", fs_kobj))
+	    || sysfs_create_group(ospfs_kobj, &ospfs_mem_attr_group) < 0)
+		goto fail;
+
+	for (i = 0; i < OSPFS_NCACHES; i++) {
+		c = &ospfs_caches[i];
+		atomic_set(&c->nobjs, 0);
+		c->cachep = kmem_cache_create(c->slab_name, c->size, 0,
+					      SLAB_HWCACHE_ALIGN | SLAB_RECLAIM_ACCOUNT, NULL);
+		if (!c->cachep
+		    || !(c->kobj = kobject_create_and_add(c->name, ospfs_kobj))
+		    || sysfs_create_group(c->kobj, &ospfs_cache_attr_group) < 0)
+			goto fail;
+	}
+	return 0;
+
+    fail:
+	ospfs_destroy_caches();
+	return -ENOMEM;
+}
+
+static void
+ospfs_destroy_caches(void)
+{
+	struct ospfs_cache *c;
+	int i;
+
+	for (i = 0; i < OSPFS_NCACHES; i++) {
+		c = &ospfs_caches[i];
+		if (c->kobj)
+			kobject_put(c->kobj);
+		if (c->cachep)
+			kmem_cache_destroy(c->cachep);
+		c->kobj = NULL;
+		c->cachep = NULL;
+	}
+	if (ospfs_kobj)
+		kobject_put(ospfs_kobj);
+	ospfs_kobj = NULL;
+}
+
+
 /*****************************************************************************
  * LOW-LEVEL FILE SYSTEM FUNCTIONS
  * There are no exercises in this section, and you don't need to understand
@@ -283,8 +896,9 @@ ospfs_mk_linux_inode(struct super_block *sb, ino_t ino)
 	} else
 		panic("OSPFS: unknown inode type!");
 
-	// Access and modification times are now.
-	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME;
+	inode->i_atime = ospfs_get_time(&oi->oi_atime);
+	inode->i_mtime = ospfs_get_time(&oi->oi_mtime);
+	inode->i_ctime = ospfs_get_time(&oi->oi_ctime);
 	return inode;
 }
 
@@ -297,20 +911,42 @@ ospfs_mk_linux_inode(struct super_block *sb, ino_t ino)
 static int
 ospfs_fill_super(struct super_block *sb, void *data, int flags)
 {
+	struct ospfs_mount_opts o;
 	struct inode *root_inode;
+	int r;
 
 	sb->s_blocksize = OSPFS_BLKSIZE;
 	sb->s_blocksize_bits = OSPFS_BLKSIZE_BITS;
 	sb->s_magic = OSPFS_MAGIC;
 	sb->s_op = &ospfs_superblock_ops;
+	sb->s_time_gran = 1;
+	if (ospfs_super->os_magic != OSPFS_MAGIC) {
+		eprintk("OSPFS: bad magic number %08x%s\n", ospfs_super->os_magic,
+			ospfs_super->os_magic == OSPFS_MAGIC_V1
+			? " (64-byte inodes; rebuild the image)" : "");
+		return -EINVAL;
+	}
+	if ((r = ospfs_parse_options(data, &o)) < 0
+	    || (r = ospfs_check_features(sb->s_flags & MS_RDONLY)) < 0)
+		return r;
+	if (ospfs_init_groups() < 0)
+		return -ENOMEM;
+	// Finish off files unlinked before the last unmount
+	if (ospfs_super->os_orphan && !(sb->s_flags & MS_RDONLY))
+		ospfs_queue_reclaim();
 
 	if (!(root_inode = ospfs_mk_linux_inode(sb, OSPFS_ROOT_INO))
 	    || !(sb->s_root = d_alloc_root(root_inode))) {
 		iput(root_inode);
+		// The reclaim worker may be freeing blocks through the groups
+		flush_workqueue(ospfs_wq);
+		ospfs_destroy_groups();
 		sb->s_dev = 0;
 		return -ENOMEM;
 	}
 
+	ospfs_apply_options(&o, sb->s_flags & MS_RDONLY);
+	ospfs_start_scrub();
 	return 0;
 }
 
@@ -332,87 +968,771 @@ ospfs_delete_dentry(struct dentry *dentry)
 
 
 /*****************************************************************************
- * DIRECTORY OPERATIONS
+ * LOOKUP CACHE
  *
- * EXERCISE: Finish 'ospfs_dir_readdir' and 'ospfs_symlink'.
+ *   Every path component is resolved by ospfs_dir_lookup, which otherwise
+ *   scans the whole directory, and since ospfs_delete_dentry keeps the
+ *   dcache from holding on to unused dentries, the same deep paths are
+ *   scanned over and over.  This cache maps (directory inode, name)
+ *   straight to the entry's inode number, so a repeated lookup is one
+ *   hash probe.  Misses are cached too (as inode 0), which makes repeated
+ *   searches along $PATH-like lists cheap.
+ *
+ *   Entries are invalidated precisely: every operation that adds or
+ *   clears a directory entry forgets that (directory, name) pair.
+ *   ospfs_rmtree, which frees whole directories whose inode numbers can
+ *   be reused, empties the cache instead.
+ *
+ *   Entries come from the "lookup" cache under MEMORY ACCOUNTING, which
+ *   can shrink it; 'lookup_cache' caps the number of entries (0 turns the
+ *   cache off).  Directory changes are serialized by the VFS's i_mutex on
+ *   the directory; 'ospfs_lookup_lock' protects the table itself.
  */
 
-// ospfs_dir_lookup(dir, dentry, ignore)
-//	This function implements the "lookup" directory operation, which
-//	looks up a named entry.
-//
-//	We have written this function for you.
-//
-//   Input:  dir    -- The Linux 'struct inode' for the directory.
-//		       You can extract the corresponding 'ospfs_inode_t'
-//		       by calling 'ospfs_inode' with the relevant inode number.
-//	     dentry -- The name of the entry being looked up.
-//   Effect: Looks up the entry named 'dentry'.  If found, attaches the
-//	     entry's 'struct inode' to the 'dentry'.  If not found, returns
-//	     a "negative dentry", which has no inode attachment.
+#define OSPFS_LOOKUP_HASHBITS	10
 
-static struct dentry *
-ospfs_dir_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *ignore)
+static struct hlist_head ospfs_lookup_hash[1 << OSPFS_LOOKUP_HASHBITS];
+static LIST_HEAD(ospfs_lookup_lru);
+static DEFINE_SPINLOCK(ospfs_lookup_lock);
+static unsigned int ospfs_lookup_nents;
+
+static unsigned int ospfs_lookup_max = 8192;
+module_param_named(lookup_cache, ospfs_lookup_max, uint, 0644);
+MODULE_PARM_DESC(lookup_cache, "Maximum number of cached directory lookups");
+
+static unsigned long ospfs_lookup_hits;
+module_param_named(lookup_hits, ospfs_lookup_hits, ulong, 0444);
+MODULE_PARM_DESC(lookup_hits, "Directory lookups answered from the cache");
+
+static inline struct hlist_head *
+ospfs_lookup_bucket(uint32_t dir, uint32_t namehash)
 {
-	// Find the OSPFS inode corresponding to 'dir'
-	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
-	struct inode *entry_inode = NULL;
-	int entry_off;
+	uint32_t h = (namehash ^ dir) * 0x9E370001U;
+	return &ospfs_lookup_hash[h >> (32 - OSPFS_LOOKUP_HASHBITS)];
+}
 
-	// Make sure filename is not too long
-	if (dentry->d_name.len > OSPFS_MAXNAMELEN)
-		return (struct dentry *) ERR_PTR(-ENAMETOOLONG);
+// ospfs_lookup_find(dir, name, namelen, namehash)
+//	Returns the cached entry for 'name' in directory 'dir', or NULL.
+//	Call with 'ospfs_lookup_lock' held.
 
-	// Mark with our operations
-	dentry->d_op = &ospfs_dentry_ops;
+static ospfs_lookup_ent_t *
+ospfs_lookup_find(uint32_t dir, const char *name, int namelen, uint32_t namehash)
+{
+	struct hlist_node *pos;
+	ospfs_lookup_ent_t *le;
+
+	hlist_for_each_entry(le, pos, ospfs_lookup_bucket(dir, namehash), le_hash)
+		if (le->le_dir == dir && le->le_namehash == namehash
+		    && le->le_namelen == namelen
+		    && memcmp(le->le_name, name, namelen) == 0)
+			return le;
+	return NULL;
+}
 
-	// Search through the directory block
-	for (entry_off = 0; entry_off < dir_oi->oi_size;
-	     entry_off += OSPFS_DIRENTRY_SIZE) {
-		// Find the OSPFS inode for the entry
-		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, entry_off);
+// Call with 'ospfs_lookup_lock' held.
+static void
+ospfs_lookup_drop(ospfs_lookup_ent_t *le)
+{
+	hlist_del(&le->le_hash);
+	list_del(&le->le_lru);
+	ospfs_lookup_nents--;
+}
 
-		// Set 'entry_inode' if we find the file we are looking for
-		if (od->od_ino > 0
-		    && strlen(od->od_name) == dentry->d_name.len
-		    && memcmp(od->od_name, dentry->d_name.name, dentry->d_name.len) == 0) {
-			entry_inode = ospfs_mk_linux_inode(dir->i_sb, od->od_ino);
-			if (!entry_inode)
-				return (struct dentry *) ERR_PTR(-EINVAL);
-			break;
-		}
+// ospfs_lookup_get(dir, name, namelen, ino)
+//	Looks up 'name' in directory 'dir' in the cache.  On a hit, sets
+//	'*ino' to the entry's inode number (0 if the name is known not to
+//	exist) and returns 1.  Returns 0 on a miss.
+
+static int
+ospfs_lookup_get(uint32_t dir, const char *name, int namelen, uint32_t *ino)
+{
+	uint32_t namehash = full_name_hash(name, namelen);
+	ospfs_lookup_ent_t *le;
+
+	spin_lock(&ospfs_lookup_lock);
+	if ((le = ospfs_lookup_find(dir, name, namelen, namehash))) {
+		list_move(&le->le_lru, &ospfs_lookup_lru);
+		*ino = le->le_ino;
+		ospfs_lookup_hits++;
 	}
+	spin_unlock(&ospfs_lookup_lock);
+	return le != NULL;
+}
 
-	// We return a dentry whether or not the file existed.
-	// The file exists if and only if 'entry_inode != NULL'.
-	// If the file doesn't exist, the dentry is called a "negative dentry".
+// ospfs_lookup_add(dir, name, namelen, ino)
+//	Records that 'name' in directory 'dir' is inode 'ino' (0 if it does
+//	not exist).  Evicts the least recently used entries to stay under
+//	'lookup_cache'.  Failing to allocate an entry is harmless.
 
-	// d_splice_alias() attaches the inode to the dentry.
-	// If it returns a new dentry, we need to set its operations.
-	if ((dentry = d_splice_alias(entry_inode, dentry)))
-		dentry->d_op = &ospfs_dentry_ops;
-	return dentry;
+static void
+ospfs_lookup_add(uint32_t dir, const char *name, int namelen, uint32_t ino)
+{
+	uint32_t namehash = full_name_hash(name, namelen);
+	ospfs_lookup_ent_t *le, *old;
+
+	if (!ospfs_lookup_max
+	    || !(le = ospfs_cache_alloc(OSPFS_CACHE_LOOKUP, GFP_KERNEL)))
+		return;
+	le->le_dir = dir;
+	le->le_ino = ino;
+	le->le_namehash = namehash;
+	le->le_namelen = namelen;
+	memcpy(le->le_name, name, namelen);
+
+	spin_lock(&ospfs_lookup_lock);
+	if ((old = ospfs_lookup_find(dir, name, namelen, namehash)))
+		ospfs_lookup_drop(old);
+	hlist_add_head(&le->le_hash, ospfs_lookup_bucket(dir, namehash));
+	list_add(&le->le_lru, &ospfs_lookup_lru);
+	ospfs_lookup_nents++;
+	if (ospfs_lookup_nents > ospfs_lookup_max) {
+		le = list_entry(ospfs_lookup_lru.prev, ospfs_lookup_ent_t, le_lru);
+		ospfs_lookup_drop(le);
+	} else
+		le = NULL;
+	spin_unlock(&ospfs_lookup_lock);
+
+	if (old)
+		ospfs_cache_free(OSPFS_CACHE_LOOKUP, old);
+	if (le)
+		ospfs_cache_free(OSPFS_CACHE_LOOKUP, le);
 }
 
+// ospfs_lookup_forget(dir, name, namelen)
+//	Drops any cached lookup of 'name' in directory 'dir'.  Called
+//	whenever that directory entry is created or cleared.
 
-// ospfs_dir_readdir(filp, dirent, filldir)
-//   This function is called when the kernel reads the contents of a directory
-//   (i.e. when file_operations.readdir is called for the inode).
-//
-//   Inputs:  filp	-- The 'struct file' structure correspoding to
-//			   the open directory.
-//			   The most important member is 'filp->f_pos', the
-//			   File POSition.  This remembers how far into the
-//			   directory we are, so if the user calls 'readdir'
-//			   twice, we don't forget our position.
-//			   This function must update 'filp->f_pos'.
-//	      dirent	-- Used to pass to 'filldir'.
-//	      filldir	-- A pointer to a callback function.
-//			   This function should call 'filldir' once for each
-//			   directory entry, passing it six arguments:
-//		  (1) 'dirent'.
-//		  (2) The directory entry's name.
-//		  (3) The length of the directory entry's name.
+static void
+ospfs_lookup_forget(uint32_t dir, const char *name, int namelen)
+{
+	uint32_t namehash = full_name_hash(name, namelen);
+	ospfs_lookup_ent_t *le;
+
+	spin_lock(&ospfs_lookup_lock);
+	if ((le = ospfs_lookup_find(dir, name, namelen, namehash)))
+		ospfs_lookup_drop(le);
+	spin_unlock(&ospfs_lookup_lock);
+	if (le)
+		ospfs_cache_free(OSPFS_CACHE_LOOKUP, le);
+}
+
+// ospfs_lookup_shrink(nr)
+//	Drops up to 'nr' of the least recently used entries; the
+//	OSPFS_CACHE_LOOKUP shrink callback.  ospfs_lookup_purge drops them all.
+
+static int
+ospfs_lookup_shrink(int nr)
+{
+	ospfs_lookup_ent_t *le;
+	int left;
+
+	spin_lock(&ospfs_lookup_lock);
+	while (nr-- > 0 && !list_empty(&ospfs_lookup_lru)) {
+		le = list_entry(ospfs_lookup_lru.prev, ospfs_lookup_ent_t, le_lru);
+		ospfs_lookup_drop(le);
+		// Freeing doesn't take the lock
+		ospfs_cache_free(OSPFS_CACHE_LOOKUP, le);
+	}
+	left = ospfs_lookup_nents;
+	spin_unlock(&ospfs_lookup_lock);
+	return left;
+}
+
+static void
+ospfs_lookup_purge(void)
+{
+	while (ospfs_lookup_shrink(256) > 0)
+		cond_resched();
+}
+
+
+/*****************************************************************************
+ * DIRECTORY INDEX
+ *
+ *   On disk a directory is an unsorted array of entries, so finding a name
+ *   means scanning it, and readdir lists entries in slot order, which
+ *   depends on which slots were free when they were created.  With the
+ *   'dirindex' parameter set, each directory in use gets an in-memory
+ *   B+tree keyed by name, built from the entries the first time it is
+ *   needed.  Lookups, and the existence checks in link and symlink, then
+ *   take O(log n) name comparisons, and readdir lists the directory in
+ *   name order (memcmp order, shorter names first on a tie).
+ *
+ *   Keys are the byte offsets of directory entries; names are compared
+ *   in place.  Each internal-node key is the first entry under that
+ *   child, so it always names a live entry.  Nodes are split when full
+ *   but never merged; a node is freed when its last key goes, so the tree
+ *   is as deep as the directory was at its largest.
+ *
+ *   Every operation that fills or clears a directory entry updates the
+ *   directory's index, if it has one, under the directory's i_mutex, the
+ *   lock that already serializes changes to the directory.  If an update
+ *   can't get memory, the index is thrown away and rebuilt on next use.
+ *   Unused indexes are cached (see the "dirindex" and "dirnode" caches
+ *   under MEMORY ACCOUNTING) and dropped under memory pressure.
+ *
+ *   The on-disk format does not change, so indexed and unindexed mounts
+ *   of an image are interchangeable.
+ */
+
+static bool ospfs_dirindex = 0;
+module_param_named(dirindex, ospfs_dirindex, bool, 0644);
+MODULE_PARM_DESC(dirindex, "Index directories by name and list them in name order");
+
+#define OSPFS_DIRIDX_HASHBITS	8
+
+static struct hlist_head ospfs_diridx_hash[1 << OSPFS_DIRIDX_HASHBITS];
+static DEFINE_SPINLOCK(ospfs_diridx_lock);
+
+// ospfs_bt_cmp(dir_oi, off, name, namelen)
+//	Compares the name of the entry at byte 'off' of 'dir_oi' with 'name',
+//	returning <0, 0 or >0 like memcmp.
+
+static int
+ospfs_bt_cmp(ospfs_inode_t *dir_oi, uint32_t off, const char *name, int namelen)
+{
+	ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off);
+	int len = strlen(od->od_name);
+	int r = memcmp(od->od_name, name, MIN(len, namelen));
+	return r ? r : len - namelen;
+}
+
+// ospfs_bt_rank(dir_oi, bn, name, namelen, le)
+//	Returns the number of keys in 'bn' that sort before 'name' (or equal
+//	to it, if 'le' is set).
+
+static uint32_t
+ospfs_bt_rank(ospfs_inode_t *dir_oi, ospfs_btnode_t *bn,
+	      const char *name, int namelen, int le)
+{
+	uint32_t lo = 0, hi = bn->bn_nkeys, mid;
+	int c;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		c = ospfs_bt_cmp(dir_oi, bn->bn_key[mid], name, namelen);
+		if (c < 0 || (le && c == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// ospfs_bt_next(dir_oi, bn, name, namelen, strict)
+//	Returns 1 plus the offset of the first entry under 'bn' named 'name'
+//	or sorting after it (only after it, if 'strict' is set), or 0 if
+//	there is none.
+
+static uint32_t
+ospfs_bt_next(ospfs_inode_t *dir_oi, ospfs_btnode_t *bn,
+	      const char *name, int namelen, int strict)
+{
+	uint32_t i, later = 0;
+
+	while (!bn->bn_leaf) {
+		i = ospfs_bt_rank(dir_oi, bn, name, namelen, 1);
+		// Everything under 'bn' sorts after 'name'
+		if (i == 0)
+			return bn->bn_key[0] + 1;
+		// Failing child i - 1, the answer is child i's first entry
+		if (i < bn->bn_nkeys)
+			later = bn->bn_key[i] + 1;
+		bn = bn->bn_child[i - 1];
+	}
+	i = ospfs_bt_rank(dir_oi, bn, name, namelen, strict);
+	return i < bn->bn_nkeys ? bn->bn_key[i] + 1 : later;
+}
+
+static ospfs_btnode_t *
+ospfs_bt_alloc(ospfs_diridx_t *di, int leaf)
+{
+	ospfs_btnode_t *bn = ospfs_cache_alloc(OSPFS_CACHE_DIRNODE, GFP_KERNEL);
+	if (bn) {
+		bn->bn_leaf = leaf;
+		bn->bn_nkeys = 0;
+		di->di_nnodes++;
+	}
+	return bn;
+}
+
+static void
+ospfs_bt_free(ospfs_diridx_t *di, ospfs_btnode_t *bn)
+{
+	uint32_t i;
+	if (!bn->bn_leaf)
+		for (i = 0; i < bn->bn_nkeys; i++)
+			ospfs_bt_free(di, bn->bn_child[i]);
+	ospfs_cache_free(OSPFS_CACHE_DIRNODE, bn);
+	di->di_nnodes--;
+}
+
+// ospfs_bt_insert(di, dir_oi, bn, off, name, namelen)
+//	Inserts the entry at 'off', named 'name', under 'bn'.  Returns the new
+//	right sibling if 'bn' had to be split, NULL if not, or an error
+//	pointer if memory ran out.
+
+static ospfs_btnode_t *
+ospfs_bt_insert(ospfs_diridx_t *di, ospfs_inode_t *dir_oi, ospfs_btnode_t *bn,
+		uint32_t off, const char *name, int namelen)
+{
+	ospfs_btnode_t *child = NULL, *right = NULL, *to = bn;
+	uint32_t i;
+
+	if (bn->bn_leaf)
+		i = ospfs_bt_rank(dir_oi, bn, name, namelen, 0);
+	else {
+		i = ospfs_bt_rank(dir_oi, bn, name, namelen, 1);
+		if (i)
+			i--;
+		child = ospfs_bt_insert(di, dir_oi, bn->bn_child[i], off, name, namelen);
+		if (IS_ERR(child))
+			return child;
+		bn->bn_key[i] = bn->bn_child[i]->bn_key[0];
+		if (!child)
+			return NULL;
+		// Add the child's new sibling after it
+		off = child->bn_key[0];
+		i++;
+	}
+
+	if (bn->bn_nkeys == OSPFS_BT_ORDER) {
+		if (!(right = ospfs_bt_alloc(di, bn->bn_leaf))) {
+			if (child)
+				ospfs_bt_free(di, child);
+			return ERR_PTR(-ENOMEM);
+		}
+		right->bn_nkeys = OSPFS_BT_ORDER / 2;
+		bn->bn_nkeys -= right->bn_nkeys;
+		memcpy(right->bn_key, &bn->bn_key[bn->bn_nkeys],
+		       right->bn_nkeys * sizeof(bn->bn_key[0]));
+		memcpy(right->bn_child, &bn->bn_child[bn->bn_nkeys],
+		       right->bn_nkeys * sizeof(bn->bn_child[0]));
+		if (i > bn->bn_nkeys) {
+			i -= bn->bn_nkeys;
+			to = right;
+		}
+	}
+
+	memmove(&to->bn_key[i + 1], &to->bn_key[i],
+		(to->bn_nkeys - i) * sizeof(to->bn_key[0]));
+	to->bn_key[i] = off;
+	if (!to->bn_leaf) {
+		memmove(&to->bn_child[i + 1], &to->bn_child[i],
+			(to->bn_nkeys - i) * sizeof(to->bn_child[0]));
+		to->bn_child[i] = child;
+	}
+	to->bn_nkeys++;
+	return right;
+}
+
+// ospfs_bt_remove(di, dir_oi, bn, off, name, namelen)
+//	Removes the entry at 'off', named 'name', from under 'bn'.  Returns 1
+//	if that leaves 'bn' empty.
+
+static int
+ospfs_bt_remove(ospfs_diridx_t *di, ospfs_inode_t *dir_oi, ospfs_btnode_t *bn,
+		uint32_t off, const char *name, int namelen)
+{
+	uint32_t i;
+
+	if (bn->bn_leaf) {
+		i = ospfs_bt_rank(dir_oi, bn, name, namelen, 0);
+		if (i == bn->bn_nkeys || bn->bn_key[i] != off)
+			return 0;
+	} else {
+		i = ospfs_bt_rank(dir_oi, bn, name, namelen, 1);
+		if (i)
+			i--;
+		if (!ospfs_bt_remove(di, dir_oi, bn->bn_child[i], off, name, namelen)) {
+			bn->bn_key[i] = bn->bn_child[i]->bn_key[0];
+			return 0;
+		}
+		ospfs_bt_free(di, bn->bn_child[i]);
+		memmove(&bn->bn_child[i], &bn->bn_child[i + 1],
+			(bn->bn_nkeys - i - 1) * sizeof(bn->bn_child[0]));
+	}
+	memmove(&bn->bn_key[i], &bn->bn_key[i + 1],
+		(bn->bn_nkeys - i - 1) * sizeof(bn->bn_key[0]));
+	bn->bn_nkeys--;
+	return bn->bn_nkeys == 0;
+}
+
+// ospfs_bt_add(di, dir_oi, off), ospfs_bt_del(di, dir_oi, off)
+//	Add the entry at 'off' to the index, or remove it.  The entry's name
+//	must be in place.  ospfs_bt_add returns 0 or -ENOMEM.
+
+static int
+ospfs_bt_add(ospfs_diridx_t *di, ospfs_inode_t *dir_oi, uint32_t off)
+{
+	ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off);
+	ospfs_btnode_t *right, *root;
+
+	right = ospfs_bt_insert(di, dir_oi, di->di_root, off, od->od_name, strlen(od->od_name));
+	if (IS_ERR(right))
+		return PTR_ERR(right);
+	if (right) {
+		// Grow a level
+		if (!(root = ospfs_bt_alloc(di, 0))) {
+			ospfs_bt_free(di, right);
+			return -ENOMEM;
+		}
+		root->bn_nkeys = 2;
+		root->bn_key[0] = di->di_root->bn_key[0];
+		root->bn_child[0] = di->di_root;
+		root->bn_key[1] = right->bn_key[0];
+		root->bn_child[1] = right;
+		di->di_root = root;
+	}
+	return 0;
+}
+
+static void
+ospfs_bt_del(ospfs_diridx_t *di, ospfs_inode_t *dir_oi, uint32_t off)
+{
+	ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off);
+	ospfs_btnode_t *root = di->di_root;
+
+	ospfs_bt_remove(di, dir_oi, root, off, od->od_name, strlen(od->od_name));
+	// Lose levels with only one child
+	while (!root->bn_leaf && root->bn_nkeys == 1) {
+		di->di_root = root->bn_child[0];
+		ospfs_cache_free(OSPFS_CACHE_DIRNODE, root);
+		di->di_nnodes--;
+		root = di->di_root;
+	}
+	if (root->bn_nkeys == 0)
+		root->bn_leaf = 1;
+}
+
+static void
+ospfs_diridx_free(ospfs_diridx_t *di)
+{
+	ospfs_bt_free(di, di->di_root);
+	ospfs_cache_free(OSPFS_CACHE_DIRIDX, di);
+}
+
+// ospfs_diridx_get(dir_ino, dir_oi, build)
+//	Returns a reference to the index of directory 'dir_ino', or NULL if
+//	it has none.  If 'build' is set and 'dirindex' is on, a missing index
+//	is built.  Call with the directory's i_mutex held.
+
+static ospfs_diridx_t *
+ospfs_diridx_get(ino_t dir_ino, ospfs_inode_t *dir_oi, int build)
+{
+	struct hlist_head *head = &ospfs_diridx_hash[hash_long(dir_ino, OSPFS_DIRIDX_HASHBITS)];
+	ospfs_diridx_t *di;
+	struct hlist_node *pos;
+	uint32_t off;
+
+	spin_lock(&ospfs_diridx_lock);
+	hlist_for_each_entry(di, pos, head, di_hash)
+		if (di->di_ino == dir_ino) {
+			di->di_count++;
+			spin_unlock(&ospfs_diridx_lock);
+			return di;
+		}
+	spin_unlock(&ospfs_diridx_lock);
+
+	if (!build || !ospfs_dirindex
+	    || !(di = ospfs_cache_alloc(OSPFS_CACHE_DIRIDX, GFP_KERNEL)))
+		return NULL;
+	memset(di, 0, sizeof(*di));
+	di->di_ino = dir_ino;
+	di->di_count = 1;
+	if (!(di->di_root = ospfs_bt_alloc(di, 1))) {
+		ospfs_cache_free(OSPFS_CACHE_DIRIDX, di);
+		return NULL;
+	}
+	for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
+		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off);
+		if (od->od_ino && ospfs_bt_add(di, dir_oi, off) < 0) {
+			ospfs_diridx_free(di);
+			return NULL;
+		}
+	}
+
+	spin_lock(&ospfs_diridx_lock);
+	hlist_add_head(&di->di_hash, head);
+	spin_unlock(&ospfs_diridx_lock);
+	return di;
+}
+
+static void
+ospfs_diridx_put(ospfs_diridx_t *di)
+{
+	int dead;
+	spin_lock(&ospfs_diridx_lock);
+	dead = --di->di_count == 0 && di->di_dead;
+	spin_unlock(&ospfs_diridx_lock);
+	if (dead)
+		ospfs_diridx_free(di);
+}
+
+// Forgets index 'di'; it is freed with its last reference.
+static void
+ospfs_diridx_kill(ospfs_diridx_t *di)
+{
+	spin_lock(&ospfs_diridx_lock);
+	if (!di->di_dead) {
+		hlist_del(&di->di_hash);
+		di->di_dead = 1;
+	}
+	spin_unlock(&ospfs_diridx_lock);
+}
+
+// ospfs_diridx_shrink(nr)
+//	Frees unused indexes until about 'nr' nodes are gone; the
+//	OSPFS_CACHE_DIRNODE shrink callback.  Returns the number of nodes in
+//	unused indexes left.
+
+static int
+ospfs_diridx_shrink(int nr)
+{
+	HLIST_HEAD(victims);
+	ospfs_diridx_t *di;
+	struct hlist_node *pos, *next;
+	int b, left = 0;
+
+	spin_lock(&ospfs_diridx_lock);
+	for (b = 0; b < (1 << OSPFS_DIRIDX_HASHBITS); b++)
+		hlist_for_each_entry_safe(di, pos, next, &ospfs_diridx_hash[b], di_hash) {
+			if (di->di_count)
+				continue;
+			else if (nr > 0) {
+				nr -= di->di_nnodes;
+				hlist_del(&di->di_hash);
+				hlist_add_head(&di->di_hash, &victims);
+			} else
+				left += di->di_nnodes;
+		}
+	spin_unlock(&ospfs_diridx_lock);
+
+	hlist_for_each_entry_safe(di, pos, next, &victims, di_hash)
+		ospfs_diridx_free(di);
+	return left;
+}
+
+// ospfs_diridx_find(dir_ino, dir_oi, name, namelen, off)
+//	Looks 'name' up in the index of directory 'dir_ino', building the
+//	index if need be.  If there is an index, sets '*off' to 1 plus the
+//	entry's offset (0 if there is no such entry) and returns 1; if not,
+//	returns 0 and the caller should scan the directory.
+
+static int
+ospfs_diridx_find(ino_t dir_ino, ospfs_inode_t *dir_oi,
+		  const char *name, int namelen, uint32_t *off)
+{
+	ospfs_diridx_t *di = ospfs_diridx_get(dir_ino, dir_oi, 1);
+	if (!di)
+		return 0;
+	*off = ospfs_bt_next(dir_oi, di->di_root, name, namelen, 0);
+	if (*off && ospfs_bt_cmp(dir_oi, *off - 1, name, namelen) != 0)
+		*off = 0;
+	ospfs_diridx_put(di);
+	return 1;
+}
+
+// ospfs_diridx_add(dir_ino, dir_oi, off), ospfs_diridx_del(dir_ino, dir_oi, off)
+//	Tell the index of directory 'dir_ino', if it has one, that the entry
+//	at byte 'off' was just filled in, or is about to be cleared.
+
+static void
+ospfs_diridx_add(ino_t dir_ino, ospfs_inode_t *dir_oi, uint32_t off)
+{
+	ospfs_diridx_t *di = ospfs_diridx_get(dir_ino, dir_oi, 0);
+	if (di) {
+		if (ospfs_bt_add(di, dir_oi, off) < 0)
+			ospfs_diridx_kill(di);
+		ospfs_diridx_put(di);
+	}
+}
+
+static void
+ospfs_diridx_del(ino_t dir_ino, ospfs_inode_t *dir_oi, uint32_t off)
+{
+	ospfs_diridx_t *di = ospfs_diridx_get(dir_ino, dir_oi, 0);
+	if (di) {
+		ospfs_bt_del(di, dir_oi, off);
+		ospfs_diridx_put(di);
+	}
+}
+
+// ospfs_diridx_forget(dir_ino)
+//	Throws away the index of directory 'dir_ino', if any.  For changes
+//	too wholesale to track entry by entry.
+
+static void
+ospfs_diridx_forget(ino_t dir_ino)
+{
+	ospfs_diridx_t *di = ospfs_diridx_get(dir_ino, NULL, 0);
+	if (di) {
+		ospfs_diridx_kill(di);
+		ospfs_diridx_put(di);
+	}
+}
+
+// ospfs_diridx_readdir(filp, di, dir_oi, dirent, filldir, f_pos)
+//	The indexed part of ospfs_dir_readdir: lists entries in name order,
+//	starting at '*f_pos'.
+//
+//	A position is 2 plus the slot number of the entry to list next, so
+//	positions stay valid as entries come and go around them.  Each file
+//	also remembers the name at the position its last readdir stopped,
+//	so the listing picks up in the right place even if that entry has
+//	been removed since.  Seeking to the position of an entry that is
+//	gone starts the listing over.
+//
+//   Returns: 1 at end of directory, 0 if filldir returned < 0 first.
+
+#define OSPFS_DIRPOS_END	((loff_t) OSPFS_MAXFILESIZE / OSPFS_DIRENTRY_SIZE + 2)
+
+static int
+ospfs_diridx_readdir(struct file *filp, ospfs_diridx_t *di, ospfs_inode_t *dir_oi,
+		     void *dirent, filldir_t filldir, uint32_t *f_pos)
+{
+	ospfs_file_info_t *fi = filp->private_data;
+	char name[OSPFS_MAXNAMELEN + 1];
+	int namelen = 0, strict = 0, r = 0;
+	uint32_t next, off = (*f_pos - 2) * OSPFS_DIRENTRY_SIZE;
+	ospfs_direntry_t *od;
+	const char *start = "";
+
+	if (*f_pos >= OSPFS_DIRPOS_END)
+		return 1;
+	if (fi && fi->fi_dirpos == *f_pos && fi->fi_dirname[0])
+		start = fi->fi_dirname;
+	else if (off < dir_oi->oi_size
+		 && (od = ospfs_inode_data(dir_oi, off))->od_ino)
+		start = od->od_name;
+	namelen = strlen(start);
+	memcpy(name, start, namelen + 1);
+
+	for (;; strict = 1) {
+		if (!(next = ospfs_bt_next(dir_oi, di->di_root, name, namelen, strict))) {
+			*f_pos = OSPFS_DIRPOS_END;
+			r = 1;
+			break;
+		}
+		od = ospfs_inode_data(dir_oi, next - 1);
+		namelen = strlen(od->od_name);
+		memcpy(name, od->od_name, namelen + 1);
+		*f_pos = (next - 1) / OSPFS_DIRENTRY_SIZE + 2;
+		if (filldir(dirent, name, namelen, *f_pos, od->od_ino,
+			    ospfs_inode(od->od_ino)->oi_ftype == OSPFS_FTYPE_DIR ? DT_DIR
+			    : ospfs_inode(od->od_ino)->oi_ftype == OSPFS_FTYPE_SYMLINK ? DT_LNK
+			    : DT_REG) < 0)
+			break;
+	}
+
+	if (fi) {
+		fi->fi_dirpos = *f_pos;
+		memcpy(fi->fi_dirname, name, namelen + 1);
+	}
+	return r;
+}
+
+
+/*****************************************************************************
+ * DIRECTORY OPERATIONS
+ *
+ * EXERCISE: Finish 'ospfs_dir_readdir' and 'ospfs_symlink'.
+ */
+
+// ospfs_dir_lookup(dir, dentry, ignore)
+//	This function implements the "lookup" directory operation, which
+//	looks up a named entry.
+//
+//	We have written this function for you.
+//
+//   Input:  dir    -- The Linux 'struct inode' for the directory.
+//		       You can extract the corresponding 'ospfs_inode_t'
+//		       by calling 'ospfs_inode' with the relevant inode number.
+//	     dentry -- The name of the entry being looked up.
+//   Effect: Looks up the entry named 'dentry'.  If found, attaches the
+//	     entry's 'struct inode' to the 'dentry'.  If not found, returns
+//	     a "negative dentry", which has no inode attachment.
+
+static struct dentry *
+ospfs_dir_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *ignore)
+{
+	// Find the OSPFS inode corresponding to 'dir'
+	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
+	struct inode *entry_inode = NULL;
+	uint32_t entry_ino = 0;
+	uint32_t entry_off;
+
+	// Make sure filename is not too long
+	if (dentry->d_name.len > OSPFS_MAXNAMELEN)
+		return (struct dentry *) ERR_PTR(-ENAMETOOLONG);
+
+	// Mark with our operations
+	dentry->d_op = &ospfs_dentry_ops;
+
+	// Search through the directory block (or its index), unless we have
+	// looked before
+	if (!ospfs_lookup_get(dir->i_ino, dentry->d_name.name,
+			      dentry->d_name.len, &entry_ino)) {
+		if (ospfs_diridx_find(dir->i_ino, dir_oi, dentry->d_name.name,
+				      dentry->d_name.len, &entry_off)) {
+			if (entry_off) {
+				ospfs_direntry_t *od = ospfs_inode_data(dir_oi, entry_off - 1);
+				entry_ino = od->od_ino;
+			}
+		} else
+			for (entry_off = 0; entry_off < dir_oi->oi_size;
+			     entry_off += OSPFS_DIRENTRY_SIZE) {
+				// Find the OSPFS inode for the entry
+				ospfs_direntry_t *od = ospfs_inode_data(dir_oi, entry_off);
+
+				// Set 'entry_ino' if we find the file we are looking for
+				if (od->od_ino > 0
+				    && strlen(od->od_name) == dentry->d_name.len
+				    && memcmp(od->od_name, dentry->d_name.name, dentry->d_name.len) == 0) {
+					entry_ino = od->od_ino;
+					break;
+				}
+			}
+		ospfs_lookup_add(dir->i_ino, dentry->d_name.name,
+				 dentry->d_name.len, entry_ino);
+	}
+
+	if (entry_ino) {
+		entry_inode = ospfs_mk_linux_inode(dir->i_sb, entry_ino);
+		if (!entry_inode)
+			return (struct dentry *) ERR_PTR(-EINVAL);
+	}
+
+	// We return a dentry whether or not the file existed.
+	// The file exists if and only if 'entry_inode != NULL'.
+	// If the file doesn't exist, the dentry is called a "negative dentry".
+
+	// d_splice_alias() attaches the inode to the dentry.
+	// If it returns a new dentry, we need to set its operations.
+	if ((dentry = d_splice_alias(entry_inode, dentry)))
+		dentry->d_op = &ospfs_dentry_ops;
+	return dentry;
+}
+
+
+// ospfs_dir_readdir(filp, dirent, filldir)
+//   This function is called when the kernel reads the contents of a directory
+//   (i.e. when file_operations.readdir is called for the inode).
+//
+//   Inputs:  filp	-- The 'struct file' structure correspoding to
+//			   the open directory.
+//			   The most important member is 'filp->f_pos', the
+//			   File POSition.  This remembers how far into the
+//			   directory we are, so if the user calls 'readdir'
+//			   twice, we don't forget our position.
+//			   This function must update 'filp->f_pos'.
+//	      dirent	-- Used to pass to 'filldir'.
+//	      filldir	-- A pointer to a callback function.
+//			   This function should call 'filldir' once for each
+//			   directory entry, passing it six arguments:
+//		  (1) 'dirent'.
+//		  (2) The directory entry's name.
+//		  (3) The length of the directory entry's name.
 //		  (4) The 'f_pos' value corresponding to the directory entry.
 //		  (5) The directory entry's inode number.
 //		  (6) DT_REG, for regular files; DT_DIR, for subdirectories;
@@ -434,6 +1754,9 @@ ospfs_dir_readdir(struct file *filp, void *dirent, filldir_t filldir)
 	uint32_t f_pos = filp->f_pos;
 	int r = 0;		/* Error return value, if any */
 	int ok_so_far = 0;	/* Return value from 'filldir' */
+	ospfs_diridx_t *di;
+
+	ospfs_trace(OSPFS_TRACE_READDIR, dir_inode->i_ino, 0, f_pos, 0);
 
 	// f_pos is an offset into the directory's data, plus two.
 	// The "plus two" is to account for "." and "..".
@@ -449,6 +1772,14 @@ ospfs_dir_readdir(struct file *filp, void *dirent, filldir_t filldir)
 			f_pos++;
 	}
 
+	// Entries in name order, if the directory is indexed
+	if (r == 0 && ok_so_far >= 0 && f_pos >= 2
+	    && (di = ospfs_diridx_get(dir_inode->i_ino, dir_oi, 1))) {
+		r = ospfs_diridx_readdir(filp, di, dir_oi, dirent, filldir, &f_pos);
+		ospfs_diridx_put(di);
+		goto done;
+	}
+
 	// actual entries
 	while (r == 0 && ok_so_far >= 0 && f_pos >= 2) {
 		ospfs_direntry_t *od;
@@ -518,6 +1849,7 @@ ospfs_dir_readdir(struct file *filp, void *dirent, filldir_t filldir)
 		f_pos++;
 	}
 
+    done:
 	// Save the file position and return!
 	filp->f_pos = f_pos;
 	return r;
@@ -559,19 +1891,46 @@ ospfs_unlink(struct inode *dirino, struct dentry *dentry)
 	}
 
 
+	ospfs_diridx_del(dentry->d_parent->d_inode->i_ino, dir_oi, entry_off);
 	od->od_ino = 0;
+	ospfs_lookup_forget(dentry->d_parent->d_inode->i_ino,
+			    dentry->d_name.name, dentry->d_name.len);
 	oi->oi_nlink--;
+	ospfs_touch(dir_oi, dirino, S_MTIME | S_CTIME);
+	if (oi->oi_nlink)
+		ospfs_touch(oi, dentry->d_inode, S_CTIME);
+	ospfs_trace(OSPFS_TRACE_UNLINK, dentry->d_inode->i_ino, dentry->d_parent->d_inode->i_ino, 0, dentry->d_name.len);
 
 	// Check for symlinks
 	if(oi->oi_ftype == OSPFS_FTYPE_SYMLINK) {
-		memset(oi, 0, sizeof(ospfs_symlink_inode_t));
+		if (oi->oi_nlink == 0)
+			ospfs_free_inode(dentry->d_inode->i_ino);
 		return 0;
 	}
 
 	// Check if we can free the blocks
 	if(oi->oi_nlink == 0) {
+		ino_t ino = dentry->d_inode->i_ino;
+		ospfs_inode_info_t *ii = ospfs_get_info(ino, 0);
+
+		// Buffered data was never given blocks; just drop it
+		if (ii) {
+			mutex_lock(&ii->ii_mutex);
+			ospfs_da_discard(ii, 0);
+			mutex_unlock(&ii->ii_mutex);
+		}
 
-		change_size(oi, 0);
+		// Free small closed files now.  Others become orphans, and
+		// their blocks are freed in the background (after the last
+		// close, if the file is still open).
+		if (!ii && !oi->oi_indirect && !oi->oi_indirect2) {
+			ospfs_free_file(oi);
+			ospfs_free_inode(ino);
+		} else
+			ospfs_add_orphan(ino);
+
+		if (ii)
+			ospfs_put_info(ii);
 	}
 
 
@@ -586,44 +1945,310 @@ ospfs_unlink(struct inode *dirino, struct dentry *dentry)
  * EXERCISE: Implement these functions.
  */
 
-// allocate_block()
-//	Use this function to allocate a block.
-//
-//   Inputs:  none
-//   Returns: block number of the allocated block,
-//	      or 0 if the disk is full
-//
-//   This function searches the free-block bitmap, which starts at Block 2, for
-//   a free block, allocates it (by marking it non-free), and returns the block
-//   number to the caller.  The block itself is not touched.
+#define OSPFS_FIRST_VALID_BLOCK (ospfs_super->os_firstinob + \
+	ospfs_size2nblocks(ospfs_super->os_ninodes * OSPFS_INODESIZE))
+
+// BLOCK GROUPS
+//	The data area and the inode table are both divided into groups, as
+//	in ext2: group g owns OSPFS_BGBLOCKS consecutive data blocks (and their
+//	slice of the bitmap) and an equal share of the inode table.  Each group
+//	has its own free counts and lock, so allocations in different groups
+//	never contend.  Files get their data blocks from their inode's group
+//	when possible.
 //
-//   Note:  A value of 0 for a bit indicates the corresponding block is
-//      allocated; a value of 1 indicates the corresponding block is free.
+//	Groups are an in-memory view of the existing layout, built at mount
+//	time; the image format doesn't change.
 //
-//   You can use the functions bitvector_set(), bitvector_clear(), and
-//   bitvector_test() to do bit operations on the map.
-#define OSPFS_FIRST_VALID_BLOCK ospfs_super->os_firstinob + \
- 								(ospfs_super->os_ninodes / OSPFS_BLKINODES)
-static uint32_t
-allocate_block(void)
+//	Free-block totals are kept in 'ospfs_nfree' and 'ospfs_nreserved'
+//	(free blocks promised to delayed allocations; see DELAYED
+//	ALLOCATION), under 'ospfs_space_lock'.  Ordinary allocations may only
+//	take unreserved blocks.  Allocators claim space from the totals
+//	before they look for it in a group, and give back what they don't
+//	find.
+
+#define OSPFS_BGBLOCKS		1024
+
+struct ospfs_group {
+	spinlock_t bg_lock;		// Protects the group's bitmap slice & inodes
+	uint32_t bg_first, bg_end;	// Data blocks [bg_first, bg_end)
+	uint32_t bg_ifirst, bg_iend;	// Inodes [bg_ifirst, bg_iend)
+	uint32_t bg_nfree;		// Free blocks
+	uint32_t bg_nifree;		// Free inodes
+	uint32_t bg_ndiscard;		// Freed blocks not yet discarded
+} ____cacheline_aligned_in_smp;
+
+static struct ospfs_group *ospfs_groups;
+static uint32_t ospfs_ngroups;
+static uint32_t ospfs_group_inodes;	// Inodes per group
+
+static DEFINE_SPINLOCK(ospfs_space_lock);
+static uint32_t ospfs_nfree;
+static uint32_t ospfs_nreserved;
+
+// Free blocks still holding old data, one bit per block; see FREED-BLOCK
+// DISCARD.  Each group's bits are protected by its lock.
+static uint32_t *ospfs_discard_map;
+static atomic_t ospfs_ndiscard = ATOMIC_INIT(0);
+
+static inline struct ospfs_group *
+ospfs_block_group(uint32_t blockno)
 {
-	/* EXERCISE: Your code here */
-	uint32_t * bitvector = ospfs_block(2);
-	uint32_t blockno = OSPFS_FIRST_VALID_BLOCK;
-	while(blockno < ospfs_super->os_nblocks) {
-		if(bitvector_test(bitvector, blockno)) {
-			bitvector_clear(bitvector, blockno);
-			break;
-		}
-		blockno++;
-	}
-	if(ospfs_super->os_nblocks == blockno) {
+	uint32_t g = (blockno - OSPFS_FIRST_VALID_BLOCK) / OSPFS_BGBLOCKS;
+	return &ospfs_groups[MIN(g, ospfs_ngroups - 1)];
+}
+
+static inline struct ospfs_group *
+ospfs_inode_group(ino_t ino)
+{
+	return &ospfs_groups[MIN(ino / ospfs_group_inodes, ospfs_ngroups - 1)];
+}
+
+// Note that freed block 'blockno' of group 'bg' needs discarding.  Caller
+// holds bg->bg_lock, and calls ospfs_discard_note once it is released.
+static inline void
+ospfs_discard_mark(struct ospfs_group *bg, uint32_t blockno)
+{
+	if (!bitvector_test(ospfs_discard_map, blockno)) {
+		bitvector_set(ospfs_discard_map, blockno);
+		bg->bg_ndiscard++;
+	}
+}
+
+// ospfs_init_groups()
+//	Sets up the groups and counts free blocks and inodes.  Called at
+//	mount time.
+
+static int
+ospfs_init_groups(void)
+{
+	uint32_t first = OSPFS_FIRST_VALID_BLOCK, ninodes = ospfs_super->os_ninodes;
+	uint32_t g, blockno, ino, nfree = 0;
+	struct ospfs_group *bg;
+
+	ospfs_ngroups = MAX((ospfs_super->os_nblocks - first + OSPFS_BGBLOCKS - 1) / OSPFS_BGBLOCKS, 1);
+	ospfs_group_inodes = (ninodes + ospfs_ngroups - 1) / ospfs_ngroups;
+	ospfs_group_inodes = roundup(ospfs_group_inodes, OSPFS_BLKINODES);
+	if (!(ospfs_groups = kcalloc(ospfs_ngroups, sizeof(*ospfs_groups), GFP_KERNEL)))
+		return -ENOMEM;
+	if (!(ospfs_discard_map = kcalloc(roundup(ospfs_super->os_nblocks, 32) / 32,
+					  sizeof(uint32_t), GFP_KERNEL))) {
+		kfree(ospfs_groups);
+		ospfs_groups = NULL;
+		return -ENOMEM;
+	}
+
+	for (g = 0; g < ospfs_ngroups; g++) {
+		bg = &ospfs_groups[g];
+		spin_lock_init(&bg->bg_lock);
+		bg->bg_first = first + g * OSPFS_BGBLOCKS;
+		bg->bg_end = MIN(bg->bg_first + OSPFS_BGBLOCKS, ospfs_super->os_nblocks);
+		bg->bg_ifirst = MIN(g * ospfs_group_inodes, ninodes);
+		bg->bg_iend = MIN(bg->bg_ifirst + ospfs_group_inodes, ninodes);
+		for (blockno = bg->bg_first; blockno < bg->bg_end; blockno++)
+			if (ospfs_freemap_test(blockno))
+				bg->bg_nfree++;
+		for (ino = MAX(bg->bg_ifirst, 1); ino < bg->bg_iend; ino++)
+			if (ospfs_inode_is_free(ospfs_inode(ino)))
+				bg->bg_nifree++;
+		nfree += bg->bg_nfree;
+	}
+
+	spin_lock(&ospfs_space_lock);
+	ospfs_nfree = nfree;
+	ospfs_nreserved = 0;
+	spin_unlock(&ospfs_space_lock);
+	atomic_set(&ospfs_ndiscard, 0);
+	return 0;
+}
+
+static void
+ospfs_destroy_groups(void)
+{
+	kfree(ospfs_groups);
+	kfree(ospfs_discard_map);
+	ospfs_groups = NULL;
+	ospfs_discard_map = NULL;
+	ospfs_ngroups = 0;
+}
+
+// ospfs_claim_space(want, reserved), ospfs_unclaim_space(n, reserved)
+//	Take up to 'want' blocks out of the free totals (returning how many),
+//	or put 'n' back.  If 'reserved' is set, the blocks come out of (or go
+//	back into) the caller's reservation.
+
+static uint32_t
+ospfs_claim_space(uint32_t want, int reserved)
+{
+	spin_lock(&ospfs_space_lock);
+	want = MIN(want, ospfs_nfree - (reserved ? 0 : ospfs_nreserved));
+	ospfs_nfree -= want;
+	if (reserved)
+		ospfs_nreserved -= MIN(want, ospfs_nreserved);
+	spin_unlock(&ospfs_space_lock);
+	return want;
+}
+
+static void
+ospfs_unclaim_space(uint32_t n, int reserved)
+{
+	spin_lock(&ospfs_space_lock);
+	ospfs_nfree += n;
+	if (reserved)
+		ospfs_nreserved += n;
+	spin_unlock(&ospfs_space_lock);
+}
+
+// ospfs_group_run(bg, goal, want, got)
+//	Allocates the first run of 'want' free blocks in group 'bg' at or
+//	after 'goal', or failing that the longest shorter run.  Sets '*got'
+//	to its length and returns its first block (0 if the group is full).
+
+static uint32_t
+ospfs_group_run(struct ospfs_group *bg, uint32_t goal, uint32_t want, uint32_t *got)
+{
+	uint32_t size = bg->bg_end - bg->bg_first;
+	uint32_t blockno, i, run = 0, runlen = 0, best = 0, bestlen = 0;
+	uint32_t undiscarded = 0;
+
+	*got = 0;
+	spin_lock(&bg->bg_lock);
+	if (bg->bg_nfree == 0) {
+		spin_unlock(&bg->bg_lock);
 		return 0;
 	}
+	want = MIN(want, bg->bg_nfree);
+
+	if (goal < bg->bg_first || goal >= bg->bg_end)
+		goal = bg->bg_first;
+	for (i = 0, blockno = goal; i < size && bestlen < want; i++) {
+		if (ospfs_freemap_test(blockno)) {
+			if (runlen++ == 0)
+				run = blockno;
+		} else
+			runlen = 0;
+		if (runlen > bestlen) {
+			best = run;
+			bestlen = runlen;
+		}
+		// Runs don't wrap around the end of the group
+		if (++blockno == bg->bg_end) {
+			blockno = bg->bg_first;
+			runlen = 0;
+		}
+	}
+
+	for (i = 0; i < bestlen; i++) {
+		ospfs_freemap_clear(best + i);
+		// Its old data is about to be overwritten anyway
+		if (bitvector_test(ospfs_discard_map, best + i)) {
+			bitvector_clear(ospfs_discard_map, best + i);
+			bg->bg_ndiscard--;
+			undiscarded++;
+		}
+	}
+	bg->bg_nfree -= bestlen;
+	spin_unlock(&bg->bg_lock);
+	if (undiscarded)
+		atomic_sub(undiscarded, &ospfs_ndiscard);
+
+	*got = bestlen;
+	return bestlen ? best : 0;
+}
+
+// Block allocation policies, chosen with the 'alloc' mount option.
+#define OSPFS_ALLOC_GOAL	0  // Start at the caller's goal
+#define OSPFS_ALLOC_FIRSTFIT	1  // Start at the first data block
+#define OSPFS_ALLOC_NEXTFIT	2  // Start after the last allocation
+
+static int ospfs_alloc_policy = OSPFS_ALLOC_GOAL;
+static uint32_t ospfs_nextfit;
+
+// ospfs_alloc_run(goal, want, got, reserved)
+//	Allocates up to 'want' consecutive blocks.  The search starts at
+//	'goal' in goal's group, and moves on to later groups only if that
+//	group is full.  Within a group, it takes the first run of 'want' free
+//	blocks, or failing that the longest shorter run.  The firstfit and
+//	nextfit policies ignore 'goal' and start at the first data block or
+//	just past the previous allocation instead.
+//
+//   Inputs:  goal     -- where to start looking (0 means the first group)
+//	      want     -- the number of blocks wanted
+//	      got      -- set to the number of blocks allocated
+//	      reserved -- nonzero if the caller holds a reservation for
+//			  these blocks; the reservation is used up
+//   Returns: the first allocated block, or 0 if the disk is full
+
+static uint32_t
+ospfs_alloc_run(uint32_t goal, uint32_t want, uint32_t *got, int reserved)
+{
+	struct ospfs_group *bg;
+	uint32_t g, i, claimed, blockno = 0;
+
+	*got = 0;
+	if (!(claimed = ospfs_claim_space(want, reserved))) {
+		// Space may be on its way back from unlinked files
+		if (!ospfs_wait_reclaim()
+		    || !(claimed = ospfs_claim_space(want, reserved)))
+			return 0;
+	}
+	want = claimed;
+
+	if (ospfs_alloc_policy == OSPFS_ALLOC_FIRSTFIT)
+		goal = OSPFS_FIRST_VALID_BLOCK;
+	else if (ospfs_alloc_policy == OSPFS_ALLOC_NEXTFIT)
+		goal = ospfs_nextfit;
+	if (goal < OSPFS_FIRST_VALID_BLOCK || goal >= ospfs_super->os_nblocks)
+		goal = OSPFS_FIRST_VALID_BLOCK;
+	g = ospfs_block_group(goal) - ospfs_groups;
+	for (i = 0; i < ospfs_ngroups && !blockno; i++) {
+		bg = &ospfs_groups[(g + i) % ospfs_ngroups];
+		blockno = ospfs_group_run(bg, goal, want, got);
+	}
+	if (blockno && ospfs_alloc_policy == OSPFS_ALLOC_NEXTFIT)
+		ospfs_nextfit = blockno + *got;
 
+	if (*got < want)
+		ospfs_unclaim_space(want - *got, reserved);
 	return blockno;
 }
 
+// ospfs_block_goal(oi, n)
+//	Returns the best place for block 'n' of file 'oi': right after block
+//	n-1, if that exists, or else the start of the inode's group.
+
+static uint32_t
+ospfs_block_goal(ospfs_inode_t *oi, uint32_t n)
+{
+	uint32_t *slot;
+	if (n > 0 && (slot = ospfs_bmap_slot(oi, n - 1, 0)) && *slot)
+		return *slot + 1;
+	return ospfs_inode_group(ospfs_inode_ino(oi))->bg_first;
+}
+
+// allocate_block(goal)
+//	Use this function to allocate a block.
+//
+//   Inputs:  goal -- where to look first (see ospfs_block_goal), or 0
+//   Returns: block number of the allocated block,
+//	      or 0 if the disk is full
+//
+//   This function searches the free-block bitmap, which starts at Block 2, for
+//   a free block, allocates it (by marking it non-free), and returns the block
+//   number to the caller.  The block itself is not touched.
+//
+//   Note:  A value of 0 for a bit indicates the corresponding block is
+//      allocated; a value of 1 indicates the corresponding block is free.
+//
+//   You can use the functions bitvector_set(), bitvector_clear(), and
+//   bitvector_test() to do bit operations on the map.
+
+static uint32_t
+allocate_block(uint32_t goal)
+{
+	uint32_t got;
+	return ospfs_alloc_run(goal, 1, &got, 0);
+}
+
 
 // free_block(blockno)
 //	Use this function to free an allocated block.
@@ -639,13 +2264,93 @@ allocate_block(void)
 static void
 free_block(uint32_t blockno)
 {
-	/* EXERCISE: Your code here */
-	uint32_t * bitvector = ospfs_block(2);
-	if(ospfs_super->os_nblocks < blockno || blockno < OSPFS_FIRST_VALID_BLOCK) { // Check for validity
+	struct ospfs_group *bg;
+	int freed = 0;
+
+	if (blockno >= ospfs_super->os_nblocks || blockno < OSPFS_FIRST_VALID_BLOCK) { // Check for validity
+		eprintk("OSPFS: freeing bogus block %u\n", blockno);
+		return;
+	}
+
+	bg = ospfs_block_group(blockno);
+	spin_lock(&bg->bg_lock);
+	if (!ospfs_freemap_test(blockno)) {
+		ospfs_freemap_set(blockno);
+		ospfs_discard_mark(bg, blockno);
+		bg->bg_nfree++;
+		freed = 1;
+	}
+	spin_unlock(&bg->bg_lock);
+	if (freed) {
+		ospfs_unclaim_space(1, 0);
+		ospfs_discard_note(1);
+	}
+}
+
+// ospfs_free_blocks(blockno, count)
+//	Frees 'count' consecutive blocks starting at 'blockno', taking each
+//	group's lock once rather than once per block.
+
+static void
+ospfs_free_blocks(uint32_t blockno, uint32_t count)
+{
+	uint32_t end = blockno + count, freed = 0;
+	struct ospfs_group *bg;
+
+	if (blockno < OSPFS_FIRST_VALID_BLOCK || end > ospfs_super->os_nblocks || end < blockno) {
+		eprintk("OSPFS: freeing bogus blocks %u+%u\n", blockno, count);
 		return;
 	}
 
-	bitvector_set(bitvector, blockno);
+	while (blockno < end) {
+		bg = ospfs_block_group(blockno);
+		spin_lock(&bg->bg_lock);
+		for (; blockno < end && blockno < bg->bg_end; blockno++)
+			if (!ospfs_freemap_test(blockno)) {
+				ospfs_freemap_set(blockno);
+				ospfs_discard_mark(bg, blockno);
+				bg->bg_nfree++;
+				freed++;
+			}
+		spin_unlock(&bg->bg_lock);
+	}
+	if (freed) {
+		ospfs_unclaim_space(freed, 0);
+		ospfs_discard_note(freed);
+	}
+}
+
+
+// ospfs_reserve_blocks(n), ospfs_unreserve_blocks(n)
+//	Promise 'n' free blocks to a delayed allocation, or take the promise
+//	back.  ospfs_reserve_blocks returns -ENOSPC if there aren't enough
+//	unpromised free blocks.
+
+static int
+ospfs_reserve_blocks(uint32_t n)
+{
+	int r, tries = 0;
+
+    retry:
+	r = 0;
+	spin_lock(&ospfs_space_lock);
+	if (ospfs_nfree - ospfs_nreserved < n)
+		r = -ENOSPC;
+	else
+		ospfs_nreserved += n;
+	spin_unlock(&ospfs_space_lock);
+
+	if (r < 0 && tries++ == 0 && ospfs_wait_reclaim())
+		goto retry;
+	return r;
+}
+
+static void
+ospfs_unreserve_blocks(uint32_t n)
+{
+	spin_lock(&ospfs_space_lock);
+	ospfs_nreserved -= MIN(n, ospfs_nreserved);
+	spin_unlock(&ospfs_space_lock);
 }
 
 
@@ -660,6 +2365,125 @@ free_block(uint32_t blockno)
  *
  */
 
+// ospfs_bmap_slot(oi, n, flags)
+//	Finds the block pointer for block 'n' of file 'oi': an oi_direct
+//	entry, or an entry in an indirect block.  File data can have holes,
+//	so the indirect blocks on the way might not exist.  Without
+//	OSPFS_BMAP_CREATE, that returns NULL.  With it, missing indirect blocks
+//	are allocated and zeroed (from a reservation, if OSPFS_BMAP_RESERVED is
+//	also given).
+//
+//   Inputs:  oi    -- the file
+//	      n     -- file block number
+//	      flags -- OSPFS_BMAP_* flags
+//   Returns: a pointer to the block pointer, or NULL if the block can't
+//	      have one (no indirect block, or no space to make one).
+//	      Indirect blocks allocated by a failed call are freed again.
+
+#define OSPFS_BMAP_CREATE	1
+#define OSPFS_BMAP_RESERVED	2
+
+static uint32_t
+ospfs_alloc_indirect(ospfs_inode_t *oi, int flags)
+{
+	uint32_t blockno, got;
+	if (!(flags & OSPFS_BMAP_CREATE))
+		return 0;
+	blockno = ospfs_alloc_run(ospfs_inode_group(ospfs_inode_ino(oi))->bg_first,
+				  1, &got, flags & OSPFS_BMAP_RESERVED);
+	if (blockno)
+		memset(ospfs_block(blockno), 0, OSPFS_BLKSIZE);
+	return blockno;
+}
+
+static uint32_t *
+ospfs_bmap_slot(ospfs_inode_t *oi, uint32_t n, int flags)
+{
+	uint32_t *indirect2;
+
+	// Inline files have no block pointers; callers convert them first
+	if (ospfs_is_inline(oi))
+		return NULL;
+	if (n < OSPFS_NDIRECT)
+		return &oi->oi_direct[n];
+
+	n -= OSPFS_NDIRECT;
+	if (n < OSPFS_NINDIRECT) {
+		if (!oi->oi_indirect && !(oi->oi_indirect = ospfs_alloc_indirect(oi, flags)))
+			return NULL;
+		return (uint32_t *) ospfs_block(oi->oi_indirect) + n;
+	}
+
+	n -= OSPFS_NINDIRECT;
+	if (n >= OSPFS_NINDIRECT * OSPFS_NINDIRECT)
+		return NULL;
+	if (!oi->oi_indirect2 && !(oi->oi_indirect2 = ospfs_alloc_indirect(oi, flags)))
+		return NULL;
+	indirect2 = (uint32_t *) ospfs_block(oi->oi_indirect2) + n / OSPFS_NINDIRECT;
+	if (!*indirect2 && !(*indirect2 = ospfs_alloc_indirect(oi, flags))) {
+		// Don't leave an empty indirect^2 block behind
+		if (flags & OSPFS_BMAP_CREATE) {
+			uint32_t *p = ospfs_block(oi->oi_indirect2), i;
+			for (i = 0; i < OSPFS_NINDIRECT && !p[i]; i++)
+				/* nothing */;
+			if (i == OSPFS_NINDIRECT) {
+				free_block(oi->oi_indirect2);
+				oi->oi_indirect2 = 0;
+			}
+		}
+		return NULL;
+	}
+	return (uint32_t *) ospfs_block(*indirect2) + n % OSPFS_NINDIRECT;
+}
+
+// ospfs_indirect_end(n)
+//	Returns the first file block past the indirect block that would map
+//	block 'n'.  When ospfs_bmap_slot finds no indirect block for 'n', the
+//	file has a hole at least up to there.
+
+static inline uint32_t
+ospfs_indirect_end(uint32_t n)
+{
+	if (n < OSPFS_NDIRECT)
+		return n + 1;
+	n -= OSPFS_NDIRECT;
+	if (n < OSPFS_NINDIRECT)
+		return OSPFS_NDIRECT + OSPFS_NINDIRECT;
+	n -= OSPFS_NINDIRECT;
+	return OSPFS_NDIRECT + OSPFS_NINDIRECT + n - n % OSPFS_NINDIRECT + OSPFS_NINDIRECT;
+}
+
+// ospfs_release_indirect(oi, n)
+//	Frees any indirect block whose first entry maps file block 'n', and
+//	the indirect^2 block if 'n' is the first block it maps.  Called when
+//	a file shrinks to 'n' blocks.  Missing blocks (holes) are skipped.
+
+static void
+ospfs_release_indirect(ospfs_inode_t *oi, uint32_t n)
+{
+	uint32_t *indirect2;
+
+	if (n == OSPFS_NDIRECT && oi->oi_indirect) {
+		free_block(oi->oi_indirect);
+		oi->oi_indirect = 0;
+	}
+	if (n < OSPFS_NDIRECT + OSPFS_NINDIRECT || !oi->oi_indirect2)
+		return;
+
+	n -= OSPFS_NDIRECT + OSPFS_NINDIRECT;
+	if (n % OSPFS_NINDIRECT == 0) {
+		indirect2 = (uint32_t *) ospfs_block(oi->oi_indirect2) + n / OSPFS_NINDIRECT;
+		if (*indirect2)
+			free_block(*indirect2);
+		*indirect2 = 0;
+	}
+	if (n == 0) {
+		free_block(oi->oi_indirect2);
+		oi->oi_indirect2 = 0;
+	}
+}
+
+
 // add_block(ospfs_inode_t *oi)
 //   Adds a single data block to a file, adding indirect and
 //   doubly-indirect blocks if necessary. (Helper function for
@@ -694,114 +2518,46 @@ free_block(uint32_t blockno)
 static int
 add_block(ospfs_inode_t *oi)
 {
-	// Indirect and Indirect2 lists
-	uint32_t * block_list;
-	uint32_t * indirect_block_list;
-	
 	// current number of blocks in file
 	uint32_t n = ospfs_size2nblocks(oi->oi_size);
+	uint32_t *slot, blockno, *entry = NULL;
+	uint32_t had_indirect = oi->oi_indirect, had_indirect2 = oi->oi_indirect2;
+	uint32_t had_entry = 0;
+	uint32_t i2 = (n - OSPFS_NDIRECT - OSPFS_NINDIRECT) / OSPFS_NINDIRECT;
 
-	// keep track of allocations to free in case of -ENOSPC
-	uint32_t allocate[3] = { 0, 0, 0 };
+	if (n >= OSPFS_MAXFILEBLKS)
+		return -EIO;
 
-	// Allocate and prepare the data block
-	allocate[0] = allocate_block();
-	if(!allocate[0]) {
+	// Find the block pointer, allocating indirect blocks as needed
+	if (n >= OSPFS_NDIRECT + OSPFS_NINDIRECT && had_indirect2)
+		had_entry = ((uint32_t *) ospfs_block(had_indirect2))[i2];
+	if (!(slot = ospfs_bmap_slot(oi, n, OSPFS_BMAP_CREATE)))
 		return -ENOSPC;
-	}
-	memset(ospfs_block(allocate[0]), 0, OSPFS_BLKSIZE);
-
-	// In direct block range
-	if(0 <= n && n < OSPFS_NDIRECT) {
-		oi->oi_direct[n] = allocate[0];
-	}
-	// Check if starting indirect block
-	else if(n == OSPFS_NDIRECT) {
-		// Allocate and prepare the indirect block
-		allocate[1] = allocate_block();
-		if(!allocate[1]) {
-			free_block(allocate[0]);
-			return -ENOSPC;
-		}
-		memset(ospfs_block(allocate[1]), 0, OSPFS_BLKSIZE);
-
-		// Set the first element of the indirect block
-		oi->oi_indirect = allocate[1];
-		block_list = ospfs_block(oi->oi_indirect);
-		block_list[0] = allocate[0];
-	}
-	// Add to indirect block
-	else if(n < OSPFS_NDIRECT + OSPFS_NINDIRECT) {
-		// Add the to the end of the list
-		block_list = ospfs_block(oi->oi_indirect);
-		block_list[(n - OSPFS_NDIRECT)] = allocate[0];
-	}
-	// Check if we need to allocate the indirect2 block
-	else if(n == OSPFS_NDIRECT + OSPFS_NINDIRECT) {
-		// Allocate the indirect2 block
-		allocate[1] = allocate_block();
-		if(!allocate[1]) {
-			free_block(allocate[0]);
-			return -ENOSPC;
+	if (n >= OSPFS_NDIRECT + OSPFS_NINDIRECT)
+		entry = (uint32_t *) ospfs_block(oi->oi_indirect2) + i2;
+
+	// Allocate and prepare the data block, next to the previous one
+	if (!(blockno = allocate_block(ospfs_block_goal(oi, n)))) {
+		// Free the indirect blocks allocated for it just now
+		if (entry && !had_entry) {
+			free_block(*entry);
+			*entry = 0;
 		}
-
-		// Allocate the indirect block
-		allocate[2] = allocate_block();
-		if(!allocate[2]) {
-			free_block(allocate[0]);
-			free_block(allocate[1]);
-			return -ENOSPC;
+		if (entry && !had_indirect2) {
+			free_block(oi->oi_indirect2);
+			oi->oi_indirect2 = 0;
 		}
-		
-		// Prepare the blocks
-		memset(ospfs_block(allocate[1]), 0, OSPFS_BLKSIZE);
-		memset(ospfs_block(allocate[2]), 0, OSPFS_BLKSIZE);
-
-		// Set the new indirect block and its first indirect and data block
-		oi->oi_indirect2 = allocate[0];
-		indirect_block_list = ospfs_block(oi->oi_indirect2);
-
-		indirect_block_list[0] = allocate[1];
-		block_list = ospfs_block(indirect_block_list[0]);
-		block_list[0] = allocate[2];
-	}
-	// See if we are still in the allowed file size
-	else if(n < OSPFS_MAXFILEBLKS) {
-		int indirect_index, direct_index;
-		// Get the indirect2 list
-		indirect_block_list = ospfs_block(oi->oi_indirect2);
-		
-		// Check if we need to allocate a new indirect block
-		indirect_index = (n - OSPFS_NDIRECT - OSPFS_NINDIRECT) / OSPFS_NINDIRECT;
-		if(indirect_block_list[indirect_index] == 0) {
-			// Allocate the new indirect block and prepare it
-			allocate[1] = allocate_block();
-			if(!allocate[1]) {
-				free_block(allocate[0]);
-				return -ENOSPC;
-			}
-			memset(ospfs_block(allocate[1]), 0, OSPFS_BLKSIZE);
-
-			// Add the new indirect block to the list
-			indirect_block_list[indirect_index] = allocate[1];	
+		if (!entry && n >= OSPFS_NDIRECT && !had_indirect) {
+			free_block(oi->oi_indirect);
+			oi->oi_indirect = 0;
 		}
-
-		// Get the direct block list from the indirect block
-		block_list = ospfs_block(indirect_block_list[indirect_index]);
-
-		// Add the new data block
-		direct_index = (n - OSPFS_NDIRECT - OSPFS_NINDIRECT) % OSPFS_NINDIRECT;
-		block_list[direct_index] = allocate[0];
-	}
-	// No more blocks...
-	else {
-		free_block(allocate[0]);
-		return -EIO;
+		return -ENOSPC;
 	}
+	memset(ospfs_block(blockno), 0, OSPFS_BLKSIZE);
+	*slot = blockno;
 
-	/* EXERCISE: Your code here */
 	oi->oi_size = (n+1)*OSPFS_BLKSIZE;
-	return 0; // Replace this line
+	return 0;
 }
 
 
@@ -830,97 +2586,27 @@ add_block(ospfs_inode_t *oi)
 static int
 remove_block(ospfs_inode_t *oi)
 {
-	// Indirect and Indirect2 lists
-	uint32_t * block_list;
-	uint32_t * indirect_block_list;
-
 	// current number of blocks in file
 	uint32_t n = ospfs_size2nblocks(oi->oi_size);
+	uint32_t *slot;
 
 	// Check if the file has any allocated storage
 	if(n == 0)
 		return 0;
+	if (n > OSPFS_MAXFILEBLKS)
+		return -EIO;
 
-	// Deallocate from the direct block range
-	if(0 < n && n <= OSPFS_NDIRECT) {
-		free_block(oi->oi_direct[n - 1]);
-		oi->oi_direct[n - 1] = 0;
-	}
-	// Deallocate from the indirect block
-	else if(n <= OSPFS_NDIRECT + OSPFS_NINDIRECT) {
-		// Check for the indirect block
-		if(oi->oi_indirect == 0) {
-			return -EIO;
-		}
-
-		block_list = ospfs_block(oi->oi_indirect);
-		if(block_list[n - 1 - OSPFS_NDIRECT] == 0) {
-			return -EIO;
-		}
-
-		// Free the data block
-		free_block(block_list[n - 1 - OSPFS_NDIRECT]);
-		block_list[n - 1 - OSPFS_NDIRECT] = 0;
-
-		// Check if we need to free the indirect block
-		if(n - OSPFS_NDIRECT == 0) {
-			free_block(oi->oi_indirect);
-			oi->oi_indirect = 0;
-		}
-
+	// Free the data block, unless the file has a hole there
+	if ((slot = ospfs_bmap_slot(oi, n - 1, 0)) && *slot) {
+		free_block(*slot);
+		*slot = 0;
 	}
-	// Deallocate from the indirect2 block range
-	else if(n <= OSPFS_MAXFILEBLKS) {
-		int blockoff, indirect_index, direct_index;
-
-		// Make sure we have the indirect2 list
-		if(oi->oi_indirect2 == 0) {
-			return -EIO;
-		}
-
-		// Get the indirect2 list
-		indirect_block_list = ospfs_block(oi->oi_indirect2);
-
-		// Check that we have the indirect block
-
-		blockoff = n - 1 - OSPFS_NDIRECT - OSPFS_NINDIRECT;
-		indirect_index = (blockoff / OSPFS_NINDIRECT);
-		if(indirect_block_list[indirect_index] == 0) {
-			return -EIO;
-		}
-
-		// Get the indirect list
-		block_list = ospfs_block(indirect_block_list[indirect_index]);
-		// Check that we have the direct block
-		direct_index = (blockoff % OSPFS_NINDIRECT);
-		if(block_list[direct_index] == 0) {
-			return -EIO;
-		}
-
-		// Free the block(s)
-		free_block(block_list[direct_index]);
-		block_list[direct_index] = 0;
 
-		// Check if we need to free the indirect block
-		if(direct_index == 0) {
-			free_block(indirect_block_list[indirect_index]);
-			indirect_block_list[indirect_index] = 0;
-		}
-
-		// Now check if we need to free indirect2 block
-		if(direct_index == 0 && indirect_index == 0) {
-			free_block(oi->oi_indirect2);
-			oi->oi_indirect2 = 0;
-		}
-	}
-	// Don't know what is going on if we get here...
-	else {
-		return -EIO;
-	}
+	// Free indirect blocks that only mapped that block
+	ospfs_release_indirect(oi, n - 1);
 
-	/* EXERCISE: Your code here */
 	oi->oi_size = (n-1)*OSPFS_BLKSIZE;
-	return 0; // Replace this line
+	return 0;
 }
 
 
@@ -970,6 +2656,18 @@ change_size(ospfs_inode_t *oi, uint32_t new_size)
 	if(OSPFS_MAXFILESIZE < new_size)
 		return -ENOSPC;
 
+	// Inline files stay inline while they fit
+	if (ospfs_is_inline(oi)) {
+		if (new_size <= OSPFS_INLINE_MAX) {
+			if (new_size < old_size)
+				memset(ospfs_inline_data(oi) + new_size, 0, old_size - new_size);
+			oi->oi_size = new_size;
+			return 0;
+		}
+		if ((r = ospfs_uninline(oi)) < 0)
+			return r;
+	}
+
 	while (ospfs_size2nblocks(oi->oi_size) < ospfs_size2nblocks(new_size)) {
         /* EXERCISE: Your code here */
 		r = add_block(oi);
@@ -996,65 +2694,1789 @@ change_size(ospfs_inode_t *oi, uint32_t new_size)
 }
 
 
-// ospfs_notify_change
-//	This function gets called when the user changes a file's size,
-//	owner, or permissions, among other things.
-//	OSPFS only pays attention to file size changes (see change_size above).
-//	We have written this function for you -- except for file quotas.
+// ospfs_free_file(oi)
+//	Frees all of file 'oi's blocks, as change_size(oi, 0) would, but
+//	walks the block pointers once and hands physically consecutive
+//	blocks back to the bitmap as runs.
 
-static int
-ospfs_notify_change(struct dentry *dentry, struct iattr *attr)
+struct ospfs_run {
+	uint32_t r_start;
+	uint32_t r_len;
+};
+
+static void
+ospfs_run_add(struct ospfs_run *run, uint32_t blockno)
 {
-	struct inode *inode = dentry->d_inode;
-	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
-	int retval = 0;
+	if (!blockno)
+		return;
+	if (run->r_len && blockno == run->r_start + run->r_len) {
+		run->r_len++;
+		return;
+	}
+	if (run->r_len)
+		ospfs_free_blocks(run->r_start, run->r_len);
+	run->r_start = blockno;
+	run->r_len = 1;
+}
 
-	if (attr->ia_valid & ATTR_SIZE) {
-		// We should not be able to change directory size
-		if (oi->oi_ftype == OSPFS_FTYPE_DIR)
-			return -EPERM;
-		if ((retval = change_size(oi, attr->ia_size)) < 0)
-			goto out;
+static void
+ospfs_free_file(ospfs_inode_t *oi)
+{
+	uint32_t nblocks = ospfs_size2nblocks(oi->oi_size), n, i;
+	struct ospfs_run run = { 0, 0 };
+	uint32_t *indirect, *indirect2;
+
+	if (ospfs_is_inline(oi)) {
+		memset(ospfs_inline_data(oi), 0, OSPFS_INLINE_MAX);
+		oi->oi_size = 0;
+		return;
 	}
 
-	if (attr->ia_valid & ATTR_MODE)
-		// Set this inode's mode to the value 'attr->ia_mode'.
-		oi->oi_mode = attr->ia_mode;
+	for (n = 0; n < MIN(nblocks, OSPFS_NDIRECT); n++)
+		ospfs_run_add(&run, oi->oi_direct[n]);
 
-	if ((retval = inode_change_ok(inode, attr)) < 0
-	    || (retval = inode_setattr(inode, attr)) < 0)
-		goto out;
+	if (oi->oi_indirect) {
+		indirect = ospfs_block(oi->oi_indirect);
+		for (n = OSPFS_NDIRECT, i = 0; n < nblocks && i < OSPFS_NINDIRECT; n++, i++)
+			ospfs_run_add(&run, indirect[i]);
+		ospfs_run_add(&run, oi->oi_indirect);
+	}
 
-    out:
-	return retval;
-}
+	if (oi->oi_indirect2) {
+		indirect2 = ospfs_block(oi->oi_indirect2);
+		n = OSPFS_NDIRECT + OSPFS_NINDIRECT;
+		for (i = 0; n < nblocks && i < OSPFS_NINDIRECT; i++, n += OSPFS_NINDIRECT) {
+			uint32_t j;
+			if (!indirect2[i])
+				continue;
+			indirect = ospfs_block(indirect2[i]);
+			for (j = 0; n + j < nblocks && j < OSPFS_NINDIRECT; j++)
+				ospfs_run_add(&run, indirect[j]);
+			ospfs_run_add(&run, indirect2[i]);
+		}
+		ospfs_run_add(&run, oi->oi_indirect2);
+	}
 
+	if (run.r_len)
+		ospfs_free_blocks(run.r_start, run.r_len);
+	memset(oi->oi_direct, 0, sizeof(oi->oi_direct));
+	oi->oi_indirect = oi->oi_indirect2 = 0;
+	oi->oi_size = 0;
+}
 
-// ospfs_read
-//	Linux calls this function to read data from a file.
-//	It is the file_operations.read callback.
-//
-//   Inputs:  filp	-- a file pointer
-//            buffer    -- a user space ptr where data should be copied
-//            count     -- the amount of data requested
-//            f_pos     -- points to the file position
-//   Returns: Number of chars read on success, -(error code) on error.
-//
-//   This function copies the corresponding bytes from the file into the user
-//   space ptr (buffer).  Use copy_to_user() to accomplish this.
-//   The current file position is passed into the function
-//   as 'f_pos'; read data starting at that position, and update the position
-//   when you're done.
-//
-//   EXERCISE: Complete this function.
 
-int i = 0;
-static ssize_t
+/*****************************************************************************
+ * INLINE DATA
+ *
+ *   Once an image has OSPFS_FEATURE_INCOMPAT_INLINE, small regular files
+ *   keep their data in the inode (see ospfs.h).  Files become inline only
+ *   while nobody is writing them: ospfs_put_info converts a file when its
+ *   last open file goes, and OSPFS_IOC_UPGRADE does on request.  Reads,
+ *   writes and truncates that stay within OSPFS_INLINE_MAX bytes work on
+ *   the inode directly.  Anything else that needs block pointers first
+ *   moves the data back out to a block, with ospfs_uninline.
+ *
+ *   The 'inline_data' parameter turns the feature on for images mounted
+ *   while it is set (see ospfs_check_features).  Modules that predate it
+ *   refuse those images.
+ */
+
+// ospfs_uninline(oi)
+//	Moves inline file 'oi's data out to a new block, making it an
+//	ordinary file again.  Does nothing to other files.  Returns 0 or
+//	-ENOSPC.
+
+static int
+ospfs_uninline(ospfs_inode_t *oi)
+{
+	uint32_t blockno = 0;
+
+	if (!ospfs_is_inline(oi))
+		return 0;
+	if (oi->oi_size) {
+		if (!(blockno = allocate_block(ospfs_block_goal(oi, 0))))
+			return -ENOSPC;
+		memset(ospfs_block(blockno), 0, OSPFS_BLKSIZE);
+		memcpy(ospfs_block(blockno), ospfs_inline_data(oi), oi->oi_size);
+	}
+	memset(ospfs_inline_data(oi), 0, OSPFS_INLINE_MAX);
+	oi->oi_direct[0] = blockno;
+	oi->oi_format = OSPFS_FORMAT_BLOCKS;
+	return 0;
+}
+
+// ospfs_inline(oi)
+//	Moves small regular file 'oi's data into the inode and frees its
+//	block, if the image allows inline data and is writable.  The caller
+//	makes sure the file has no buffered data and no other open file.
+
+static void
+ospfs_inline(ospfs_inode_t *oi)
+{
+	uint8_t data[OSPFS_INLINE_MAX];
+	uint32_t blockno = oi->oi_direct[0], n;
+
+	if (!(ospfs_super->os_feature_incompat & OSPFS_FEATURE_INCOMPAT_INLINE)
+	    || ospfs_rdonly || oi->oi_ftype != OSPFS_FTYPE_REG || oi->oi_nlink == 0
+	    || oi->oi_format != OSPFS_FORMAT_BLOCKS
+	    || oi->oi_size == 0 || oi->oi_size > OSPFS_INLINE_MAX
+	    || oi->oi_indirect || oi->oi_indirect2)
+		return;
+	for (n = 1; n < OSPFS_NDIRECT; n++)
+		if (oi->oi_direct[n])
+			return;
+
+	memset(data, 0, sizeof(data));
+	if (blockno)
+		memcpy(data, ospfs_block(blockno), oi->oi_size);
+	memcpy(ospfs_inline_data(oi), data, sizeof(data));
+	oi->oi_format = OSPFS_FORMAT_INLINE;
+	if (blockno)
+		free_block(blockno);
+}
+
+
+/*****************************************************************************
+ * DELAYED ALLOCATION
+ *
+ *   Writes to parts of a regular file that have no disk block yet (past
+ *   EOF, or in a hole) don't allocate one.  The data goes to an in-memory
+ *   buffer ('ospfs_dabuf_t'), and a free block is reserved for it.  The
+ *   file's oi_size still grows right away; only the block pointer stays 0.
+ *   When the file is flushed (on close and fsync, when buffers use up
+ *   the memory budget, or when the file has 'prealloc' buffers) all its
+ *   buffered blocks are allocated at once, so they can go in one
+ *   contiguous run after the file's existing data.
+ *   Data that is truncated away or unlinked before then never touches the
+ *   bitmap at all.
+ *
+ *   Buffers hang off an 'ospfs_inode_info_t', which exists while the inode
+ *   has open files.  Reads check the buffers before treating a missing
+ *   block as a hole.
+ *
+ *   Reservations cover the worst case: one block per buffer, plus every
+ *   indirect block that could be needed to map the highest buffered block.
+ *   So a flush can't run out of space; what it doesn't use goes back.
+ *
+ *   Log-style writers append a few bytes at a time.  When a write stops
+ *   partway into a buffer, 'ii_tail' remembers that buffer, and a write
+ *   that continues exactly there and fits in the rest of it is just a
+ *   copy: no size checks, block map or buffer lookups.  A write that
+ *   fills the buffer ends the tail, since the next buffer may not exist
+ *   yet; the following write takes the normal path, which finds or adds
+ *   that buffer and starts a new tail in it.  Anything that frees
+ *   buffers (flushes and discards) forgets the tail first.
+ */
+
+static unsigned int ospfs_da_window = 0;
+module_param_named(prealloc, ospfs_da_window, uint, 0644);
+MODULE_PARM_DESC(prealloc, "Blocks a file buffers before allocating them as one run (0 = until close)");
+
+#define OSPFS_INFO_HASHBITS	6
+
+static struct hlist_head ospfs_info_hash[1 << OSPFS_INFO_HASHBITS];
+static DEFINE_SPINLOCK(ospfs_info_lock);
+
+// ospfs_get_info(ino, create)
+//	Returns a new reference to inode 'ino's in-memory state, creating it
+//	if 'create' is set.  Returns NULL if there is none (or no memory).
+
+static ospfs_inode_info_t *
+ospfs_get_info(ino_t ino, int create)
+{
+	struct hlist_head *head = &ospfs_info_hash[hash_long(ino, OSPFS_INFO_HASHBITS)];
+	ospfs_inode_info_t *ii, *new_ii = NULL;
+	struct hlist_node *pos;
+
+    retry:
+	spin_lock(&ospfs_info_lock);
+	hlist_for_each_entry(ii, pos, head, ii_hash)
+		if (ii->ii_ino == ino) {
+			ii->ii_count++;
+			spin_unlock(&ospfs_info_lock);
+			if (new_ii)
+				ospfs_cache_free(OSPFS_CACHE_INODE, new_ii);
+			return ii;
+		}
+	if (new_ii) {
+		hlist_add_head(&new_ii->ii_hash, head);
+		spin_unlock(&ospfs_info_lock);
+		return new_ii;
+	}
+	spin_unlock(&ospfs_info_lock);
+
+	if (!create
+	    || !(new_ii = ospfs_cache_alloc(OSPFS_CACHE_INODE, GFP_KERNEL)))
+		return NULL;
+	memset(new_ii, 0, sizeof(*new_ii));
+	new_ii->ii_ino = ino;
+	new_ii->ii_count = 1;
+	mutex_init(&new_ii->ii_mutex);
+	INIT_RADIX_TREE(&new_ii->ii_dirty, GFP_KERNEL);
+	goto retry;
+}
+
+// ospfs_meta_blocks(nblocks)
+//	Returns the number of indirect blocks a file of 'nblocks' blocks can
+//	need.
+
+static uint32_t
+ospfs_meta_blocks(uint32_t nblocks)
+{
+	if (nblocks <= OSPFS_NDIRECT)
+		return 0;
+	else if (nblocks <= OSPFS_NDIRECT + OSPFS_NINDIRECT)
+		return 1;
+	nblocks -= OSPFS_NDIRECT + OSPFS_NINDIRECT;
+	return 2 + (nblocks - 1) / OSPFS_NINDIRECT;
+}
+
+// ospfs_da_buffer(ii, n)
+//	Returns the buffer for file block 'n', creating a zeroed one (and
+//	reserving space for it) if necessary.  Returns an ERR_PTR on failure.
+//	Caller holds ii->ii_mutex.
+
+static ospfs_dabuf_t *
+ospfs_da_buffer(ospfs_inode_info_t *ii, uint32_t n)
+{
+	ospfs_dabuf_t *db;
+	uint32_t need = 1;
+	int r;
+
+	if ((db = radix_tree_lookup(&ii->ii_dirty, n)))
+		return db;
+
+	if (n >= ii->ii_metatop)
+		need += ospfs_meta_blocks(n + 1) - ospfs_meta_blocks(ii->ii_metatop);
+	if ((r = ospfs_reserve_blocks(need)) < 0)
+		return ERR_PTR(r);
+
+	if (!(db = ospfs_cache_alloc(OSPFS_CACHE_DABUF, GFP_KERNEL))) {
+		ospfs_unreserve_blocks(need);
+		return ERR_PTR(-ENOMEM);
+	}
+	memset(db->db_data, 0, OSPFS_BLKSIZE);
+	db->db_index = n;
+	if ((r = radix_tree_insert(&ii->ii_dirty, n, db)) < 0) {
+		ospfs_cache_free(OSPFS_CACHE_DABUF, db);
+		ospfs_unreserve_blocks(need);
+		return ERR_PTR(r);
+	}
+
+	ii->ii_ndirty++;
+	ii->ii_nreserved += need;
+	ii->ii_metatop = MAX(ii->ii_metatop, n + 1);
+	return db;
+}
+
+// ospfs_da_done(ii)
+//	Gives back leftover reservations once 'ii' has no buffers.
+
+static void
+ospfs_da_done(ospfs_inode_info_t *ii)
+{
+	if (ii->ii_ndirty)
+		return;
+	ospfs_unreserve_blocks(ii->ii_nreserved);
+	ii->ii_nreserved = 0;
+	ii->ii_metatop = 0;
+}
+
+// ospfs_da_discard(ii, from), ospfs_da_discard_range(ii, from, to)
+//	Throws away the buffers for file blocks 'from' and up (for a truncate
+//	or unlink), or for blocks [from, to) (for a hole punch).  Caller holds
+//	ii->ii_mutex.
+
+static void
+ospfs_da_discard_range(ospfs_inode_info_t *ii, uint32_t from, uint32_t to)
+{
+	ospfs_dabuf_t *batch[16];
+	unsigned int i, n;
+
+	ii->ii_tail = NULL;
+	while (ii->ii_ndirty && from < to
+	       && (n = radix_tree_gang_lookup(&ii->ii_dirty, (void **) batch, from, 16)) > 0)
+		for (i = 0; i < n; i++) {
+			if (batch[i]->db_index >= to) {
+				from = to;
+				break;
+			}
+			from = batch[i]->db_index + 1;
+			radix_tree_delete(&ii->ii_dirty, batch[i]->db_index);
+			ospfs_cache_free(OSPFS_CACHE_DABUF, batch[i]);
+			ii->ii_ndirty--;
+			ii->ii_nreserved--;
+			ospfs_unreserve_blocks(1);
+		}
+	ospfs_da_done(ii);
+}
+
+static void
+ospfs_da_discard(ospfs_inode_info_t *ii, uint32_t from)
+{
+	ospfs_da_discard_range(ii, from, (uint32_t) -1);
+}
+
+// ospfs_da_slot(ii, oi, n)
+//	Returns the block pointer for block 'n', taking any indirect blocks
+//	it needs from 'ii's reservation.
+
+static uint32_t *
+ospfs_da_slot(ospfs_inode_info_t *ii, ospfs_inode_t *oi, uint32_t n)
+{
+	uint32_t *slot, used;
+
+	if ((slot = ospfs_bmap_slot(oi, n, 0)))
+		return slot;
+	used = (n >= OSPFS_NDIRECT + OSPFS_NINDIRECT && !oi->oi_indirect2) ? 2 : 1;
+	if ((slot = ospfs_bmap_slot(oi, n, OSPFS_BMAP_CREATE | OSPFS_BMAP_RESERVED)))
+		ii->ii_nreserved -= MIN(used, ii->ii_nreserved);
+	return slot;
+}
+
+// ospfs_da_flush(ii, oi)
+//	Allocates disk blocks for all of 'ii's buffers and copies the data
+//	there.  Buffered blocks are allocated together, starting right after
+//	the block before the first of them if possible.  Caller holds
+//	ii->ii_mutex.
+//
+//   Returns: 0 on success, -ENOSPC if space ran out (which reservations
+//	      should prevent); blocks not flushed keep their buffers.
+
+static int
+ospfs_da_flush(ospfs_inode_info_t *ii, ospfs_inode_t *oi)
+{
+	ospfs_dabuf_t *batch[16];
+	uint32_t index = 0, blockno = 0, left = 0, got, *slot;
+	unsigned int i, n;
+	int r = 0;
+
+	ii->ii_tail = NULL;
+	while (ii->ii_ndirty
+	       && (n = radix_tree_gang_lookup(&ii->ii_dirty, (void **) batch, index, 16)) > 0)
+		for (i = 0; i < n; i++) {
+			ospfs_dabuf_t *db = batch[i];
+
+			if (left == 0) {
+				uint32_t goal = ospfs_block_goal(oi, db->db_index);
+				if (!(blockno = ospfs_alloc_run(goal, ii->ii_ndirty, &got, 1))) {
+					r = -ENOSPC;
+					goto out;
+				}
+				ii->ii_nreserved -= MIN(got, ii->ii_nreserved);
+				left = got;
+			}
+
+			if (!(slot = ospfs_da_slot(ii, oi, db->db_index))) {
+				r = -ENOSPC;
+				goto out;
+			}
+			if (!*slot) {
+				*slot = blockno++;
+				left--;
+			}
+			memcpy(ospfs_block(*slot), db->db_data, OSPFS_BLKSIZE);
+
+			index = db->db_index + 1;
+			radix_tree_delete(&ii->ii_dirty, db->db_index);
+			ospfs_cache_free(OSPFS_CACHE_DABUF, db);
+			ii->ii_ndirty--;
+		}
+
+    out:
+	// Hand back the unused part of the last run
+	while (left-- > 0)
+		free_block(blockno++);
+	ospfs_da_done(ii);
+	if (r < 0)
+		eprintk("OSPFS: out of space flushing inode %lu\n", (unsigned long) ii->ii_ino);
+	return r;
+}
+
+// ospfs_put_info(ii)
+//	Drops a reference to 'ii'.  When the last reference goes, buffered
+//	data is flushed, or discarded if the file has been deleted, and a
+//	small enough file is made inline.
+
+static void
+ospfs_put_info(ospfs_inode_info_t *ii)
+{
+	ospfs_inode_t *oi = ospfs_inode(ii->ii_ino);
+	uint32_t left;
+
+	spin_lock(&ospfs_info_lock);
+	while (ii->ii_count == 1) {
+		// Flush without the spinlock.  Anyone who gets a reference in
+		// the meantime keeps 'ii' alive, and their data with it.
+		spin_unlock(&ospfs_info_lock);
+		mutex_lock(&ii->ii_mutex);
+		if (oi->oi_nlink == 0)
+			ospfs_da_discard(ii, 0);
+		else if (ospfs_da_flush(ii, oi) >= 0 && !ii->ii_ndirty)
+			ospfs_inline(oi);
+		left = ii->ii_ndirty;
+		mutex_unlock(&ii->ii_mutex);
+		spin_lock(&ospfs_info_lock);
+		// Someone may have opened the file, buffered more data and
+		// closed it again meanwhile; their close left it to us
+		if (ii->ii_count != 1 || ii->ii_ndirty <= left)
+			break;
+	}
+	if (--ii->ii_count > 0) {
+		spin_unlock(&ospfs_info_lock);
+		return;
+	}
+	hlist_del(&ii->ii_hash);
+	spin_unlock(&ospfs_info_lock);
+
+	if (ii->ii_ndirty) {
+		eprintk("OSPFS: dropping %u unflushed blocks of inode %lu\n",
+			ii->ii_ndirty, (unsigned long) ii->ii_ino);
+		ospfs_da_discard(ii, 0);
+	}
+	ospfs_cache_free(OSPFS_CACHE_INODE, ii);
+
+	// An unlinked file's last close lets its blocks go
+	if (oi->oi_ftype == OSPFS_FTYPE_ORPHAN)
+		ospfs_queue_reclaim();
+}
+
+// ospfs_info_busy(ino)
+//	Returns nonzero if inode 'ino' has open files.
+
+static int
+ospfs_info_busy(ino_t ino)
+{
+	struct hlist_head *head = &ospfs_info_hash[hash_long(ino, OSPFS_INFO_HASHBITS)];
+	ospfs_inode_info_t *ii;
+	struct hlist_node *pos;
+	int busy = 0;
+
+	spin_lock(&ospfs_info_lock);
+	hlist_for_each_entry(ii, pos, head, ii_hash)
+		if (ii->ii_ino == ino) {
+			busy = 1;
+			break;
+		}
+	spin_unlock(&ospfs_info_lock);
+	return busy;
+}
+
+
+/*****************************************************************************
+ * ORPHAN RECLAMATION
+ *
+ *   Freeing a big file's blocks takes a while, so ospfs_unlink doesn't do
+ *   it.  It turns the inode into an orphan (see ospfs.h) and returns, and
+ *   a worker thread frees the orphan's blocks and then the inode itself.
+ *   Orphans that are still open wait for their last close.  statfs counts
+ *   the blocks of orphans as free, and allocations that find the disk full
+ *   wait for pending reclamation before giving up.
+ *
+ *   The list lives in the image, so orphans left behind by an interrupted
+ *   reclaim are picked up again at mount time.
+ */
+
+#define OSPFS_RECLAIM_CHUNK	256	// Blocks freed between reschedules
+
+static DEFINE_SPINLOCK(ospfs_orphan_lock);
+
+static void ospfs_reclaim(struct work_struct *work);
+static DECLARE_WORK(ospfs_reclaim_work, ospfs_reclaim);
+
+static void
+ospfs_queue_reclaim(void)
+{
+	queue_work(ospfs_wq, &ospfs_reclaim_work);
+}
+
+// ospfs_add_orphan(ino)
+//	Puts unlinked inode 'ino' on the orphan list and kicks the worker.
+
+static void
+ospfs_add_orphan(ino_t ino)
+{
+	ospfs_inode_t *oi = ospfs_inode(ino);
+
+	spin_lock(&ospfs_orphan_lock);
+	oi->oi_ftype = OSPFS_FTYPE_ORPHAN;
+	oi->oi_mode = ospfs_super->os_orphan;
+	ospfs_super->os_orphan = ino;
+	spin_unlock(&ospfs_orphan_lock);
+	ospfs_queue_reclaim();
+}
+
+// ospfs_orphan_pending(nblocks)
+//	Returns the number of orphans, and sets '*nblocks' to about how many
+//	blocks they hold.
+
+static uint32_t
+ospfs_orphan_pending(uint32_t *nblocks)
+{
+	uint32_t ino, n = 0;
+
+	*nblocks = 0;
+	spin_lock(&ospfs_orphan_lock);
+	for (ino = ospfs_super->os_orphan; ino; ino = ospfs_inode(ino)->oi_mode) {
+		uint32_t size = ospfs_size2nblocks(ospfs_inode(ino)->oi_size);
+		*nblocks += size + ospfs_meta_blocks(size);
+		n++;
+	}
+	spin_unlock(&ospfs_orphan_lock);
+	return n;
+}
+
+// ospfs_wait_reclaim()
+//	Waits for the worker to reclaim what it can.  Returns 0 if there
+//	were no orphans to wait for.
+
+static int
+ospfs_wait_reclaim(void)
+{
+	if (!ospfs_super->os_orphan || !ospfs_wq)
+		return 0;
+	flush_workqueue(ospfs_wq);
+	return 1;
+}
+
+// ospfs_reclaim(work)
+//	The worker.  Frees the blocks of every orphan that isn't open, a
+//	chunk at a time, then the orphan itself.
+
+static void
+ospfs_reclaim(struct work_struct *work)
+{
+	uint32_t ino, *prev;
+	ospfs_inode_t *oi;
+
+	for (;;) {
+		// Find an orphan with no open files
+		spin_lock(&ospfs_orphan_lock);
+		for (ino = ospfs_super->os_orphan; ino; ino = ospfs_inode(ino)->oi_mode)
+			if (!ospfs_info_busy(ino))
+				break;
+		spin_unlock(&ospfs_orphan_lock);
+		if (!ino)
+			return;
+
+		// Only this worker changes orphans, so no lock is needed
+		oi = ospfs_inode(ino);
+		while (oi->oi_size > 0) {
+			uint32_t n = ospfs_size2nblocks(oi->oi_size);
+			change_size(oi, n > OSPFS_RECLAIM_CHUNK ? (n - OSPFS_RECLAIM_CHUNK) * OSPFS_BLKSIZE : 0);
+			cond_resched();
+		}
+
+		spin_lock(&ospfs_orphan_lock);
+		for (prev = &ospfs_super->os_orphan; *prev != ino; prev = &ospfs_inode(*prev)->oi_mode)
+			/* nothing */;
+		*prev = oi->oi_mode;
+		spin_unlock(&ospfs_orphan_lock);
+		ospfs_free_inode(ino);
+	}
+}
+
+
+/*****************************************************************************
+ * FREED-BLOCK DISCARD
+ *
+ *   A freed block keeps its old contents until it is reused.  Freed
+ *   blocks are marked in 'ospfs_discard_map' instead, and later discarded
+ *   in batches: group by group, under the group's lock, skipping any
+ *   that were reallocated in the meantime.  The OSPFS image is kernel
+ *   memory, not a file or device, so there is no host-side store to
+ *   punch holes in or send TRIM to; discarding a block means zeroing it,
+ *   so deleted data doesn't linger in the image.
+ *
+ *   A batch runs on the worker thread once 'discard_batch' freed blocks
+ *   are pending (0 means never), and synchronously at sync time.
+ */
+
+#define OSPFS_DISCARD_CHUNK	64	// Blocks zeroed per lock hold
+
+static unsigned int ospfs_discard_batch = 4096;
+module_param_named(discard_batch, ospfs_discard_batch, uint, 0644);
+MODULE_PARM_DESC(discard_batch, "Freed blocks that trigger a background discard (0 = only at sync)");
+
+// Added to by the worker and by ospfs_sync_fs at once, so atomic
+static atomic_long_t ospfs_discarded = ATOMIC_LONG_INIT(0);
+
+static int
+ospfs_get_discarded(char *buf, struct kernel_param *kp)
+{
+	return sprintf(buf, "%ld", atomic_long_read(&ospfs_discarded));
+}
+
+static int
+ospfs_set_discarded(const char *val, struct kernel_param *kp)
+{
+	return -EPERM;
+}
+
+module_param_call(discarded, ospfs_set_discarded, ospfs_get_discarded, NULL, 0444);
+MODULE_PARM_DESC(discarded, "Freed blocks discarded so far");
+
+static void ospfs_discard(struct work_struct *work);
+static DECLARE_WORK(ospfs_discard_work, ospfs_discard);
+
+// ospfs_discard_note(n)
+//	Called after 'n' blocks were marked for discard.
+
+static void
+ospfs_discard_note(uint32_t n)
+{
+	unsigned int batch = ospfs_discard_batch;
+	if (atomic_add_return(n, &ospfs_ndiscard) >= batch && batch)
+		queue_work(ospfs_wq, &ospfs_discard_work);
+}
+
+static void
+ospfs_discard_group(struct ospfs_group *bg)
+{
+	uint32_t blockno = bg->bg_first, zeroed, seen;
+
+	while (blockno < bg->bg_end) {
+		spin_lock(&bg->bg_lock);
+		for (zeroed = seen = 0; bg->bg_ndiscard && blockno < bg->bg_end
+			     && zeroed < OSPFS_DISCARD_CHUNK; blockno++) {
+			if (!bitvector_test(ospfs_discard_map, blockno))
+				continue;
+			bitvector_clear(ospfs_discard_map, blockno);
+			bg->bg_ndiscard--;
+			seen++;
+			if (ospfs_freemap_test(blockno)) {
+				memset(ospfs_block(blockno), 0, OSPFS_BLKSIZE);
+				zeroed++;
+			}
+		}
+		if (!bg->bg_ndiscard)
+			blockno = bg->bg_end;
+		spin_unlock(&bg->bg_lock);
+
+		atomic_sub(seen, &ospfs_ndiscard);
+		atomic_long_add(zeroed, &ospfs_discarded);
+		cond_resched();
+	}
+}
+
+// ospfs_discard(work)
+//	Discards every pending freed block.  Runs on the worker thread, and
+//	directly from ospfs_sync_fs.
+
+static void
+ospfs_discard(struct work_struct *work)
+{
+	uint32_t g;
+	for (g = 0; g < ospfs_ngroups; g++)
+		if (ospfs_groups[g].bg_ndiscard)
+			ospfs_discard_group(&ospfs_groups[g]);
+}
+
+
+// ospfs_truncate(inode, oi, size)
+//	Sets regular file 'oi's size, dropping any buffered data past the new
+//	end first.
+
+static int
+ospfs_truncate(struct inode *inode, ospfs_inode_t *oi, uint32_t size)
+{
+	ospfs_inode_info_t *ii = ospfs_get_info(inode->i_ino, 0);
+	ospfs_dabuf_t *db;
+	int r;
+
+	if (!ii)
+		return change_size(oi, size);
+
+	mutex_lock(&ii->ii_mutex);
+	if (size < oi->oi_size) {
+		ospfs_da_discard(ii, ospfs_size2nblocks(size));
+		// Zero the tail of a partial last block, in case the file grows
+		if (size % OSPFS_BLKSIZE
+		    && (db = radix_tree_lookup(&ii->ii_dirty, size / OSPFS_BLKSIZE)))
+			memset(db->db_data + size % OSPFS_BLKSIZE, 0,
+			       OSPFS_BLKSIZE - size % OSPFS_BLKSIZE);
+	}
+	r = change_size(oi, size);
+	mutex_unlock(&ii->ii_mutex);
+	ospfs_put_info(ii);
+	return r;
+}
+
+
+// ospfs_fallocate(inode, mode, offset, len)
+//	The inode_operations.fallocate callback.  Only hole punching is
+//	supported (FALLOC_FL_PUNCH_HOLE, with FALLOC_FL_KEEP_SIZE as Linux
+//	requires): the whole blocks inside the range are freed, along with
+//	any indirect blocks left empty, and the partial blocks at its ends
+//	are zeroed.  The file size doesn't change.  OSPFS has no unwritten
+//	extents, so there is no preallocation.
+
+#ifndef FALLOC_FL_PUNCH_HOLE
+# define FALLOC_FL_PUNCH_HOLE	0x02
+#endif
+
+// Zero bytes [start, end) of file 'oi', all within one block.
+static void
+ospfs_zero_partial(ospfs_inode_info_t *ii, ospfs_inode_t *oi, uint32_t start, uint32_t end)
+{
+	uint32_t *slot = ospfs_bmap_slot(oi, start / OSPFS_BLKSIZE, 0);
+	ospfs_dabuf_t *db;
+
+	if (start >= end)
+		return;
+	if (slot && *slot)
+		memset((uint8_t *) ospfs_block(*slot) + start % OSPFS_BLKSIZE, 0, end - start);
+	else if (ii && (db = radix_tree_lookup(&ii->ii_dirty, start / OSPFS_BLKSIZE)))
+		memset(db->db_data + start % OSPFS_BLKSIZE, 0, end - start);
+}
+
+// Free indirect block '*blockp' if it maps nothing.
+static void
+ospfs_prune_indirect(uint32_t *blockp)
+{
+	uint32_t *p, i;
+	if (!*blockp)
+		return;
+	p = ospfs_block(*blockp);
+	for (i = 0; i < OSPFS_NINDIRECT && !p[i]; i++)
+		/* nothing */;
+	if (i == OSPFS_NINDIRECT) {
+		free_block(*blockp);
+		*blockp = 0;
+	}
+}
+
+static long
+ospfs_fallocate(struct inode *inode, int mode, loff_t offset, loff_t len)
+{
+	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
+	ospfs_inode_info_t *ii;
+	struct ospfs_run run = { 0, 0 };
+	uint32_t start, end, first, last, n, *slot;
+
+	if (mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))
+		return -EOPNOTSUPP;
+	if (offset < 0 || len <= 0)
+		return -EINVAL;
+
+	if ((ii = ospfs_get_info(inode->i_ino, 0)))
+		mutex_lock(&ii->ii_mutex);
+	if (offset >= oi->oi_size)
+		goto out;
+	start = offset;
+	end = MIN(offset + len, (loff_t) oi->oi_size);
+	ospfs_touch(oi, inode, S_MTIME | S_CTIME);
+	if (ospfs_is_inline(oi)) {
+		memset(ospfs_inline_data(oi) + start, 0, end - start);
+		goto out;
+	}
+
+	// Whole blocks [first, last); a partial last block of the file
+	// counts as whole, since nothing past EOF matters
+	first = ospfs_size2nblocks(start);
+	last = (end == oi->oi_size) ? ospfs_size2nblocks(end) : end / OSPFS_BLKSIZE;
+	if (first >= last) {
+		ospfs_zero_partial(ii, oi, start, end);
+		goto out;
+	}
+	ospfs_zero_partial(ii, oi, start, first * OSPFS_BLKSIZE);
+	if (last * OSPFS_BLKSIZE < end)
+		ospfs_zero_partial(ii, oi, last * OSPFS_BLKSIZE, end);
+
+	if (ii)
+		ospfs_da_discard_range(ii, first, last);
+	for (n = first; n < last; n++) {
+		if (!(slot = ospfs_bmap_slot(oi, n, 0))) {
+			n = ospfs_indirect_end(n) - 1;
+			continue;
+		}
+		ospfs_run_add(&run, *slot);
+		*slot = 0;
+	}
+	if (run.r_len)
+		ospfs_free_blocks(run.r_start, run.r_len);
+
+	// Indirect blocks covering the hole may now be empty
+	if (last > OSPFS_NDIRECT)
+		ospfs_prune_indirect(&oi->oi_indirect);
+	if (last > OSPFS_NDIRECT + OSPFS_NINDIRECT && oi->oi_indirect2) {
+		uint32_t *indirect2 = ospfs_block(oi->oi_indirect2);
+		uint32_t lo = MAX(first, OSPFS_NDIRECT + OSPFS_NINDIRECT) - OSPFS_NDIRECT - OSPFS_NINDIRECT;
+		uint32_t hi = last - 1 - OSPFS_NDIRECT - OSPFS_NINDIRECT;
+		for (n = lo / OSPFS_NINDIRECT; n <= hi / OSPFS_NINDIRECT; n++)
+			ospfs_prune_indirect(&indirect2[n]);
+		ospfs_prune_indirect(&oi->oi_indirect2);
+	}
+
+    out:
+	if (ii) {
+		mutex_unlock(&ii->ii_mutex);
+		ospfs_put_info(ii);
+	}
+	return 0;
+}
+
+
+// ospfs_notify_change
+//	This function gets called when the user changes a file's size,
+//	owner, or permissions, among other things.
+//	OSPFS only pays attention to file size changes (see change_size above).
+//	We have written this function for you -- except for file quotas.
+
+static int
+ospfs_notify_change(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = dentry->d_inode;
+	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
+	int retval = 0;
+
+	if (attr->ia_valid & ATTR_SIZE) {
+		// We should not be able to change directory size
+		if (oi->oi_ftype == OSPFS_FTYPE_DIR)
+			return -EPERM;
+		if ((retval = ospfs_truncate(inode, oi, attr->ia_size)) < 0)
+			goto out;
+		ospfs_trace(OSPFS_TRACE_TRUNCATE, inode->i_ino, 0, attr->ia_size, 0);
+	}
+
+	if (attr->ia_valid & ATTR_MODE)
+		// Set this inode's mode to the value 'attr->ia_mode'.
+		oi->oi_mode = attr->ia_mode;
+
+	if ((retval = inode_change_ok(inode, attr)) < 0
+	    || (retval = inode_setattr(inode, attr)) < 0)
+		goto out;
+
+	// inode_setattr has set the times the caller asked for (including
+	// those implied by a size change); keep them
+	if (attr->ia_valid & ATTR_ATIME)
+		ospfs_set_time(&oi->oi_atime, inode->i_atime);
+	if (attr->ia_valid & ATTR_MTIME)
+		ospfs_set_time(&oi->oi_mtime, inode->i_mtime);
+	if (attr->ia_valid & ATTR_CTIME)
+		ospfs_set_time(&oi->oi_ctime, inode->i_ctime);
+
+    out:
+	return retval;
+}
+
+
+/*****************************************************************************
+ * SCRUBBER
+ *
+ *   Damage to a long-lived image otherwise shows up only when something
+ *   reads the damaged part.  The scrubber is a kernel thread that checks
+ *   the whole image every 'scrub_interval' seconds, in physical order:
+ *   first the inode table, following each file's block pointers and
+ *   directory entries from there, then a sweep of the data blocks
+ *   comparing the free-block bitmap with what the files use.  It checks
+ *   that
+ *     - metadata blocks are marked in use,
+ *     - inodes have a valid type and size,
+ *     - every block pointer lies within the data area,
+ *     - no block belongs to two files, and the bitmap marks exactly the
+ *	 blocks that files use, and
+ *     - directory entries name in-use inodes.
+ *   OSPFS keeps no checksums, so the contents of data blocks can't be
+ *   verified.
+ *
+ *   The scrubber reads the image while it changes, so a block can look
+ *   leaked or doubly used, or a pointer bad, just because an allocation,
+ *   truncate or inline conversion was halfway done.  Those problems are
+ *   only reported if the next pass finds them again.
+ *
+ *   Reads are charged against 'scrub_rate' (KB/s; 0, the default, turns
+ *   the scrubber off), and the scrubber waits while files are being read
+ *   or written.  'scrub_pos', 'scrub_passes' and 'scrub_errors' report
+ *   its progress.
+ */
+
+#define OSPFS_SCRUB_BATCH	64		// Blocks read between sleeps
+#define OSPFS_SCRUB_IDLE	(HZ / 10)	// Quiet time before scrubbing
+
+static unsigned int ospfs_scrub_rate = 0;
+module_param_named(scrub_rate, ospfs_scrub_rate, uint, 0644);
+MODULE_PARM_DESC(scrub_rate, "Scrubber bandwidth cap in KB/s (0 = off)");
+
+static unsigned int ospfs_scrub_interval = 24 * 60 * 60;
+module_param_named(scrub_interval, ospfs_scrub_interval, uint, 0644);
+MODULE_PARM_DESC(scrub_interval, "Seconds between the starts of scrub passes");
+
+static unsigned int ospfs_scrub_pos;
+module_param_named(scrub_pos, ospfs_scrub_pos, uint, 0444);
+MODULE_PARM_DESC(scrub_pos, "Block the current scrub pass has reached");
+
+static unsigned long ospfs_scrub_passes;
+module_param_named(scrub_passes, ospfs_scrub_passes, ulong, 0444);
+MODULE_PARM_DESC(scrub_passes, "Scrub passes completed");
+
+static unsigned long ospfs_scrub_errors;
+module_param_named(scrub_errors, ospfs_scrub_errors, ulong, 0444);
+MODULE_PARM_DESC(scrub_errors, "Problems the scrubber has found");
+
+// When a file was last read or written
+static unsigned long ospfs_last_io;
+
+static struct task_struct *ospfs_scrub_task;
+static uint32_t *ospfs_scrub_used;	// Blocks used by files this pass
+static uint32_t *ospfs_scrub_suspect;	// Possible problems from last pass
+static uint32_t *ospfs_scrub_next;	// ... and from this pass
+static uint32_t ospfs_scrub_charged;	// Blocks read since the last sleep
+
+#define ospfs_scrub_error(format, ...) do {				\
+		ospfs_scrub_errors++;					\
+		if (printk_ratelimit())					\
+			eprintk("OSPFS: scrub: " format, ## __VA_ARGS__); \
+	} while (0)
+
+// ospfs_scrub_throttle(nblocks)
+//	Charges the scrubber for reading 'nblocks' blocks, sleeping as needed
+//	to stay under 'scrub_rate' and to stay out of the way of file I/O.
+
+static void
+ospfs_scrub_throttle(uint32_t nblocks)
+{
+	unsigned int rate;
+
+	if ((ospfs_scrub_charged += nblocks) < OSPFS_SCRUB_BATCH)
+		return;
+	while (!(rate = ospfs_scrub_rate) && !kthread_should_stop())
+		schedule_timeout_interruptible(HZ);
+	if (rate)
+		schedule_timeout_interruptible(msecs_to_jiffies(
+			ospfs_scrub_charged * (OSPFS_BLKSIZE / 1024) * 1000 / rate));
+	ospfs_scrub_charged = 0;
+	while (time_before(jiffies, ospfs_last_io + OSPFS_SCRUB_IDLE)
+	       && !kthread_should_stop())
+		schedule_timeout_interruptible(OSPFS_SCRUB_IDLE);
+}
+
+// ospfs_scrub_suspicious(blockno)
+//	Notes a problem with 'blockno' that might be a change in progress.
+//	Returns nonzero if the previous pass saw one too, so it is real.
+
+static int
+ospfs_scrub_suspicious(uint32_t blockno)
+{
+	bitvector_set(ospfs_scrub_next, blockno);
+	return bitvector_test(ospfs_scrub_suspect, blockno);
+}
+
+// ospfs_scrub_ref(ino, blockno)
+//	Records that inode 'ino' uses block 'blockno'.  Returns 0 if the block
+//	number is out of range (so the block mustn't be read), 1 otherwise.
+//	A file changing to or from inline data has data where its pointers
+//	were for a moment, so a bad pointer counts against the inode's block
+//	of the inode table and is only reported if seen there twice.
+
+static int
+ospfs_scrub_ref(uint32_t ino, uint32_t blockno)
+{
+	if (blockno < OSPFS_FIRST_VALID_BLOCK || blockno >= ospfs_super->os_nblocks) {
+		if (ospfs_scrub_suspicious(ospfs_super->os_firstinob + ino / OSPFS_BLKINODES))
+			ospfs_scrub_error("inode %u points to bad block %u\n", ino, blockno);
+		return 0;
+	}
+	if (!bitvector_test(ospfs_scrub_used, blockno))
+		bitvector_set(ospfs_scrub_used, blockno);
+	else if (ospfs_scrub_suspicious(blockno))
+		ospfs_scrub_error("block %u is used twice (again by inode %u)\n",
+				  blockno, ino);
+	return 1;
+}
+
+// ospfs_scrub_indirect(ino, blockno)
+//	Checks indirect block 'blockno' of inode 'ino' and records the blocks
+//	it points to.  Returns 0 if any pointer was out of range.
+
+static int
+ospfs_scrub_indirect(uint32_t ino, uint32_t blockno)
+{
+	uint32_t *indirect = ospfs_block(blockno);
+	int i, ok = 1;
+
+	ospfs_scrub_throttle(1);
+	for (i = 0; i < OSPFS_NINDIRECT; i++)
+		if (indirect[i] && !ospfs_scrub_ref(ino, indirect[i]))
+			ok = 0;
+	return ok;
+}
+
+// ospfs_scrub_blocks(ino, oi)
+//	Checks and records the blocks of inode 'ino'.  Returns 0 if any
+//	pointer was out of range.
+
+static int
+ospfs_scrub_blocks(uint32_t ino, ospfs_inode_t *oi)
+{
+	uint32_t *indirect2;
+	int i, ok = 1;
+
+	if (oi->oi_xattr && !ospfs_scrub_ref(ino, oi->oi_xattr))
+		ok = 0;
+	if (ospfs_is_inline(oi))
+		return ok;
+	for (i = 0; i < OSPFS_NDIRECT; i++)
+		if (oi->oi_direct[i] && !ospfs_scrub_ref(ino, oi->oi_direct[i]))
+			ok = 0;
+	if (oi->oi_indirect
+	    && (!ospfs_scrub_ref(ino, oi->oi_indirect)
+		|| !ospfs_scrub_indirect(ino, oi->oi_indirect)))
+		ok = 0;
+	if (oi->oi_indirect2) {
+		if (!ospfs_scrub_ref(ino, oi->oi_indirect2))
+			return 0;
+		indirect2 = ospfs_block(oi->oi_indirect2);
+		ospfs_scrub_throttle(1);
+		for (i = 0; i < OSPFS_NINDIRECT; i++)
+			if (indirect2[i]
+			    && (!ospfs_scrub_ref(ino, indirect2[i])
+				|| !ospfs_scrub_indirect(ino, indirect2[i])))
+				ok = 0;
+	}
+	return ok;
+}
+
+// ospfs_scrub_dir(ino, oi)
+//	Checks the entries of directory 'ino', whose block pointers are known
+//	to be in range.
+
+static void
+ospfs_scrub_dir(uint32_t ino, ospfs_inode_t *oi)
+{
+	uint32_t off, blockno;
+	ospfs_direntry_t *od;
+
+	for (off = 0; off < oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
+		if (!(blockno = ospfs_inode_blockno(oi, off)))
+			continue;
+		if (off % OSPFS_BLKSIZE == 0)
+			ospfs_scrub_throttle(1);
+		od = (ospfs_direntry_t *) ((uint8_t *) ospfs_block(blockno) + off % OSPFS_BLKSIZE);
+		if (!od->od_ino)
+			continue;
+		if (od->od_ino >= ospfs_super->os_ninodes)
+			ospfs_scrub_error("directory %u has an entry for bad inode %u\n",
+					  ino, od->od_ino);
+		else if (ospfs_inode_is_free(ospfs_inode(od->od_ino))
+			 && ospfs_scrub_suspicious(blockno))
+			ospfs_scrub_error("directory %u has an entry for free inode %u\n",
+					  ino, od->od_ino);
+	}
+}
+
+// ospfs_scrub_pass()
+//	Checks the whole image once.  Returns early if the thread is stopped.
+
+static void
+ospfs_scrub_pass(void)
+{
+	uint32_t nblocks = ospfs_super->os_nblocks, first = OSPFS_FIRST_VALID_BLOCK;
+	uint32_t ino, b, *t;
+	ospfs_inode_t *oi;
+
+	memset(ospfs_scrub_used, 0, (nblocks + 31) / 32 * 4);
+	memset(ospfs_scrub_next, 0, (nblocks + 31) / 32 * 4);
+
+	for (b = 0; b < first; b++)
+		if (ospfs_freemap_test(b))
+			ospfs_scrub_error("metadata block %u is marked free\n", b);
+
+	// The inode table, in order
+	for (ino = OSPFS_ROOT_INO; ino < ospfs_super->os_ninodes; ino++) {
+		if (kthread_should_stop())
+			return;
+		if (ino % OSPFS_BLKINODES == 0 || ino == OSPFS_ROOT_INO) {
+			ospfs_scrub_pos = ospfs_super->os_firstinob + ino / OSPFS_BLKINODES;
+			ospfs_scrub_throttle(1);
+		}
+		oi = ospfs_inode(ino);
+		if (ospfs_inode_is_free(oi) || oi->oi_ftype == OSPFS_FTYPE_SYMLINK)
+			continue;
+		if (oi->oi_ftype > OSPFS_FTYPE_ORPHAN) {
+			ospfs_scrub_error("inode %u has bad type %u\n", ino, oi->oi_ftype);
+			continue;
+		}
+		if (oi->oi_size > OSPFS_MAXFILESIZE)
+			ospfs_scrub_error("inode %u has bad size %u\n", ino, oi->oi_size);
+		if (ospfs_scrub_blocks(ino, oi) && oi->oi_ftype == OSPFS_FTYPE_DIR)
+			ospfs_scrub_dir(ino, oi);
+	}
+
+	// The data area: the bitmap must agree with what files use
+	for (b = first; b < nblocks; b++) {
+		int used = bitvector_test(ospfs_scrub_used, b);
+		if (b % OSPFS_SCRUB_BATCH == 0) {
+			if (kthread_should_stop())
+				return;
+			ospfs_scrub_pos = b;
+			cond_resched();
+		}
+		if (used == !ospfs_freemap_test(b) || !ospfs_scrub_suspicious(b))
+			continue;
+		if (used)
+			ospfs_scrub_error("block %u is in use but marked free\n", b);
+		else
+			ospfs_scrub_error("block %u is marked in use but unused\n", b);
+	}
+
+	ospfs_scrub_pos = nblocks;
+	ospfs_scrub_passes++;
+	t = ospfs_scrub_suspect;
+	ospfs_scrub_suspect = ospfs_scrub_next;
+	ospfs_scrub_next = t;
+}
+
+// ospfs_scrubd(arg)
+//	The scrubber thread.
+
+static int
+ospfs_scrubd(void *arg)
+{
+	unsigned long next = jiffies;
+
+	set_user_nice(current, 19);
+	while (!kthread_should_stop()) {
+		if (ospfs_scrub_rate && time_after_eq(jiffies, next)) {
+			next = jiffies + ospfs_scrub_interval * HZ;
+			ospfs_scrub_pass();
+		} else
+			schedule_timeout_interruptible(HZ);
+	}
+	return 0;
+}
+
+// ospfs_stop_scrub(), ospfs_start_scrub()
+//	Stop and start the scrubber at unmount and mount.  A scrubber that
+//	can't start is not fatal to the mount.
+
+static void
+ospfs_stop_scrub(void)
+{
+	if (ospfs_scrub_task)
+		kthread_stop(ospfs_scrub_task);
+	ospfs_scrub_task = NULL;
+	vfree(ospfs_scrub_used);
+	vfree(ospfs_scrub_suspect);
+	vfree(ospfs_scrub_next);
+	ospfs_scrub_used = ospfs_scrub_suspect = ospfs_scrub_next = NULL;
+}
+
+static void
+ospfs_start_scrub(void)
+{
+	size_t size = (ospfs_super->os_nblocks + 31) / 32 * 4;
+
+	ospfs_scrub_used = vmalloc(size);
+	ospfs_scrub_suspect = vmalloc(size);
+	ospfs_scrub_next = vmalloc(size);
+	if (ospfs_scrub_used && ospfs_scrub_suspect && ospfs_scrub_next) {
+		memset(ospfs_scrub_suspect, 0, size);
+		ospfs_scrub_task = kthread_run(ospfs_scrubd, NULL, "ospfs_scrub");
+		if (!IS_ERR(ospfs_scrub_task))
+			return;
+	}
+	eprintk("OSPFS: can't start the scrubber\n");
+	ospfs_scrub_task = NULL;
+	ospfs_stop_scrub();
+}
+
+
+/*****************************************************************************
+ * EXTENDED ATTRIBUTES
+ *
+ *   getxattr, setxattr, listxattr and removexattr for regular files and
+ *   directories, kept in the inode's attribute block (see ospfs.h).  The
+ *   "user.", "trusted." and "security." namespaces are supported; the VFS
+ *   checks the caller's permissions for each before calling us.
+ *
+ *   Changes rewrite the block in place, so readers take
+ *   'ospfs_xattr_mutex' too, and never see a list being moved around.
+ */
+
+static DEFINE_MUTEX(ospfs_xattr_mutex);
+
+// ospfs_xattr_namelen(name)
+//	Returns the length of attribute name 'name', or -EOPNOTSUPP if it is
+//	in an unsupported namespace, or -ERANGE if it is too long.
+
+static int
+ospfs_xattr_namelen(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (strncmp(name, XATTR_USER_PREFIX, XATTR_USER_PREFIX_LEN) != 0
+	    && strncmp(name, XATTR_TRUSTED_PREFIX, XATTR_TRUSTED_PREFIX_LEN) != 0
+	    && strncmp(name, XATTR_SECURITY_PREFIX, XATTR_SECURITY_PREFIX_LEN) != 0)
+		return -EOPNOTSUPP;
+	if (len > XATTR_NAME_MAX)
+		return -ERANGE;
+	return len;
+}
+
+// ospfs_xattr_find(xb, name, namelen, endp)
+//	Returns the entry for attribute 'name' in attribute block 'xb', or
+//	NULL if there is none.  Sets '*endp' to the offset of the end of the
+//	list.  An entry that would run past the end of the block ends it.
+
+static ospfs_xattr_entry_t *
+ospfs_xattr_find(uint8_t *xb, const char *name, int namelen, uint32_t *endp)
+{
+	ospfs_xattr_entry_t *oxe, *found = NULL;
+	uint32_t off, size;
+
+	for (off = 0; off + sizeof(*oxe) <= OSPFS_BLKSIZE; off += size) {
+		oxe = (ospfs_xattr_entry_t *) (xb + off);
+		size = OSPFS_XATTR_ENTRYSIZE(oxe->oxe_namelen, oxe->oxe_valuelen);
+		if (!oxe->oxe_namelen || off + size > OSPFS_BLKSIZE)
+			break;
+		if (name && oxe->oxe_namelen == namelen
+		    && memcmp(oxe + 1, name, namelen) == 0)
+			found = oxe;
+	}
+	*endp = off;
+	return found;
+}
+
+// ospfs_xattr_remove(xb, oxe, end)
+//	Removes entry 'oxe' from attribute block 'xb', whose list ends at
+//	offset 'end', and returns the new end.
+
+static uint32_t
+ospfs_xattr_remove(uint8_t *xb, ospfs_xattr_entry_t *oxe, uint32_t end)
+{
+	uint32_t off = (uint8_t *) oxe - xb;
+	uint32_t size = OSPFS_XATTR_ENTRYSIZE(oxe->oxe_namelen, oxe->oxe_valuelen);
+
+	memmove(xb + off, xb + off + size, end - off - size);
+	memset(xb + end - size, 0, size);
+	return end - size;
+}
+
+static ssize_t
+ospfs_getxattr(struct dentry *dentry, const char *name, void *buffer, size_t size)
+{
+	ospfs_inode_t *oi = ospfs_inode(dentry->d_inode->i_ino);
+	ospfs_xattr_entry_t *oxe;
+	int namelen = ospfs_xattr_namelen(name);
+	uint32_t end;
+	ssize_t r;
+
+	if (namelen < 0)
+		return namelen;
+	mutex_lock(&ospfs_xattr_mutex);
+	if (!oi->oi_xattr
+	    || !(oxe = ospfs_xattr_find(ospfs_block(oi->oi_xattr), name, namelen, &end)))
+		r = -ENODATA;
+	else if (size && size < oxe->oxe_valuelen)
+		r = -ERANGE;
+	else {
+		r = oxe->oxe_valuelen;
+		if (size)
+			memcpy(buffer, (char *) (oxe + 1) + namelen, r);
+	}
+	mutex_unlock(&ospfs_xattr_mutex);
+	return r;
+}
+
+// ospfs_listxattr(dentry, buffer, size)
+//	Lists the attribute names, each followed by a null byte.  "trusted."
+//	attributes are only listed for CAP_SYS_ADMIN, as in other file
+//	systems.
+
+static ssize_t
+ospfs_listxattr(struct dentry *dentry, char *buffer, size_t size)
+{
+	ospfs_inode_t *oi = ospfs_inode(dentry->d_inode->i_ino);
+	ospfs_xattr_entry_t *oxe;
+	int trusted = capable(CAP_SYS_ADMIN);
+	uint8_t *xb;
+	uint32_t off, end;
+	ssize_t total = 0;
+
+	mutex_lock(&ospfs_xattr_mutex);
+	if (!oi->oi_xattr)
+		goto out;
+	xb = ospfs_block(oi->oi_xattr);
+	ospfs_xattr_find(xb, NULL, 0, &end);
+	for (off = 0; off < end;
+	     off += OSPFS_XATTR_ENTRYSIZE(oxe->oxe_namelen, oxe->oxe_valuelen)) {
+		const char *name;
+		oxe = (ospfs_xattr_entry_t *) (xb + off);
+		name = (const char *) (oxe + 1);
+		if (!trusted && oxe->oxe_namelen >= XATTR_TRUSTED_PREFIX_LEN
+		    && strncmp(name, XATTR_TRUSTED_PREFIX, XATTR_TRUSTED_PREFIX_LEN) == 0)
+			continue;
+		if (size) {
+			if (total + oxe->oxe_namelen + 1 > size) {
+				total = -ERANGE;
+				goto out;
+			}
+			memcpy(buffer + total, name, oxe->oxe_namelen);
+			buffer[total + oxe->oxe_namelen] = '\0';
+		}
+		total += oxe->oxe_namelen + 1;
+	}
+    out:
+	mutex_unlock(&ospfs_xattr_mutex);
+	return total;
+}
+
+// ospfs_setxattr(dentry, name, value, size, flags)
+//	Sets attribute 'name', allocating the attribute block if this is the
+//	inode's first.  Returns -ENOSPC if the block has no room for it (or
+//	the disk none for the block).
+
+static int
+ospfs_setxattr(struct dentry *dentry, const char *name, const void *value,
+	       size_t size, int flags)
+{
+	struct inode *inode = dentry->d_inode;
+	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
+	ospfs_xattr_entry_t *oxe;
+	int namelen = ospfs_xattr_namelen(name);
+	uint32_t need, end, blockno;
+	uint8_t *xb;
+	int r = 0;
+
+	if (namelen < 0)
+		return namelen;
+	need = OSPFS_XATTR_ENTRYSIZE(namelen, size);
+	if (size > OSPFS_BLKSIZE || need > OSPFS_BLKSIZE)
+		return -ENOSPC;
+
+	mutex_lock(&ospfs_xattr_mutex);
+	if (!oi->oi_xattr) {
+		if (flags & XATTR_REPLACE) {
+			r = -ENODATA;
+			goto out;
+		}
+		if (!(blockno = allocate_block(ospfs_block_goal(oi, 0)))) {
+			r = -ENOSPC;
+			goto out;
+		}
+		memset(ospfs_block(blockno), 0, OSPFS_BLKSIZE);
+		oi->oi_xattr = blockno;
+		ospfs_super->os_feature_compat |= OSPFS_FEATURE_COMPAT_XATTR;
+	}
+
+	xb = ospfs_block(oi->oi_xattr);
+	oxe = ospfs_xattr_find(xb, name, namelen, &end);
+	if (oxe && (flags & XATTR_CREATE))
+		r = -EEXIST;
+	else if (!oxe && (flags & XATTR_REPLACE))
+		r = -ENODATA;
+	else if (end + need - (oxe ? OSPFS_XATTR_ENTRYSIZE(namelen, oxe->oxe_valuelen) : 0)
+		 > OSPFS_BLKSIZE)
+		r = -ENOSPC;
+	if (r < 0)
+		goto out;
+
+	if (oxe)
+		end = ospfs_xattr_remove(xb, oxe, end);
+	oxe = (ospfs_xattr_entry_t *) (xb + end);
+	oxe->oxe_namelen = namelen;
+	oxe->oxe_valuelen = size;
+	memcpy(oxe + 1, name, namelen);
+	memcpy((char *) (oxe + 1) + namelen, value, size);
+	ospfs_touch(oi, inode, S_CTIME);
+
+    out:
+	mutex_unlock(&ospfs_xattr_mutex);
+	return r;
+}
+
+// ospfs_removexattr(dentry, name)
+//	Removes attribute 'name', freeing the attribute block along with the
+//	last one.
+
+static int
+ospfs_removexattr(struct dentry *dentry, const char *name)
+{
+	struct inode *inode = dentry->d_inode;
+	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
+	ospfs_xattr_entry_t *oxe;
+	int namelen = ospfs_xattr_namelen(name);
+	uint32_t end;
+	uint8_t *xb;
+	int r = 0;
+
+	if (namelen < 0)
+		return namelen;
+	mutex_lock(&ospfs_xattr_mutex);
+	if (!oi->oi_xattr
+	    || !(oxe = ospfs_xattr_find((xb = ospfs_block(oi->oi_xattr)), name, namelen, &end))) {
+		r = -ENODATA;
+		goto out;
+	}
+	if (ospfs_xattr_remove(xb, oxe, end) == 0) {
+		free_block(oi->oi_xattr);
+		oi->oi_xattr = 0;
+	}
+	ospfs_touch(oi, inode, S_CTIME);
+
+    out:
+	mutex_unlock(&ospfs_xattr_mutex);
+	return r;
+}
+
+
+// An extent being built up by ospfs_fiemap
+struct ospfs_extent {
+	uint32_t e_logical;	// First file block
+	uint32_t e_physical;	// First disk block (0 if delalloc)
+	uint32_t e_len;		// Length in blocks (0 if none pending)
+	uint32_t e_flags;	// FIEMAP_EXTENT_* flags
+};
+
+// Reports extent 'e', if it has any blocks, and empties it.
+static int
+ospfs_fiemap_emit(struct fiemap_extent_info *fieinfo, struct ospfs_extent *e, uint32_t flags)
+{
+	int r;
+	if (!e->e_len)
+		return 0;
+	r = fiemap_fill_next_extent(fieinfo, (u64) e->e_logical * OSPFS_BLKSIZE,
+				    (u64) e->e_physical * OSPFS_BLKSIZE,
+				    (u64) e->e_len * OSPFS_BLKSIZE, e->e_flags | flags);
+	e->e_len = 0;
+	return r;
+}
+
+// ospfs_fiemap(inode, fieinfo, start, len)
+//	The inode_operations.fiemap callback, behind the FS_IOC_FIEMAP ioctl
+//	(and so 'filefrag').  Walks the file's block pointers, merging
+//	logically and physically consecutive blocks into extents.  Holes are
+//	simply not reported.  Blocks still in delayed-allocation buffers have
+//	no physical address yet; consecutive ones are reported together as
+//	one DELALLOC extent, unless FIEMAP_FLAG_SYNC asks for them to be
+//	flushed first.  Extents are block-granular.
+
+static int
+ospfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len)
+{
+	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
+	ospfs_inode_info_t *ii = ospfs_get_info(inode->i_ino, 0);
+	struct ospfs_extent e = { 0, 0, 0, 0 };
+	uint32_t n, first, last, nblocks, *slot;
+	int r;
+
+	if ((r = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC)) < 0)
+		goto out_put;
+	if (ii) {
+		mutex_lock(&ii->ii_mutex);
+		if ((fieinfo->fi_flags & FIEMAP_FLAG_SYNC)
+		    && (r = ospfs_da_flush(ii, oi)) < 0)
+			goto out;
+	}
+
+	// Inline data is one extent, located at its inode
+	if (ospfs_is_inline(oi)) {
+		if (start < oi->oi_size)
+			r = fiemap_fill_next_extent(fieinfo, 0,
+				(u64) ospfs_super->os_firstinob * OSPFS_BLKSIZE
+				+ (u64) inode->i_ino * OSPFS_INODESIZE
+				+ offsetof(ospfs_inode_t, oi_direct),
+				oi->oi_size, FIEMAP_EXTENT_DATA_INLINE
+				| FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_LAST);
+		goto out;
+	}
+
+	nblocks = ospfs_size2nblocks(oi->oi_size);
+	first = MIN(start / OSPFS_BLKSIZE, (u64) nblocks);
+	last = MIN((start + len + OSPFS_BLKSIZE - 1) / OSPFS_BLKSIZE, (u64) nblocks);
+
+	// Walk on past 'last' until the next extent starts, so the final
+	// one can be flagged FIEMAP_EXTENT_LAST
+	for (n = first; n < nblocks; n++) {
+		uint32_t blockno = 0, flags;
+
+		slot = ospfs_bmap_slot(oi, n, 0);
+		if (slot && *slot) {
+			blockno = *slot;
+			flags = 0;
+		} else if (ii && radix_tree_lookup(&ii->ii_dirty, n))
+			flags = FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_UNKNOWN;
+		else {
+			// A hole; skip whole missing indirect blocks at once
+			// (unless buffered blocks might be hiding there)
+			if (!slot && !ii)
+				n = ospfs_indirect_end(n) - 1;
+			continue;
+		}
+
+		if (e.e_len && n == e.e_logical + e.e_len && flags == e.e_flags
+		    && (flags || blockno == e.e_physical + e.e_len)) {
+			e.e_len++;
+			continue;
+		}
+		if (n >= last)
+			break;
+		if ((r = ospfs_fiemap_emit(fieinfo, &e, 0)) != 0)
+			goto out;
+		e.e_logical = n;
+		e.e_physical = blockno;
+		e.e_len = 1;
+		e.e_flags = flags;
+	}
+	r = ospfs_fiemap_emit(fieinfo, &e, n >= nblocks ? FIEMAP_EXTENT_LAST : 0);
+
+    out:
+	if (ii)
+		mutex_unlock(&ii->ii_mutex);
+    out_put:
+	if (ii)
+		ospfs_put_info(ii);
+	// fiemap_fill_next_extent returns 1 once the caller's array is full
+	return r < 0 ? r : 0;
+}
+
+
+// ospfs_llseek(filp, offset, origin)
+//	The regular file_operations.llseek callback.  Adds SEEK_DATA and
+//	SEEK_HOLE, answered from the block map, so sparse-aware copiers can
+//	skip holes instead of reading their zeroes through ospfs_read.  Holes
+//	are block-granular; buffered (delayed-allocation) blocks count as
+//	data, and the end of the file counts as a hole.  Other seeks go to
+//	generic_file_llseek.
+
+#ifndef SEEK_DATA
+# define SEEK_DATA	3
+# define SEEK_HOLE	4
+#endif
+
+static loff_t
+ospfs_llseek(struct file *filp, loff_t offset, int origin)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
+	ospfs_inode_info_t *ii;
+	uint32_t n, nblocks, *slot;
+	loff_t pos;
+
+	if (origin != SEEK_DATA && origin != SEEK_HOLE)
+		return generic_file_llseek(filp, offset, origin);
+
+	if ((ii = ospfs_get_info(inode->i_ino, 0)))
+		mutex_lock(&ii->ii_mutex);
+	nblocks = ospfs_size2nblocks(oi->oi_size);
+	if (offset < 0 || offset >= oi->oi_size) {
+		pos = -ENXIO;
+		goto out;
+	}
+
+	for (n = offset / OSPFS_BLKSIZE; n < nblocks; n++) {
+		int data;
+		slot = ospfs_bmap_slot(oi, n, 0);
+		data = ospfs_is_inline(oi) || (slot && *slot)
+			|| (ii && radix_tree_lookup(&ii->ii_dirty, n));
+		if (data == (origin == SEEK_DATA))
+			break;
+		if (!slot && !ii)
+			n = ospfs_indirect_end(n) - 1;
+	}
+
+	if (n >= nblocks)
+		pos = origin == SEEK_DATA ? -ENXIO : oi->oi_size;
+	else
+		pos = MAX((loff_t) n * OSPFS_BLKSIZE, offset);
+	if (pos >= 0)
+		filp->f_pos = pos;
+
+    out:
+	if (ii) {
+		mutex_unlock(&ii->ii_mutex);
+		ospfs_put_info(ii);
+	}
+	return pos;
+}
+
+
+// ospfs_readahead(fi, oi, pos, count)
+//	Called by ospfs_read before it copies out 'count' bytes at 'pos'.
+//	If this read continues where the last one on 'fi' left off, the
+//	readahead window doubles (up to 'readahead' blocks) and the blocks in
+//	the window beyond this read, plus the indirect-block entries that
+//	map them, are prefetched.  Any other read collapses the window, so
+//	random readers pay nothing.
+//
+//	The OSPFS "disk" is memory, so prefetching pulls blocks into the CPU
+//	cache ahead of copy_to_user.  Blocks are only prefetched once: the
+//	window is refilled from where the last prefetch ended.
+
+#define OSPFS_RA_MIN		4
+
+static unsigned int ospfs_ra_max = 32;
+module_param_named(readahead, ospfs_ra_max, uint, 0644);
+MODULE_PARM_DESC(readahead, "Maximum readahead window, in blocks");
+
+static void
+ospfs_prefetch_blockno(ospfs_inode_t *oi, uint32_t n)
+{
+	uint32_t *indirect2;
+
+	if (n < OSPFS_NDIRECT)
+		return;
+	n -= OSPFS_NDIRECT;
+	if (n < OSPFS_NINDIRECT) {
+		if (oi->oi_indirect)
+			prefetch((uint32_t *) ospfs_block(oi->oi_indirect) + n);
+		return;
+	}
+	n -= OSPFS_NINDIRECT;
+	if (!oi->oi_indirect2)
+		return;
+	indirect2 = (uint32_t *) ospfs_block(oi->oi_indirect2) + n / OSPFS_NINDIRECT;
+	prefetch(indirect2);
+	if (*indirect2)
+		prefetch((uint32_t *) ospfs_block(*indirect2) + n % OSPFS_NINDIRECT);
+}
+
+static void
+ospfs_readahead(ospfs_file_info_t *fi, ospfs_inode_t *oi, loff_t pos, size_t count)
+{
+	uint32_t first = pos / OSPFS_BLKSIZE;
+	uint32_t last = (pos + count - 1) / OSPFS_BLKSIZE;
+	uint32_t nblocks = ospfs_size2nblocks(oi->oi_size);
+	uint32_t n, end;
+
+	if (count == 0)
+		return;
+
+	// A read that starts in the block the previous read ended in is
+	// still sequential.
+	if (fi->fi_ra_window && (first == fi->fi_ra_next || first + 1 == fi->fi_ra_next))
+		fi->fi_ra_window = MIN(fi->fi_ra_window * 2, ospfs_ra_max);
+	else if (first == 0 || first == fi->fi_ra_next) {
+		fi->fi_ra_window = MIN(OSPFS_RA_MIN, ospfs_ra_max);
+		fi->fi_ra_end = first;
+	} else
+		fi->fi_ra_window = 0;
+	fi->fi_ra_next = last + 1;
+
+	if (fi->fi_ra_window == 0)
+		return;
+
+	end = MIN(last + 1 + fi->fi_ra_window, nblocks);
+	for (n = MAX(fi->fi_ra_end, last + 1); n < end; n++) {
+		uint32_t blockno;
+		ospfs_prefetch_blockno(oi, n);
+		blockno = ospfs_inode_blockno(oi, n * OSPFS_BLKSIZE);
+		if (blockno)
+			prefetch_range(ospfs_block(blockno), OSPFS_BLKSIZE);
+	}
+	fi->fi_ra_end = MAX(fi->fi_ra_end, end);
+}
+
+
+// ospfs_read
+//	Linux calls this function to read data from a file.
+//	It is the file_operations.read callback.
+//
+//   Inputs:  filp	-- a file pointer
+//            buffer    -- a user space ptr where data should be copied
+//            count     -- the amount of data requested
+//            f_pos     -- points to the file position
+//   Returns: Number of chars read on success, -(error code) on error.
+//
+//   This function copies the corresponding bytes from the file into the user
+//   space ptr (buffer).  Use copy_to_user() to accomplish this.
+//   The current file position is passed into the function
+//   as 'f_pos'; read data starting at that position, and update the position
+//   when you're done.
+//
+//   EXERCISE: Complete this function.
+
+// ospfs_accessed(filp, oi)
+//	Updates the access time after a read, "relatime" style: only if the
+//	old one is no later than the last modification or change, or is a
+//	day old.  So a file read over and over costs no inode writes, but
+//	tools can still tell whether it was read since it last changed.
+//	Read-only and noatime mounts never update it.
+
+static void
+ospfs_accessed(struct file *filp, ospfs_inode_t *oi)
+{
+	struct timespec now = CURRENT_TIME;
+	uint32_t atime = oi->oi_atime.ot_sec;
+
+	if ((filp->f_flags & O_NOATIME) || IS_NOATIME(filp->f_dentry->d_inode)
+	    || (filp->f_vfsmnt->mnt_flags & MNT_NOATIME)
+	    || (atime > oi->oi_mtime.ot_sec && atime > oi->oi_ctime.ot_sec
+		&& now.tv_sec - atime < 24 * 60 * 60))
+		return;
+	ospfs_touch(oi, filp->f_dentry->d_inode, S_ATIME);
+}
+
+// ospfs_read_unmapped(ii, oi, buffer, pos, n)
+//	Copies 'n' bytes at 'pos' from a file block with no disk block: from
+//	its delayed-allocation buffer if there is one, otherwise zeroes.
+//	'ii' is NULL for files opened on read-only mounts; then the inode's
+//	in-memory state, if another open file has any, is looked up here.
+//	Returns 0 or a nonzero copy_to_user-style failure.
+
+static unsigned long
+ospfs_read_unmapped(ospfs_inode_info_t *ii, ospfs_inode_t *oi, char __user *buffer,
+		    loff_t pos, uint32_t n)
+{
+	ospfs_inode_info_t *tmp_ii = NULL;
+	ospfs_dabuf_t *db;
+	uint32_t blockno;
+	unsigned long r;
+
+	if (!ii && !(ii = tmp_ii = ospfs_get_info(ospfs_inode_ino(oi), 0)))
+		return clear_user(buffer, n);
+
+	mutex_lock(&ii->ii_mutex);
+	// A flush may have allocated the block since we looked
+	if ((blockno = ospfs_inode_blockno(oi, pos)))
+		r = copy_to_user(buffer, (uint8_t *) ospfs_block(blockno) + pos % OSPFS_BLKSIZE, n);
+	else if ((db = radix_tree_lookup(&ii->ii_dirty, pos / OSPFS_BLKSIZE)))
+		r = copy_to_user(buffer, db->db_data + pos % OSPFS_BLKSIZE, n);
+	else
+		r = clear_user(buffer, n);
+	mutex_unlock(&ii->ii_mutex);
+	if (tmp_ii)
+		ospfs_put_info(tmp_ii);
+	return r;
+}
+
+// ospfs_read_inline(ii, oi, buffer, pos, n)
+//	Copies 'n' bytes at 'pos' of inline file 'oi' to user space, holding
+//	'ii's mutex so a writer can't move the data out meanwhile ('ii' is
+//	looked up as in ospfs_read_unmapped if NULL).  Returns 0, -EFAULT,
+//	or 1 if the file turned out not to be inline after all.
+
+static int
+ospfs_read_inline(ospfs_inode_info_t *ii, ospfs_inode_t *oi, char __user *buffer,
+		  loff_t pos, uint32_t n)
+{
+	ospfs_inode_info_t *tmp_ii = NULL;
+	int r = 1;
+
+	if (!ii)
+		ii = tmp_ii = ospfs_get_info(ospfs_inode_ino(oi), 0);
+	if (ii)
+		mutex_lock(&ii->ii_mutex);
+	if (ospfs_is_inline(oi))
+		r = copy_to_user(buffer, ospfs_inline_data(oi) + pos, n) ? -EFAULT : 0;
+	if (ii)
+		mutex_unlock(&ii->ii_mutex);
+	if (tmp_ii)
+		ospfs_put_info(tmp_ii);
+	return r;
+}
+
+static ssize_t
 ospfs_read(struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
 {
 	ospfs_inode_t *oi = ospfs_inode(filp->f_dentry->d_inode->i_ino);
+	ospfs_file_info_t *fi = filp->private_data;
 	int retval = 0;
 	size_t amount = 0;
+	loff_t start_pos = *f_pos;
+
+	ospfs_last_io = jiffies;
 
 	// Make sure we don't read past the end of the file!
 	// Change 'count' so we never read past the end of the file.
@@ -1065,36 +4487,41 @@ ospfs_read(struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
 	if(oi->oi_size < *f_pos + count)
 		count = oi->oi_size - *f_pos;
 
+	if (fi)
+		ospfs_readahead(fi, oi, *f_pos, count);
+
+	if (ospfs_is_inline(oi)) {
+		retval = ospfs_read_inline(fi ? fi->fi_info : NULL, oi, buffer, *f_pos, count);
+		if (retval <= 0) {
+			if (retval == 0) {
+				amount = count;
+				*f_pos += count;
+			}
+			goto done;
+		}
+		retval = 0;
+	}
+
 	// Copy the data to user block by block
 	while (amount < count && retval >= 0) {
 		uint32_t blockno = ospfs_inode_blockno(oi, *f_pos);
 		uint32_t n;
 		char *data;
 
-		// ospfs_inode_blockno returns 0 on error
-		if (blockno == 0) {
-			retval = -EIO;
-			goto done;
-		}
-
-		data = ospfs_block(blockno);
-		// Get to the right position in the block - is this right??
-		data += (*f_pos % OSPFS_BLKSIZE);
-		
-		// Figure out how much data is left in this block to read.
-		// Copy data into user space. Return -EFAULT if unable to write
-		// into user space.
-		// Use variable 'n' to track number of bytes moved.
-		/* EXERCISE: Your code here */
-		
 		// Go only to the end of a block, or the end of the read if before that
 		n = MIN(OSPFS_BLKSIZE - (*f_pos % OSPFS_BLKSIZE), (count - amount));
 
 		if(n == 0)
 			goto done;
 
-		retval = copy_to_user(buffer, data, n);
-		
+		if (blockno != 0) {
+			data = ospfs_block(blockno);
+			data += (*f_pos % OSPFS_BLKSIZE);
+			retval = copy_to_user(buffer, data, n);
+		} else
+			// No block: buffered data, or a hole
+			retval = ospfs_read_unmapped(fi ? fi->fi_info : NULL, oi, buffer, *f_pos, n);
+
 		if(retval != 0) {
 			retval = -EFAULT;
 			goto done;
@@ -1106,6 +4533,10 @@ ospfs_read(struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
 	}
 
 	done:
+	if (amount > 0)
+		ospfs_accessed(filp, oi);
+	if (retval >= 0)
+		ospfs_trace(OSPFS_TRACE_READ, filp->f_dentry->d_inode->i_ino, 0, start_pos, amount);
 	return (retval >= 0 ? amount : retval);
 }
 
@@ -1130,57 +4561,95 @@ ospfs_read(struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
 static ssize_t
 ospfs_write(struct file *filp, const char __user *buffer, size_t count, loff_t *f_pos)
 {
-	ospfs_inode_t *oi = ospfs_inode(filp->f_dentry->d_inode->i_ino);
+	struct inode *inode = filp->f_dentry->d_inode;
+	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
+	ospfs_file_info_t *fi = filp->private_data;
+	ospfs_inode_info_t *ii = fi ? fi->fi_info : NULL;
 	int retval = 0;
 	size_t amount = 0;
+	loff_t start_pos;
+
+	if (!ii)
+		return -EIO;
+	ospfs_last_io = jiffies;
+	mutex_lock(&ii->ii_mutex);
 
 	// Support files opened with the O_APPEND flag.  To detect O_APPEND,
 	// use struct file's f_flags field and the O_APPEND bit.
-	/* EXERCISE: Your code here */
 	if(filp->f_flags & O_APPEND) {
 		*f_pos = oi->oi_size;
 	}
+	start_pos = *f_pos;
 
-	// If the user is writing past the end of the file, change the file's
-	// size to accomodate the request.  (Use change_size().)
-	/* EXERCISE: Your code here */
-	if(oi->oi_size < (*f_pos) + count) {
-		// We gotta do something about this one...
-		retval = change_size(oi, (*f_pos + count));
-		if(retval < 0) {
-			return retval;
+	// A small write that continues the last one inside the same buffer
+	// is just a copy (see DELAYED ALLOCATION)
+	if (ii->ii_tail && *f_pos == ii->ii_tail_pos
+	    && count <= OSPFS_BLKSIZE - *f_pos % OSPFS_BLKSIZE) {
+		if (copy_from_user(ii->ii_tail + *f_pos % OSPFS_BLKSIZE, buffer, count)) {
+			retval = -EFAULT;
+			goto done;
+		}
+		amount = count;
+		*f_pos += count;
+		ii->ii_tail_pos = *f_pos;
+		if (*f_pos % OSPFS_BLKSIZE == 0)
+			ii->ii_tail = NULL;
+		if (*f_pos > oi->oi_size)
+			oi->oi_size = *f_pos;
+		goto done;
+	}
+
+	// Writing past the end of the file changes the file's size, but
+	// blocks are only allocated when the data is flushed.
+	if (*f_pos + count > OSPFS_MAXFILESIZE) {
+		retval = -ENOSPC;
+		goto done;
+	}
+
+	// Inline files take writes that fit in place
+	if (ospfs_is_inline(oi)) {
+		if (*f_pos + count <= OSPFS_INLINE_MAX) {
+			if (copy_from_user(ospfs_inline_data(oi) + *f_pos, buffer, count)) {
+				retval = -EFAULT;
+				goto done;
+			}
+			amount = count;
+			*f_pos += count;
+			if (*f_pos > oi->oi_size)
+				oi->oi_size = *f_pos;
+			goto done;
 		}
+		if ((retval = ospfs_uninline(oi)) < 0)
+			goto done;
 	}
 
 	// Copy data block by block
 	while (amount < count && retval >= 0) {
-		uint32_t blockno = ospfs_inode_blockno(oi, *f_pos);
+		uint32_t *slot = ospfs_bmap_slot(oi, *f_pos / OSPFS_BLKSIZE, 0);
+		ospfs_dabuf_t *db = NULL;
 		uint32_t n;
 		char *data;
 
-		if (blockno == 0) {
-			retval = -EIO;
-			goto done;
+		if (slot && *slot)
+			data = ospfs_block(*slot);
+		else {
+			db = ospfs_da_buffer(ii, *f_pos / OSPFS_BLKSIZE);
+			if (IS_ERR(db)) {
+				retval = PTR_ERR(db);
+				goto done;
+			}
+			data = (char *) db->db_data;
 		}
-
-		data = ospfs_block(blockno);
-		// Get to the right position in the block - is this right?
 		data += (*f_pos % OSPFS_BLKSIZE);
-		
-		// Figure out how much data is left in this block to write.
-		// Copy data from user space. Return -EFAULT if unable to read
-		// read user space.
-		// Keep track of the number of bytes moved in 'n'.
-		/* EXERCISE: Your code here */
 
-		// Go only to the end of a block, or the end of the read if before that
+		// Go only to the end of a block, or the end of the write if before that
 		n = MIN(OSPFS_BLKSIZE - (*f_pos % OSPFS_BLKSIZE), (count - amount));
 
 		if(n == 0)
 			goto done;
 
 		retval = copy_from_user(data, buffer, n);
-		
+
 		if(retval != 0) {
 			retval = -EFAULT;
 			goto done;
@@ -1189,9 +4658,28 @@ ospfs_write(struct file *filp, const char __user *buffer, size_t count, loff_t *
 		buffer += n;
 		amount += n;
 		*f_pos += n;
+		if (*f_pos > oi->oi_size)
+			oi->oi_size = *f_pos;
+		ii->ii_tail = (db && *f_pos % OSPFS_BLKSIZE) ? db->db_data : NULL;
+		ii->ii_tail_pos = *f_pos;
 	}
 
     done:
+	inode->i_size = oi->oi_size;
+	if (amount > 0)
+		ospfs_touch(oi, inode, S_MTIME | S_CTIME);
+	// Allocate a full window, and don't let buffered data crowd
+	// everything else out of the budget
+	if ((ospfs_da_window && ii->ii_ndirty >= ospfs_da_window)
+	    || atomic_long_read(&ospfs_mem_bytes) > ospfs_mem_budget)
+		ospfs_da_flush(ii, oi);
+	mutex_unlock(&ii->ii_mutex);
+
+	// A short write is a success
+	if (amount > 0)
+		retval = 0;
+	if (retval >= 0)
+		ospfs_trace(OSPFS_TRACE_WRITE, inode->i_ino, 0, start_pos, amount);
 	return (retval >= 0 ? amount : retval);
 }
 
@@ -1210,9 +4698,11 @@ ospfs_write(struct file *filp, const char __user *buffer, size_t count, loff_t *
 static ospfs_direntry_t *
 find_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen)
 {
-	int off;
+	uint32_t off;
 	if (namelen < 0)
 		namelen = strlen(name);
+	if (ospfs_diridx_find(ospfs_inode_ino(dir_oi), dir_oi, name, namelen, &off))
+		return off ? ospfs_inode_data(dir_oi, off - 1) : 0;
 	for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
 		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off);
 		if (od->od_ino
@@ -1224,11 +4714,12 @@ find_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen)
 }
 
 
-// create_blank_direntry(dir_oi)
+// create_blank_direntry(dir_oi, offp)
 //	'dir_oi' is an OSP inode for a directory.
-//	Return a blank directory entry in that directory.  This might require
-//	adding a new block to the directory.  Returns an error pointer (see
-//	below) on failure.
+//	Return a blank directory entry in that directory, and set '*offp' to
+//	its byte offset in the directory.  This might require adding a new
+//	block to the directory.  Returns an error pointer (see below) on
+//	failure.
 //
 // ERROR POINTERS: The Linux kernel uses a special convention for returning
 // error values in the form of pointers.  Here's how it works.
@@ -1253,7 +4744,7 @@ find_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen)
 // EXERCISE: Write this function.
 
 static ospfs_direntry_t *
-create_blank_direntry(ospfs_inode_t *dir_oi)
+create_blank_direntry(ospfs_inode_t *dir_oi, uint32_t *offp)
 {
 	// Outline:
 	// 1. Check the existing directory data for an empty entry.  Return one
@@ -1274,6 +4765,7 @@ create_blank_direntry(ospfs_inode_t *dir_oi)
 		for(dirno = 0; dirno < direntries_per_block; dirno++) {
 			if(direntry_list[dirno].od_ino == 0) {
 				direntry = &direntry_list[dirno];
+				*offp = blockno * OSPFS_BLKSIZE + dirno * OSPFS_DIRENTRY_SIZE;
 				break;
 			}
 		}
@@ -1284,26 +4776,131 @@ create_blank_direntry(ospfs_inode_t *dir_oi)
 	// See if we found any blank direntries
 	if(direntry == 0) {
 		// Check to see if we can add a new block to the directory
-		int error = change_size(dir_oi, dir_oi->oi_size + OSPFS_BLKSIZE);
+		int error = change_size(dir_oi, blocks_size * OSPFS_BLKSIZE + OSPFS_BLKSIZE);
 		if(error < 0)
-			ERR_PTR(-ENOSPC);
+			return ERR_PTR(error);
+
+		// Clear the memory and set the direntry pointer to the first direntry
+		//  in the new block, which starts where the old blocks ended
+		direntry_list = ospfs_inode_data(dir_oi, blocks_size * OSPFS_BLKSIZE);
+		memset(direntry_list, 0, OSPFS_BLKSIZE);
+
+		direntry = &direntry_list[0];
+		*offp = blocks_size * OSPFS_BLKSIZE;
+	}
+
+	// In the clear, now return the new direntry
+	return direntry;
+}
+
+// ospfs_alloc_inode(dir_oi, dir_ino)
+//	Finds and claims a free inode for a new entry in directory 'dir_ino'.
+//	Inodes of one directory are kept in as few inode blocks as possible,
+//	so 'ls -l' touches few blocks.  The first choice is a free slot in the
+//	inode block holding the directory itself, then one in a block holding
+//	one of its entries, then the nearest block after the directory's in
+//	the directory's group.  If that group has no free inodes, the group
+//	with the most free inodes is used.
+//
+//	The inode is claimed by setting its link count to 1 and its times to
+//	now; the caller initializes the rest, or releases it with
+//	ospfs_free_inode.
+//
+//   Returns: the inode number, or 0 if the inode table is full.
+
+static uint32_t
+ospfs_claim_inode(uint32_t b)
+{
+	uint32_t ino = b * OSPFS_BLKINODES;
+	uint32_t end = MIN(ino + OSPFS_BLKINODES, ospfs_super->os_ninodes);
+	struct ospfs_group *bg = ospfs_inode_group(ino);
+
+	spin_lock(&bg->bg_lock);
+	for (ino = MAX(ino, 1); bg->bg_nifree && ino < end; ino++) {
+		ospfs_inode_t *oi = ospfs_inode(ino);
+		if (ospfs_inode_is_free(oi)) {
+			memset(oi, 0, sizeof(*oi));
+			oi->oi_nlink = 1;
+			ospfs_touch(oi, NULL, S_ATIME | S_MTIME | S_CTIME);
+			bg->bg_nifree--;
+			spin_unlock(&bg->bg_lock);
+			return ino;
+		}
+	}
+	spin_unlock(&bg->bg_lock);
+	return 0;
+}
+
+static uint32_t
+ospfs_claim_group_inode(struct ospfs_group *bg, uint32_t start)
+{
+	uint32_t first = bg->bg_ifirst / OSPFS_BLKINODES;
+	uint32_t nblocks = ospfs_size2nblocks((bg->bg_iend - bg->bg_ifirst) * OSPFS_INODESIZE);
+	uint32_t b, ino;
+
+	if (start < first || start >= first + nblocks)
+		start = first;
+	for (b = 0; b < nblocks && bg->bg_nifree; b++)
+		if ((ino = ospfs_claim_inode(first + (start - first + b) % nblocks)))
+			return ino;
+	return 0;
+}
 
-		// Clear the memory and set the direntry pointer to the first direntry
-		//  in the new block, found by the new dir_oi size
-		direntry_list =
-			ospfs_inode_data(
-				dir_oi,
-				(ospfs_size2nblocks(dir_oi->oi_size)) * OSPFS_BLKSIZE
-			);
-		memset(direntry_list, 0, OSPFS_BLKSIZE);
+static uint32_t
+ospfs_alloc_inode(ospfs_inode_t *dir_oi, ino_t dir_ino)
+{
+	uint32_t home = dir_ino / OSPFS_BLKINODES, tried = home;
+	struct ospfs_group *bg, *best;
+	uint32_t off, b, g, ino;
 
-		direntry = &direntry_list[0];
+	if ((ino = ospfs_claim_inode(home)))
+		return ino;
+
+	// Blocks holding siblings
+	for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
+		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off);
+		b = od->od_ino / OSPFS_BLKINODES;
+		if (od->od_ino == 0 || b == home || b == tried)
+			continue;
+		if ((ino = ospfs_claim_inode(b)))
+			return ino;
+		tried = b;
 	}
 
-	// In the clear, now return the new direntry
-	return direntry;
+	if ((ino = ospfs_claim_group_inode(ospfs_inode_group(dir_ino), home + 1)))
+		return ino;
+
+	// Fall back to the emptiest group; retry if others beat us to it
+	do {
+		best = NULL;
+		for (g = 0; g < ospfs_ngroups; g++) {
+			bg = &ospfs_groups[g];
+			if (bg->bg_nifree && (!best || bg->bg_nifree > best->bg_nifree))
+				best = bg;
+		}
+	} while (best && !(ino = ospfs_claim_group_inode(best, 0)));
+	return ino;
 }
 
+// ospfs_free_inode(ino)
+//	Releases inode 'ino' once its last link is gone and its blocks are
+//	freed.  Frees its extended attribute block, if any, too.
+
+static void
+ospfs_free_inode(ino_t ino)
+{
+	struct ospfs_group *bg = ospfs_inode_group(ino);
+	ospfs_inode_t *oi = ospfs_inode(ino);
+
+	if (oi->oi_ftype != OSPFS_FTYPE_SYMLINK && oi->oi_xattr)
+		free_block(oi->oi_xattr);
+	spin_lock(&bg->bg_lock);
+	memset(oi, 0, sizeof(*oi));
+	bg->bg_nifree++;
+	spin_unlock(&bg->bg_lock);
+}
+
+
 // ospfs_link(src_dentry, dir, dst_dentry
 //   Linux calls this function to create hard links.
 //   It is the ospfs_dir_inode_ops.link callback.
@@ -1339,6 +4936,7 @@ ospfs_link(struct dentry *src_dentry, struct inode *dir, struct dentry *dst_dent
 	ospfs_direntry_t *direntry;
 	ospfs_inode_t *link_inode;
 	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
+	uint32_t entry_off;
 	if(src_dentry->d_inode->i_ino == 0) {
 		return -EIO;
 	}
@@ -1353,7 +4951,7 @@ ospfs_link(struct dentry *src_dentry, struct inode *dir, struct dentry *dst_dent
 	}
 
 	// Check if we can add the new directory in the directory
-	direntry = create_blank_direntry(dir_oi);
+	direntry = create_blank_direntry(dir_oi, &entry_off);
 	if(IS_ERR(direntry)) {
 		return PTR_ERR(direntry);
 	}
@@ -1362,9 +4960,16 @@ ospfs_link(struct dentry *src_dentry, struct inode *dir, struct dentry *dst_dent
 	direntry->od_ino = src_dentry->d_inode->i_ino;
 	// Create the name and null byte padding
 	strncpy(direntry->od_name, dst_dentry->d_name.name, dst_dentry->d_name.len);
+	direntry->od_name[dst_dentry->d_name.len] = '\0';
+
+	ospfs_diridx_add(dir->i_ino, dir_oi, entry_off);
+	ospfs_lookup_forget(dir->i_ino, dst_dentry->d_name.name, dst_dentry->d_name.len);
 
 	link_inode = ospfs_inode(direntry->od_ino);
 	link_inode->oi_nlink++;
+	ospfs_touch(link_inode, src_dentry->d_inode, S_CTIME);
+	ospfs_touch(dir_oi, dir, S_MTIME | S_CTIME);
+	ospfs_trace(OSPFS_TRACE_LINK, direntry->od_ino, dir->i_ino, 0, dst_dentry->d_name.len);
 
 	return 0;
 }
@@ -1404,31 +5009,25 @@ ospfs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidat
 	int i;
 	ospfs_direntry_t *direntry;
 	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
-	ospfs_inode_t *inodes = ospfs_block(ospfs_super->os_firstinob);
+	ospfs_inode_t *oi;
 
-	uint32_t entry_ino = 0;
+	uint32_t entry_ino = 0, entry_off;
 
 	// Check if we can add the new directory in the directory
-	direntry = create_blank_direntry(dir_oi);
+	direntry = create_blank_direntry(dir_oi, &entry_off);
 	if(IS_ERR(direntry)) {
 		return PTR_ERR(direntry);
 	}
 
-	// Find an open inode
-	for(i = 0; i < ospfs_super->os_ninodes; i++) {
-		if(inodes[i].oi_nlink == 0) {
-			entry_ino = i;
-			break;
-		}
-	}
-	if(i == ospfs_super->os_ninodes)
+	// Find an open inode near the directory's other inodes
+	if (!(entry_ino = ospfs_alloc_inode(dir_oi, dir->i_ino)))
 		return -ENOSPC;
 
 	// Set the values of the inode
-	inodes[entry_ino].oi_nlink = 1;
-	inodes[entry_ino].oi_size = 0;
-	inodes[entry_ino].oi_ftype = OSPFS_FTYPE_REG;
-	inodes[entry_ino].oi_mode = mode;
+	oi = ospfs_inode(entry_ino);
+	oi->oi_size = 0;
+	oi->oi_ftype = OSPFS_FTYPE_REG;
+	oi->oi_mode = mode;
 
 	// Set up dentry
 	direntry->od_ino = entry_ino;
@@ -1439,6 +5038,9 @@ ospfs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidat
 		else
 			direntry->od_name[i] = '\0';
 	}	
+	ospfs_diridx_add(dir->i_ino, dir_oi, entry_off);
+	ospfs_lookup_forget(dir->i_ino, dentry->d_name.name, dentry->d_name.len);
+	ospfs_touch(dir_oi, dir, S_MTIME | S_CTIME);
 
 	/* Execute this code after your function has successfully created the
 	   file.  Set entry_ino to the created file's inode number before
@@ -1448,6 +5050,7 @@ ospfs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidat
 		if (!in)
 			return -ENOMEM;
 		d_instantiate(dentry, in);
+		ospfs_trace(OSPFS_TRACE_CREATE, entry_ino, dir->i_ino, mode, dentry->d_name.len);
 		return 0;
 	}
 }
@@ -1465,97 +5068,931 @@ ospfs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidat
 //                      dentry->d_name.len: length of filename
 //           symname -- the symbolic link's destination
 //
-//   Returns: 0 on success, -(error code) on error.  In particular:
-//               -ENAMETOOLONG if dentry->d_name.len is too large, or
-//			       'symname' is too long;
-//               -EEXIST       if a file named the same as 'dentry' already
-//                             exists in the given 'dir';
-//               -ENOSPC       if the disk is full & the file can't be created;
-//               -EIO          on I/O error.
+//   Returns: 0 on success, -(error code) on error.  In particular:
+//               -ENAMETOOLONG if dentry->d_name.len is too large, or
+//			       'symname' is too long;
+//               -EEXIST       if a file named the same as 'dentry' already
+//                             exists in the given 'dir';
+//               -ENOSPC       if the disk is full & the file can't be created;
+//               -EIO          on I/O error.
+//
+//   EXERCISE: Complete this function.
+
+static int
+ospfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
+{
+	int len, i;
+	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
+	ospfs_symlink_inode_t *symlink = 0;
+	ospfs_direntry_t *direntry = 0;
+	uint32_t entry_ino = 0, entry_off;
+
+	if(OSPFS_MAXNAMELEN < dentry->d_name.len) {
+		return -ENAMETOOLONG;
+	}
+
+	if(find_direntry(dir_oi, dentry->d_name.name, 
+			dentry->d_name.len)) {
+		return -EEXIST;
+	}
+
+	// Now check the symbolic link name
+	len = strlen(symname);
+	if(OSPFS_MAXSYMLINKLEN < len) {
+		return -ENAMETOOLONG;
+	}
+
+	// Get a new direntry
+	direntry = create_blank_direntry(dir_oi, &entry_off);
+	if(IS_ERR(direntry))
+		return PTR_ERR(direntry);
+
+	// Find an open inode near the directory's other inodes
+	if (!(entry_ino = ospfs_alloc_inode(dir_oi, dir->i_ino)))
+		return -ENOSPC;
+
+	// Set the symlink to the appropriate inode
+	symlink = (ospfs_symlink_inode_t*)ospfs_inode(entry_ino);
+
+
+	// Set the values of the members
+	symlink->oi_nlink = 1;
+	symlink->oi_ftype = OSPFS_FTYPE_SYMLINK;
+	symlink->oi_size = len;
+	strcpy(symlink->oi_symlink, symname);
+
+	// Make root?ln1:ln2<null> into root?ln1<null>ln2<null>
+	// This is to make conditional symlinks easier later
+	if(strncmp (symlink->oi_symlink, "root?", 5) == 0) {
+		i = 0;
+		// Find the dividing point
+		while(i < len && symlink->oi_symlink[i] != ':') {
+			i++;
+		}
+		// This should never happen
+		if(i == len) {
+			ospfs_free_inode(entry_ino);
+			return -ENAMETOOLONG;
+		}
+
+		// Divide the two with a null byte
+		symlink->oi_symlink[i] = '\0';
+	}
+
+	// Finish making the direntry
+	direntry->od_ino = entry_ino;
+	strncpy(direntry->od_name, dentry->d_name.name, dentry->d_name.len);
+	direntry->od_name[dentry->d_name.len] = '\0';
+	ospfs_diridx_add(dir->i_ino, dir_oi, entry_off);
+	ospfs_lookup_forget(dir->i_ino, dentry->d_name.name, dentry->d_name.len);
+	ospfs_touch(dir_oi, dir, S_MTIME | S_CTIME);
+
+	/* Execute this code after your function has successfully created the
+	   file.  Set entry_ino to the created file's inode number before
+	   getting here. */
+	{
+		struct inode *i = ospfs_mk_linux_inode(dir->i_sb, entry_ino);
+		if (!i)
+			return -ENOMEM;
+		d_instantiate(dentry, i);
+		ospfs_trace(OSPFS_TRACE_SYMLINK, entry_ino, dir->i_ino, len, dentry->d_name.len);
+		return 0;
+	}
+}
+
+
+/*****************************************************************************
+ * DIRECTORY IOCTLS
+ *
+ *   Bulk operations on directories; see the IOCTLS section of ospfs.h.
+ *   Each runs with the directory's i_mutex held, as the VFS does for
+ *   readdir and the namespace operations.
+ */
+
+// ospfs_readdirplus(dir, uarg)
+//	OSPFS_IOC_READDIRPLUS.  Walks the directory a block at a time, copying
+//	out each live entry with its inode's attributes.  The cookie is the
+//	byte offset of the next directory entry to look at.
+
+static long
+ospfs_readdirplus(struct inode *dir, struct ospfs_readdirplus __user *uarg)
+{
+	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
+	struct ospfs_readdirplus arg;
+	ospfs_dirent_plus_t ent, __user *uent;
+	uint32_t off, n = 0;
+	long r = 0;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.orp_cookie % OSPFS_DIRENTRY_SIZE)
+		return -EINVAL;
+	uent = (ospfs_dirent_plus_t __user *) (unsigned long) arg.orp_entries;
+
+	mutex_lock(&dir->i_mutex);
+	ospfs_trace(OSPFS_TRACE_READDIR, dir->i_ino, 0, arg.orp_cookie, 0);
+	off = MIN(arg.orp_cookie, (uint64_t) dir_oi->oi_size);
+	while (off < dir_oi->oi_size && n < arg.orp_count) {
+		// One directory block at a time
+		uint8_t *block = ospfs_inode_data(dir_oi, off);
+		uint32_t end = MIN(off - off % OSPFS_BLKSIZE + OSPFS_BLKSIZE, dir_oi->oi_size);
+
+		for (; off < end && n < arg.orp_count; off += OSPFS_DIRENTRY_SIZE, block += OSPFS_DIRENTRY_SIZE) {
+			ospfs_direntry_t *od = (ospfs_direntry_t *) block;
+			ospfs_inode_t *oi;
+
+			if (od->od_ino == 0)
+				continue;
+			oi = ospfs_inode(od->od_ino);
+			memset(&ent, 0, sizeof(ent));
+			ent.odp_ino = od->od_ino;
+			ent.odp_ftype = oi->oi_ftype;
+			ent.odp_size = oi->oi_size;
+			ent.odp_mode = oi->oi_ftype == OSPFS_FTYPE_SYMLINK ? 0777 : oi->oi_mode;
+			ent.odp_nlink = oi->oi_nlink;
+			strncpy(ent.odp_name, od->od_name, OSPFS_MAXNAMELEN);
+			if (copy_to_user(&uent[n], &ent, sizeof(ent))) {
+				r = -EFAULT;
+				goto out;
+			}
+			n++;
+		}
+	}
+
+	arg.orp_cookie = off;
+	arg.orp_count = n;
+	arg.orp_eof = (off >= dir_oi->oi_size);
+	if (copy_to_user(uarg, &arg, sizeof(arg)))
+		r = -EFAULT;
+
+    out:
+	mutex_unlock(&dir->i_mutex);
+	return r;
+}
+
+// ospfs_createbatch(dir, uarg)
+//	OSPFS_IOC_CREATEBATCH.  Creates the files in one pass over the
+//	directory.  A temporary hash set of the names already there (and of
+//	each name as it is added) replaces the per-file find_direntry scan.
+//	New entries fill free directory slots in order from the start; the
+//	directory is grown once, up front, by as many blocks as the batch
+//	needs.  Each file's inode is claimed next to the previous one's, and
+//	its data goes right after the previous file's data.
+//
+//	No dentries are created: the VFS looks the new names up on demand,
+//	and ospfs_delete_dentry keeps it from caching stale negative ones.
+
+struct ospfs_nameset {
+	uint32_t *ns_slots;	// Directory entry offset + 1, or 0 if empty
+	uint32_t ns_mask;
+};
+
+static uint32_t *
+ospfs_nameset_slot(struct ospfs_nameset *ns, ospfs_inode_t *dir_oi,
+		   const char *name, uint32_t namelen)
+{
+	uint32_t h = full_name_hash(name, namelen);
+	uint32_t *slot;
+
+	for (;; h++) {
+		ospfs_direntry_t *od;
+		slot = &ns->ns_slots[h & ns->ns_mask];
+		if (!*slot)
+			return slot;
+		od = ospfs_inode_data(dir_oi, *slot - 1);
+		if (strlen(od->od_name) == namelen
+		    && memcmp(od->od_name, name, namelen) == 0)
+			return slot;
+	}
+}
+
+// Fill in a new file's blocks, contiguously from '*goal', with 'size'
+// bytes from user memory.  On error the blocks allocated so far stay in
+// the file, for the caller to free with change_size.
+static int
+ospfs_createbatch_fill(ospfs_inode_t *oi, const char __user *data,
+		       uint32_t size, uint32_t *goal)
+{
+	uint32_t n, nblocks = ospfs_size2nblocks(size);
+	uint32_t blockno = 0, left = 0, *slot;
+	int r = 0;
+
+	if (!*goal)
+		*goal = ospfs_block_goal(oi, 0);
+	for (n = 0; n < nblocks; n++, blockno++, left--) {
+		uint32_t amount = MIN(size - n * OSPFS_BLKSIZE, OSPFS_BLKSIZE);
+		uint8_t *block;
+
+		if (!left && !(blockno = ospfs_alloc_run(*goal, nblocks - n, &left, 0)))
+			return -ENOSPC;
+		if (!(slot = ospfs_bmap_slot(oi, n, OSPFS_BMAP_CREATE))) {
+			r = -ENOSPC;
+			break;
+		}
+		*slot = blockno;
+		oi->oi_size = (n + 1) * OSPFS_BLKSIZE;
+		*goal = blockno + 1;
+
+		block = ospfs_block(blockno);
+		if (copy_from_user(block, data + n * OSPFS_BLKSIZE, amount)) {
+			blockno++, left--;
+			r = -EFAULT;
+			break;
+		}
+		memset(block + amount, 0, OSPFS_BLKSIZE - amount);
+	}
+
+	// Return what's left of the last run
+	if (left)
+		ospfs_free_blocks(blockno, left);
+	if (r == 0)
+		oi->oi_size = size;
+	return r;
+}
+
+static int
+ospfs_createbatch_one(struct inode *dir, struct ospfs_nameset *ns,
+		      const ospfs_create_ent_t *ent, uint32_t *diroff,
+		      uint32_t *ino, uint32_t *goal)
+{
+	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
+	ospfs_direntry_t *od = NULL;
+	char name[OSPFS_MAXNAMELEN + 1];
+	uint32_t *hslot, entry_ino = 0;
+	ospfs_inode_t *oi;
+	int r;
+
+	if (ent->oce_namelen > OSPFS_MAXNAMELEN)
+		return -ENAMETOOLONG;
+	if (ent->oce_size > OSPFS_MAXFILESIZE)
+		return -EFBIG;
+	if (copy_from_user(name, (const char __user *) (unsigned long) ent->oce_name,
+			   ent->oce_namelen))
+		return -EFAULT;
+	if (ent->oce_namelen == 0 || memchr(name, '/', ent->oce_namelen)
+	    || memchr(name, '\0', ent->oce_namelen))
+		return -EINVAL;
+	name[ent->oce_namelen] = '\0';
+
+	hslot = ospfs_nameset_slot(ns, dir_oi, name, ent->oce_namelen);
+	if (*hslot)
+		return -EEXIST;
+
+	// Next free directory slot
+	for (;; *diroff += OSPFS_DIRENTRY_SIZE) {
+		// add_block zeroes the new block, so its slots are all free
+		if (*diroff >= dir_oi->oi_size
+		    && (r = change_size(dir_oi, *diroff + OSPFS_BLKSIZE)) < 0)
+			return r;
+		od = ospfs_inode_data(dir_oi, *diroff);
+		if (od->od_ino == 0)
+			break;
+	}
+
+	// Next inode after the last one, else the usual search
+	if (*ino && (*ino + 1) % OSPFS_BLKINODES)
+		entry_ino = ospfs_claim_inode(*ino / OSPFS_BLKINODES);
+	if (!entry_ino && !(entry_ino = ospfs_alloc_inode(dir_oi, dir->i_ino)))
+		return -ENOSPC;
+	oi = ospfs_inode(entry_ino);
+	oi->oi_ftype = OSPFS_FTYPE_REG;
+	oi->oi_mode = ent->oce_mode & S_IALLUGO;
+
+	if (ent->oce_size
+	    && (r = ospfs_createbatch_fill(oi, (const char __user *) (unsigned long) ent->oce_data,
+					   ent->oce_size, goal)) < 0) {
+		change_size(oi, 0);
+		ospfs_free_inode(entry_ino);
+		return r;
+	}
+
+	memcpy(od->od_name, name, OSPFS_MAXNAMELEN + 1);
+	od->od_ino = entry_ino;
+	ospfs_diridx_add(dir->i_ino, dir_oi, *diroff);
+	ospfs_lookup_forget(dir->i_ino, name, ent->oce_namelen);
+	ospfs_touch(dir_oi, dir, S_MTIME | S_CTIME);
+	*hslot = *diroff + 1;
+	*diroff += OSPFS_DIRENTRY_SIZE;
+	*ino = entry_ino;
+
+	ospfs_trace(OSPFS_TRACE_CREATE, entry_ino, dir->i_ino, oi->oi_mode, ent->oce_namelen);
+	if (ent->oce_size)
+		ospfs_trace(OSPFS_TRACE_WRITE, entry_ino, 0, 0, ent->oce_size);
+	return entry_ino;
+}
+
+static long
+ospfs_createbatch(struct inode *dir, struct ospfs_createbatch __user *uarg)
+{
+	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
+	struct ospfs_createbatch arg;
+	ospfs_create_ent_t ent, __user *uent;
+	struct ospfs_nameset ns;
+	uint32_t off, nfree = 0, nslots, ino = 0, goal = 0, diroff = 0;
+	long r = 0;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.obc_count > OSPFS_MAXFILESIZE / OSPFS_DIRENTRY_SIZE)
+		return -EINVAL;
+	uent = (ospfs_create_ent_t __user *) (unsigned long) arg.obc_entries;
+	arg.obc_done = arg.obc_created = 0;
+
+	// The check the VFS would make before each create
+	if ((r = inode_permission(dir, MAY_WRITE | MAY_EXEC)) < 0)
+		return r;
+
+	mutex_lock(&dir->i_mutex);
+
+	// Size the set for the directory plus the batch, at most half full
+	nslots = dir_oi->oi_size / OSPFS_DIRENTRY_SIZE + arg.obc_count;
+	ns.ns_mask = 63;
+	while (ns.ns_mask < 2 * nslots)
+		ns.ns_mask = 2 * ns.ns_mask + 1;
+	if (!(ns.ns_slots = vmalloc((ns.ns_mask + 1) * sizeof(uint32_t)))) {
+		r = -ENOMEM;
+		goto out;
+	}
+	memset(ns.ns_slots, 0, (ns.ns_mask + 1) * sizeof(uint32_t));
+
+	for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
+		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off);
+		if (od->od_ino == 0)
+			nfree++;
+		else
+			*ospfs_nameset_slot(&ns, dir_oi, od->od_name, strlen(od->od_name)) = off + 1;
+	}
+
+	// Grow the directory in one go; if that fails, entries grow it one
+	// block at a time until space runs out
+	if (arg.obc_count > nfree) {
+		uint32_t need = arg.obc_count - nfree;
+		uint32_t size = ospfs_size2nblocks(dir_oi->oi_size) * OSPFS_BLKSIZE;
+		need = ospfs_size2nblocks(need * OSPFS_DIRENTRY_SIZE) * OSPFS_BLKSIZE;
+		if (size + (uint64_t) need <= OSPFS_MAXFILESIZE)
+			change_size(dir_oi, size + need);
+	}
+
+	for (; arg.obc_done < arg.obc_count; arg.obc_done++) {
+		if (copy_from_user(&ent, &uent[arg.obc_done], sizeof(ent))) {
+			r = -EFAULT;
+			break;
+		}
+		ent.oce_result = ospfs_createbatch_one(dir, &ns, &ent, &diroff, &ino, &goal);
+		if (put_user(ent.oce_result, &uent[arg.obc_done].oce_result)) {
+			r = -EFAULT;
+			break;
+		}
+		if (ent.oce_result > 0)
+			arg.obc_created++;
+		else if (ent.oce_result == -ENOSPC) {
+			arg.obc_done++;
+			break;
+		}
+		cond_resched();
+	}
+
+	vfree(ns.ns_slots);
+	if (copy_to_user(uarg, &arg, sizeof(arg)))
+		r = -EFAULT;
+
+    out:
+	mutex_unlock(&dir->i_mutex);
+	return r;
+}
+
+// ospfs_rmtree(filp, uarg)
+//	OSPFS_IOC_RMTREE.  Walks the tree depth first, going from directory
+//	entries straight to inodes, with an explicit stack instead of
+//	recursion (kernel stacks are small).  A file that loses its last link
+//	has its blocks freed in runs by ospfs_free_file.  An emptied
+//	directory's blocks go the same way, entries and all; only the one
+//	entry naming it in its parent is cleared.  Until then the tree stays
+//	linked in, so an error part way through leaves a consistent,
+//	partly removed tree.
+//
+//	Nothing in the tree may be in use.  The target is locked below its
+//	parent, as rmdir does, and then shrink_dcache_parent prunes the
+//	unused dentries below it, so any still there belong to open files,
+//	working directories or mount points.  With none left, every lookup
+//	or create that could reach into the tree has to go through the
+//	target and wait for its lock, so the directories further down need
+//	no locks of their own.  A removed target is marked dead, like an
+//	rmdir'd directory, for anyone who was already waiting.
+//
+//	Removing an entry takes what unlink and rmdir would: write and search
+//	permission on its directory, and past a sticky bit, ownership.  The
+//	target's parent and every directory emptied are checked before any
+//	of their entries go.
+
+struct ospfs_rmframe {
+	uint32_t rf_ino;		// Directory being emptied
+	uint32_t rf_off;		// Next entry to look at
+	ospfs_direntry_t *rf_entry;	// Its entry in its parent, or NULL
+};
+
+// Drop one link to non-directory 'ino', freeing it with the last one.
+static void
+ospfs_rmtree_unlink(uint32_t ino)
+{
+	ospfs_inode_t *oi = ospfs_inode(ino);
+	ospfs_inode_info_t *ii;
+
+	if (--oi->oi_nlink > 0)
+		return;
+	if (oi->oi_ftype == OSPFS_FTYPE_SYMLINK) {
+		ospfs_free_inode(ino);
+		return;
+	}
+
+	// Still open through a hard link outside the tree: orphan it,
+	// as ospfs_unlink would
+	if ((ii = ospfs_get_info(ino, 0))) {
+		mutex_lock(&ii->ii_mutex);
+		ospfs_da_discard(ii, 0);
+		mutex_unlock(&ii->ii_mutex);
+		ospfs_add_orphan(ino);
+		ospfs_put_info(ii);
+		return;
+	}
+	ospfs_free_file(oi);
+	ospfs_free_inode(ino);
+}
+
+// ospfs_rmtree_may_empty(sb, ino)
+//	Returns 0 if the caller may remove entries from directory 'ino', as
+//	the VFS's may_delete would check, or a negative error code.
+
+static int
+ospfs_rmtree_may_empty(struct super_block *sb, uint32_t ino)
+{
+	struct inode *dir = ospfs_mk_linux_inode(sb, ino);
+	int r;
+
+	if (!dir)
+		return -ENOMEM;
+	r = inode_permission(dir, MAY_WRITE | MAY_EXEC);
+	// Everything belongs to root (see ospfs_mk_linux_inode)
+	if (r == 0 && (dir->i_mode & S_ISVTX) && current->fsuid != 0
+	    && !capable(CAP_FOWNER))
+		r = -EPERM;
+	iput(dir);
+	return r;
+}
+
+static long
+ospfs_rmtree(struct file *filp, struct ospfs_rmtree __user *uarg)
+{
+	struct dentry *parent = filp->f_dentry, *target;
+	struct inode *dir = parent->d_inode, *victim = NULL;
+	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino), *oi;
+	struct ospfs_rmtree arg;
+	struct ospfs_rmframe *stack = NULL, *top;
+	uint32_t depth = 0, maxdepth = 0, ino;
+	char name[OSPFS_MAXNAMELEN + 1];
+	ospfs_direntry_t *od = NULL;
+	long r = 0;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.ort_namelen > OSPFS_MAXNAMELEN)
+		return -ENAMETOOLONG;
+	if (copy_from_user(name, (const char __user *) (unsigned long) arg.ort_name,
+			   arg.ort_namelen))
+		return -EFAULT;
+	name[arg.ort_namelen] = '\0';
+	arg.ort_removed = 0;
+	// Fails on a read-only superblock or mount, bind mounts too
+	if ((r = mnt_want_write(filp->f_vfsmnt)) < 0)
+		return r;
+
+	mutex_lock_nested(&dir->i_mutex, I_MUTEX_PARENT);
+	if (arg.ort_namelen) {
+		if ((r = ospfs_rmtree_may_empty(dir->i_sb, dir->i_ino)) < 0)
+			goto out;
+		target = lookup_one_len(name, parent, arg.ort_namelen);
+		if (IS_ERR(target)) {
+			r = PTR_ERR(target);
+			goto out;
+		}
+		if (!target->d_inode
+		    || !(od = find_direntry(dir_oi, name, arg.ort_namelen))) {
+			r = -ENOENT;
+			goto put;
+		}
+		if (S_ISDIR(target->d_inode->i_mode)) {
+			victim = target->d_inode;
+			mutex_lock_nested(&victim->i_mutex, I_MUTEX_CHILD);
+		}
+	} else
+		target = dget(parent);
+
+	shrink_dcache_parent(target);
+	if (!list_empty(&target->d_subdirs)
+	    || (arg.ort_namelen && atomic_read(&target->d_count) > 1)) {
+		r = -EBUSY;
+		goto put;
+	}
+
+	ino = arg.ort_namelen ? od->od_ino : dir->i_ino;
+	if (ospfs_inode(ino)->oi_ftype != OSPFS_FTYPE_DIR) {
+		ospfs_diridx_forget(dir->i_ino);
+		od->od_ino = 0;
+		ospfs_lookup_forget(dir->i_ino, name, arg.ort_namelen);
+		ospfs_trace(OSPFS_TRACE_UNLINK, ino, dir->i_ino, 0, arg.ort_namelen);
+		ospfs_rmtree_unlink(ino);
+		arg.ort_removed++;
+		goto removed;
+	}
+	if ((r = ospfs_rmtree_may_empty(dir->i_sb, ino)) < 0)
+		goto put;
+
+	for (;;) {
+		// Make room for one more directory
+		if (depth == maxdepth) {
+			struct ospfs_rmframe *bigger;
+			maxdepth = maxdepth ? 2 * maxdepth : 16;
+			if (!(bigger = kmalloc(maxdepth * sizeof(*stack), GFP_KERNEL))) {
+				r = -ENOMEM;
+				break;
+			}
+			if (depth)
+				memcpy(bigger, stack, depth * sizeof(*stack));
+			kfree(stack);
+			stack = bigger;
+		}
+		if (ino) {
+			stack[depth].rf_ino = ino;
+			stack[depth].rf_off = 0;
+			stack[depth].rf_entry = od;
+			depth++;
+			ino = 0;
+		}
+
+		// Next entry of the innermost directory
+		top = &stack[depth - 1];
+		oi = ospfs_inode(top->rf_ino);
+		while (top->rf_off < oi->oi_size && !ino) {
+			od = ospfs_inode_data(oi, top->rf_off);
+			top->rf_off += OSPFS_DIRENTRY_SIZE;
+			if (!od->od_ino)
+				continue;
+			if (ospfs_inode(od->od_ino)->oi_ftype == OSPFS_FTYPE_DIR
+			    && (r = ospfs_rmtree_may_empty(dir->i_sb, od->od_ino)) < 0)
+				break;
+			ospfs_trace(OSPFS_TRACE_UNLINK, od->od_ino, top->rf_ino, 0, strlen(od->od_name));
+			arg.ort_removed++;
+			if (ospfs_inode(od->od_ino)->oi_ftype == OSPFS_FTYPE_DIR)
+				ino = od->od_ino;
+			else {
+				ospfs_rmtree_unlink(od->od_ino);
+				od->od_ino = 0;
+			}
+			cond_resched();
+		}
+		if (r < 0)
+			break;
+		if (ino)
+			continue;
+
+		// Directory is empty: drop its blocks, then its inode and the
+		// entry naming it, unless it is the directory being emptied
+		ospfs_free_file(oi);
+		ospfs_diridx_forget(top->rf_ino);
+		depth--;
+		if (top->rf_entry) {
+			top->rf_entry->od_ino = 0;
+			ospfs_free_inode(top->rf_ino);
+			oi = ospfs_inode(depth ? stack[depth - 1].rf_ino : dir->i_ino);
+			if (oi->oi_nlink > 1)
+				oi->oi_nlink--;
+		}
+		if (!depth)
+			break;
+	}
+	// Cached lookups in the freed directories would go stale
+	ospfs_lookup_purge();
+	ospfs_diridx_forget(dir->i_ino);
+
+    removed:
+	if (arg.ort_removed)
+		ospfs_touch(dir_oi, dir, S_MTIME | S_CTIME);
+	dir->i_size = dir_oi->oi_size;
+	dir->i_nlink = dir_oi->oi_nlink + 1;
+	if (arg.ort_namelen && !r && victim)
+		victim->i_flags |= S_DEAD;
+    put:
+	// d_delete may drop the last reference to the victim
+	if (victim)
+		mutex_unlock(&victim->i_mutex);
+	if (arg.ort_namelen && !r)
+		d_delete(target);
+	dput(target);
+    out:
+	mutex_unlock(&dir->i_mutex);
+	mnt_drop_write(filp->f_vfsmnt);
+	kfree(stack);
+	if (put_user(arg.ort_removed, &uarg->ort_removed))
+		r = -EFAULT;
+	return r;
+}
+
+// ospfs_dir_ioctl(filp, cmd, arg)
+//	The directory file_operations.unlocked_ioctl callback.
+
+static long
+ospfs_dir_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct inode *dir = filp->f_dentry->d_inode;
+	long r;
+
+	switch (cmd) {
+	case OSPFS_IOC_READDIRPLUS:
+		return ospfs_readdirplus(dir, (struct ospfs_readdirplus __user *) arg);
+	case OSPFS_IOC_CREATEBATCH:
+		// Fails on a read-only superblock or mount, bind mounts too
+		if ((r = mnt_want_write(filp->f_vfsmnt)) < 0)
+			return r;
+		r = ospfs_createbatch(dir, (struct ospfs_createbatch __user *) arg);
+		mnt_drop_write(filp->f_vfsmnt);
+		return r;
+	case OSPFS_IOC_RMTREE:
+		return ospfs_rmtree(filp, (struct ospfs_rmtree __user *) arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+
+/*****************************************************************************
+ * FILE IOCTLS
+ */
+
+// ospfs_copyrange(filp, uarg)
+//	OSPFS_IOC_COPYRANGE.  Both files' buffered data is flushed first, so
+//	everything to copy has a disk block.  Then the destination blocks
+//	that are missing are allocated, as few runs as possible starting
+//	right after the block before them.  Then data is copied straight
+//	between blocks of the image.  With equal alignment a source hole
+//	stays a hole, and the block is neither allocated nor written.
+//
+//	OSPFS blocks have no reference counts, so blocks can't be shared
+//	between files (no reflink); the data is always copied.
 //
-//   EXERCISE: Complete this function.
+//	Both files' ii_mutexes are held, taken in inode number order.
 
-static int
-ospfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
+static long
+ospfs_copyrange(struct file *filp, struct ospfs_copyrange __user *uarg)
 {
-	int len, i;
-	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
-	ospfs_symlink_inode_t *symlink = 0;
-	ospfs_inode_t *inodes = ospfs_block(ospfs_super->os_firstinob);
-	ospfs_direntry_t *direntry = 0;
-	uint32_t entry_ino = 0;
+	struct inode *inode = filp->f_dentry->d_inode, *src_inode;
+	ospfs_file_info_t *fi = filp->private_data, *src_fi;
+	ospfs_inode_info_t *ii = fi->fi_info, *src_ii;
+	ospfs_inode_t *oi = ospfs_inode(inode->i_ino), *src_oi;
+	struct ospfs_copyrange arg;
+	struct file *src_filp;
+	uint32_t n, first, last, need = 0, blockno = 0, left = 0, *slot;
+	uint32_t len, pos, old_size;
+	int aligned;
+	long r = 0;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (!(filp->f_mode & FMODE_WRITE) || (filp->f_flags & O_APPEND))
+		return -EBADF;
+	if (!(src_filp = fget(arg.ocr_src_fd)))
+		return -EBADF;
+	src_inode = src_filp->f_dentry->d_inode;
+	src_fi = src_filp->private_data;
+	if (!(src_filp->f_mode & FMODE_READ)) {
+		r = -EBADF;
+		goto out_fput;
+	}
+	if (src_inode->i_sb != inode->i_sb || src_inode->i_fop != &ospfs_reg_file_ops
+	    || !src_fi || !src_fi->fi_info) {
+		r = -EXDEV;
+		goto out_fput;
+	}
+	src_ii = src_fi->fi_info;
+	src_oi = ospfs_inode(src_inode->i_ino);
+	arg.ocr_copied = 0;
+
+	if (src_ii == ii)
+		mutex_lock(&ii->ii_mutex);
+	else if (src_inode->i_ino < inode->i_ino) {
+		mutex_lock(&src_ii->ii_mutex);
+		mutex_lock(&ii->ii_mutex);
+	} else {
+		mutex_lock(&ii->ii_mutex);
+		mutex_lock(&src_ii->ii_mutex);
+	}
 
-	if(OSPFS_MAXNAMELEN < dentry->d_name.len) {
-		return -ENAMETOOLONG;
+	// Clip to the source's end of file
+	if (arg.ocr_src_off >= src_oi->oi_size)
+		goto out;
+	len = MIN(arg.ocr_len, (uint64_t) src_oi->oi_size - arg.ocr_src_off);
+	// Checked without adding, so a huge offset can't wrap past the limit;
+	// the block and size arithmetic below relies on both ranges fitting
+	if (arg.ocr_dst_off > OSPFS_MAXFILESIZE || len > OSPFS_MAXFILESIZE - arg.ocr_dst_off
+	    || arg.ocr_src_off > OSPFS_MAXFILESIZE || len > OSPFS_MAXFILESIZE - arg.ocr_src_off) {
+		r = -EFBIG;
+		goto out;
+	}
+	if (src_ii == ii && arg.ocr_src_off < arg.ocr_dst_off + len
+	    && arg.ocr_dst_off < arg.ocr_src_off + len) {
+		r = -EINVAL;
+		goto out;
 	}
+	// Copying works block to block, so inline files go back to blocks
+	if ((r = ospfs_da_flush(src_ii, src_oi)) < 0
+	    || (src_ii != ii && (r = ospfs_da_flush(ii, oi)) < 0)
+	    || (r = ospfs_uninline(src_oi)) < 0 || (r = ospfs_uninline(oi)) < 0)
+		goto out;
 
-	if(find_direntry(dir_oi, dentry->d_name.name, 
-			dentry->d_name.len)) {
-		return -EEXIST;
+	// Allocate missing destination blocks, counting them first so
+	// ospfs_alloc_run can look for a single run
+	aligned = (arg.ocr_src_off % OSPFS_BLKSIZE == arg.ocr_dst_off % OSPFS_BLKSIZE);
+	first = arg.ocr_dst_off / OSPFS_BLKSIZE;
+	last = ospfs_size2nblocks(arg.ocr_dst_off + len);
+	for (n = first; n < last; n++) {
+		slot = ospfs_bmap_slot(oi, n, 0);
+		if ((!slot || !*slot)
+		    && (!aligned || ospfs_inode_blockno(src_oi, (n - first) * OSPFS_BLKSIZE
+							+ arg.ocr_src_off - arg.ocr_src_off % OSPFS_BLKSIZE)))
+			need++;
+	}
+	for (n = first; n < last && need; n++) {
+		slot = ospfs_bmap_slot(oi, n, 0);
+		if ((slot && *slot)
+		    || (aligned && !ospfs_inode_blockno(src_oi, (n - first) * OSPFS_BLKSIZE
+							+ arg.ocr_src_off - arg.ocr_src_off % OSPFS_BLKSIZE)))
+			continue;
+		if (!left && !(blockno = ospfs_alloc_run(ospfs_block_goal(oi, n), need, &left, 0)))
+			break;
+		if (!(slot = ospfs_bmap_slot(oi, n, OSPFS_BMAP_CREATE)))
+			break;
+		memset(ospfs_block(blockno), 0, OSPFS_BLKSIZE);
+		*slot = blockno++;
+		left--;
+		need--;
+	}
+	if (left)
+		ospfs_free_blocks(blockno, left);
+	// Out of space: copy only up to the first block we couldn't get
+	if (need)
+		len = n * OSPFS_BLKSIZE > arg.ocr_dst_off
+			? MIN(len, n * OSPFS_BLKSIZE - arg.ocr_dst_off) : 0;
+
+	// The gap between the old end of file and the copy reads as zeroes
+	old_size = oi->oi_size;
+	if (arg.ocr_dst_off > old_size && old_size % OSPFS_BLKSIZE
+	    && (slot = ospfs_bmap_slot(oi, old_size / OSPFS_BLKSIZE, 0)) && *slot)
+		memset((uint8_t *) ospfs_block(*slot) + old_size % OSPFS_BLKSIZE, 0,
+		       MIN(OSPFS_BLKSIZE - old_size % OSPFS_BLKSIZE, arg.ocr_dst_off - old_size));
+	if (arg.ocr_dst_off + len > oi->oi_size)
+		oi->oi_size = arg.ocr_dst_off + len;
+
+	for (pos = 0; pos < len; ) {
+		uint32_t src = arg.ocr_src_off + pos, dst = arg.ocr_dst_off + pos;
+		uint32_t src_block = ospfs_inode_blockno(src_oi, src);
+		uint32_t dst_block = ospfs_inode_blockno(oi, dst);
+		uint32_t amount = MIN(len - pos, OSPFS_BLKSIZE - src % OSPFS_BLKSIZE);
+
+		amount = MIN(amount, OSPFS_BLKSIZE - dst % OSPFS_BLKSIZE);
+		if (src_block && dst_block)
+			memcpy((uint8_t *) ospfs_block(dst_block) + dst % OSPFS_BLKSIZE,
+			       (uint8_t *) ospfs_block(src_block) + src % OSPFS_BLKSIZE, amount);
+		else if (dst_block)
+			memset((uint8_t *) ospfs_block(dst_block) + dst % OSPFS_BLKSIZE, 0, amount);
+		pos += amount;
+		cond_resched();
 	}
+	arg.ocr_copied = len;
+	inode->i_size = oi->oi_size;
+	if (len)
+		ospfs_touch(oi, inode, S_MTIME | S_CTIME);
+	ospfs_trace(OSPFS_TRACE_READ, src_inode->i_ino, 0, arg.ocr_src_off, len);
+	ospfs_trace(OSPFS_TRACE_WRITE, inode->i_ino, 0, arg.ocr_dst_off, len);
 
-	// Now check the symbolic link name
-	len = strlen(symname);
-	if(OSPFS_MAXSYMLINKLEN < len) {
-		return -ENAMETOOLONG;
+    out:
+	mutex_unlock(&ii->ii_mutex);
+	if (src_ii != ii)
+		mutex_unlock(&src_ii->ii_mutex);
+	if (r >= 0 && put_user(arg.ocr_copied, &uarg->ocr_copied))
+		r = -EFAULT;
+    out_fput:
+	fput(src_filp);
+	return r;
+}
+
+// ospfs_upgrade(filp)
+//	OSPFS_IOC_UPGRADE: converts the file now, as its last close would.
+
+static long
+ospfs_upgrade(struct file *filp)
+{
+	ospfs_inode_t *oi = ospfs_inode(filp->f_dentry->d_inode->i_ino);
+	ospfs_file_info_t *fi = filp->private_data;
+	ospfs_inode_info_t *ii = fi ? fi->fi_info : NULL;
+	long r;
+	int busy;
+
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (!ii)
+		return -EINVAL;
+	mutex_lock(&ii->ii_mutex);
+	spin_lock(&ospfs_info_lock);
+	busy = ii->ii_count > 1;
+	spin_unlock(&ospfs_info_lock);
+	if (busy)
+		r = -EBUSY;
+	else if ((r = ospfs_da_flush(ii, oi)) >= 0) {
+		if (!ii->ii_ndirty)
+			ospfs_inline(oi);
+		r = oi->oi_format;
 	}
+	mutex_unlock(&ii->ii_mutex);
+	return r;
+}
 
-	// Get a new direntry
-	direntry = create_blank_direntry(dir_oi);
-	if(IS_ERR(direntry))
-		return PTR_ERR(direntry);
+// ospfs_file_ioctl(filp, cmd, arg)
+//	The regular file_operations.unlocked_ioctl callback.
 
-	// Find an open inode
-	for(i = 0; i < ospfs_super->os_ninodes; i++) {
-		if(inodes[i].oi_nlink == 0) {
-			entry_ino = i;
-			break;
-		}
+static long
+ospfs_file_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case OSPFS_IOC_COPYRANGE:
+		return ospfs_copyrange(filp, (struct ospfs_copyrange __user *) arg);
+	case OSPFS_IOC_UPGRADE:
+		return ospfs_upgrade(filp);
+	default:
+		return -ENOTTY;
 	}
-	if(i == ospfs_super->os_ninodes)
-		return -ENOSPC;
+}
 
-	// Set the symlink to the appropriate inode
-	symlink = (ospfs_symlink_inode_t*)&inodes[entry_ino];
 
+// ospfs_open(inode, filp)
+//   Linux calls this function when a file or directory is opened.
+//   It is the file_operations.open callback.  Sets up the per-open
+//   'ospfs_file_info_t' and records the open in the workload trace.
 
-	// Set the values of the members
-	symlink->oi_nlink = 1;
-	symlink->oi_ftype = OSPFS_FTYPE_SYMLINK;
-	symlink->oi_size = len;
-	strcpy(symlink->oi_symlink, symname);
+static int
+ospfs_open(struct inode *inode, struct file *filp)
+{
+	ospfs_file_info_t *fi = ospfs_cache_alloc(OSPFS_CACHE_FILE, GFP_KERNEL);
+	if (!fi)
+		return -ENOMEM;
+	memset(fi, 0, sizeof(*fi));
+	fi->fi_ino = inode->i_ino;
+	// Even files that only read get the in-memory state, so ii_count
+	// sees every open file before a format change frees a block they
+	// might be reading (a read-only mount can become writable)
+	if (S_ISREG(inode->i_mode) && !(fi->fi_info = ospfs_get_info(inode->i_ino, 1))) {
+		ospfs_cache_free(OSPFS_CACHE_FILE, fi);
+		return -ENOMEM;
+	}
+	filp->private_data = fi;
 
-	// Make root?ln1:ln2<null> into root?ln1<null>ln2<null>
-	// This is to make conditional symlinks easier later
-	if(strncmp (symlink->oi_symlink, "root?", 5) == 0) {
-		i = 0;
-		// Find the dividing point
-		while(i < len && symlink->oi_symlink[i] != ':') {
-			i++;
-		}
-		// This should never happen
-		if(i == len)
-			return -ENAMETOOLONG;
+	ospfs_trace(OSPFS_TRACE_OPEN, inode->i_ino, 0, filp->f_flags, 0);
+	return 0;
+}
 
-		// Divide the two with a null byte
-		symlink->oi_symlink[i] = '\0';
+
+// ospfs_release(inode, filp)
+//   Linux calls this function when the last reference to an open file goes
+//   away.  It is the file_operations.release callback.  When the inode's
+//   last open file goes, its buffered data is flushed.
+
+static int
+ospfs_release(struct inode *inode, struct file *filp)
+{
+	ospfs_file_info_t *fi = filp->private_data;
+	if (fi) {
+		if (fi->fi_info)
+			ospfs_put_info(fi->fi_info);
+		ospfs_cache_free(OSPFS_CACHE_FILE, fi);
 	}
+	filp->private_data = NULL;
+	return 0;
+}
 
-	// Finish making the direntry
-	direntry->od_ino = entry_ino;
-	strncpy(direntry->od_name, dentry->d_name.name, dentry->d_name.len);
-	direntry->od_name[dentry->d_name.len] = '\0';
 
-	/* Execute this code after your function has successfully created the
-	   file.  Set entry_ino to the created file's inode number before
-	   getting here. */
-	{
-		struct inode *i = ospfs_mk_linux_inode(dir->i_sb, entry_ino);
-		if (!i)
-			return -ENOMEM;
-		d_instantiate(dentry, i);
-		return 0;
+// ospfs_fsync(filp, dentry, datasync)
+//	Gives any buffered data of the file its disk blocks.
+
+static int
+ospfs_fsync(struct file *filp, struct dentry *dentry, int datasync)
+{
+	ospfs_file_info_t *fi = filp->private_data;
+	int r = 0;
+
+	if (fi && fi->fi_info) {
+		mutex_lock(&fi->fi_info->ii_mutex);
+		r = ospfs_da_flush(fi->fi_info, ospfs_inode(fi->fi_ino));
+		mutex_unlock(&fi->fi_info->ii_mutex);
 	}
+	return r;
 }
 
 
@@ -1601,6 +6038,278 @@ ospfs_follow_link(struct dentry *dentry, struct nameidata *nd)
 }
 
 
+// ospfs_sync_fs(sb, wait)
+//	Called by sync(2) and at unmount.  Discards pending freed blocks
+//	(see FREED-BLOCK DISCARD), or has the worker do it if 'wait' is 0.
+
+static int
+ospfs_sync_fs(struct super_block *sb, int wait)
+{
+	if (wait)
+		ospfs_discard(NULL);
+	else if (atomic_read(&ospfs_ndiscard))
+		queue_work(ospfs_wq, &ospfs_discard_work);
+	return 0;
+}
+
+
+// ospfs_put_super(sb)
+//	Called at unmount.  Lets the workers finish first.
+
+static void
+ospfs_put_super(struct super_block *sb)
+{
+	ospfs_stop_scrub();
+	flush_workqueue(ospfs_wq);
+	ospfs_discard(NULL);
+	ospfs_destroy_groups();
+}
+
+
+// ospfs_statfs(dentry, buf)
+//	Reports free space.  Blocks and inodes of orphans count as free, since
+//	they will be soon.
+
+static int
+ospfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	uint32_t g, nifree = 0, norphans, orphan_blocks;
+
+	norphans = ospfs_orphan_pending(&orphan_blocks);
+	for (g = 0; g < ospfs_ngroups; g++)
+		nifree += ospfs_groups[g].bg_nifree;
+
+	buf->f_type = OSPFS_MAGIC;
+	buf->f_bsize = OSPFS_BLKSIZE;
+	buf->f_blocks = ospfs_super->os_nblocks - OSPFS_FIRST_VALID_BLOCK;
+	spin_lock(&ospfs_space_lock);
+	buf->f_bfree = ospfs_nfree + orphan_blocks;
+	buf->f_bavail = ospfs_nfree - ospfs_nreserved + orphan_blocks;
+	spin_unlock(&ospfs_space_lock);
+	buf->f_files = ospfs_super->os_ninodes - 1;
+	buf->f_ffree = nifree + norphans;
+	buf->f_namelen = OSPFS_MAXNAMELEN;
+	return 0;
+}
+
+
+/*****************************************************************************
+ * MOUNT OPTIONS
+ *
+ *   The allocator, cache and readahead tunables can be set when mounting,
+ *   for example "mount -t ospfs -o alloc=nextfit,readahead=64 none /mnt".
+ *   There is only one OSPFS superblock, so an option just sets the
+ *   module-wide value; a remount can change it again, and /proc/mounts
+ *   shows the values in force.
+ *
+ *	alloc=goal|firstfit|nextfit	where block searches start (see
+ *					ospfs_alloc_run; default goal)
+ *	prealloc=N			allocate a file's buffered blocks
+ *					once it has N (0 = on close)
+ *	readahead=N			largest readahead window, in blocks
+ *	lookup_cache=N			cached directory lookups (0 = off)
+ *	dirindex, nodirindex		index directories by name or not
+ *	mem_budget=BYTES		memory budget for the caches
+ *	inline_data			store small files in their inodes
+ *
+ *   Options take effect only once the mount or remount can no longer
+ *   fail, so a bad one (or a failed mount) leaves everything as it was.
+ *
+ *   Read-only mounts also get a cheaper read path: reads don't update
+ *   access times.
+ */
+
+static bool ospfs_inline_enable = 0;
+module_param_named(inline_data, ospfs_inline_enable, bool, 0644);
+MODULE_PARM_DESC(inline_data, "Turn on inline data for images mounted from now on");
+
+enum {
+	Opt_alloc, Opt_prealloc, Opt_readahead, Opt_lookup_cache,
+	Opt_dirindex, Opt_nodirindex, Opt_mem_budget, Opt_inline_data, Opt_err
+};
+
+static match_table_t ospfs_tokens = {
+	{ Opt_alloc, "alloc=%s" },
+	{ Opt_prealloc, "prealloc=%u" },
+	{ Opt_readahead, "readahead=%u" },
+	{ Opt_lookup_cache, "lookup_cache=%u" },
+	{ Opt_dirindex, "dirindex" },
+	{ Opt_nodirindex, "nodirindex" },
+	{ Opt_mem_budget, "mem_budget=%s" },
+	{ Opt_inline_data, "inline_data" },
+	{ Opt_err, NULL }
+};
+
+// Indexed by OSPFS_ALLOC_*
+static const char *ospfs_alloc_names[] = { "goal", "firstfit", "nextfit" };
+
+// ospfs_parse_options(options, o)
+//	Parses the comma-separated 'options' (which may be NULL) into 'o',
+//	starting from the current settings.  Returns 0, -EINVAL or -ENOMEM.
+
+static int
+ospfs_parse_options(char *options, struct ospfs_mount_opts *o)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p, *name, *end;
+	int token, n;
+
+	o->alloc = ospfs_alloc_policy;
+	o->prealloc = ospfs_da_window;
+	o->readahead = ospfs_ra_max;
+	o->lookup_cache = ospfs_lookup_max;
+	o->dirindex = ospfs_dirindex;
+	o->mem_budget = ospfs_mem_budget;
+	o->inline_data = ospfs_inline_enable;
+
+	while (options && (p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		switch ((token = match_token(p, ospfs_tokens, args))) {
+		case Opt_alloc:
+			if (!(name = match_strdup(&args[0])))
+				return -ENOMEM;
+			for (n = 0; n < ARRAY_SIZE(ospfs_alloc_names); n++)
+				if (strcmp(name, ospfs_alloc_names[n]) == 0)
+					break;
+			kfree(name);
+			if (n == ARRAY_SIZE(ospfs_alloc_names))
+				goto bad;
+			o->alloc = n;
+			break;
+		case Opt_prealloc:
+			if (match_int(&args[0], &n) || n < 0)
+				goto bad;
+			o->prealloc = n;
+			break;
+		case Opt_readahead:
+			if (match_int(&args[0], &n) || n < 0)
+				goto bad;
+			o->readahead = n;
+			break;
+		case Opt_lookup_cache:
+			if (match_int(&args[0], &n) || n < 0)
+				goto bad;
+			o->lookup_cache = n;
+			break;
+		case Opt_dirindex:
+		case Opt_nodirindex:
+			o->dirindex = (token == Opt_dirindex);
+			break;
+		case Opt_mem_budget:
+			// Wider than match_int, like the mem_budget attribute
+			if (!(name = match_strdup(&args[0])))
+				return -ENOMEM;
+			o->mem_budget = simple_strtoul(name, &end, 0);
+			n = (end == name || *end);
+			kfree(name);
+			if (n)
+				goto bad;
+			break;
+		case Opt_inline_data:
+			o->inline_data = 1;
+			break;
+		default:
+			goto bad;
+		}
+	}
+	return 0;
+
+    bad:
+	eprintk("OSPFS: bad mount option \"%s\"\n", p);
+	return -EINVAL;
+}
+
+// ospfs_check_features(rdonly)
+//	Checks that this module understands the features the image uses
+//	(see ospfs.h).  Returns 0, or -EINVAL or -EROFS if the image can't
+//	be mounted as asked.
+
+static int
+ospfs_check_features(int rdonly)
+{
+	uint32_t incompat = ospfs_super->os_feature_incompat & ~OSPFS_FEATURE_INCOMPAT_SUPP;
+	uint32_t ro_compat = ospfs_super->os_feature_ro_compat & ~OSPFS_FEATURE_RO_COMPAT_SUPP;
+
+	if (incompat) {
+		eprintk("OSPFS: image uses unknown features %#x\n", incompat);
+		return -EINVAL;
+	}
+	if (ro_compat && !rdonly) {
+		eprintk("OSPFS: image uses unknown features %#x; mount it read-only\n",
+			ro_compat);
+		return -EROFS;
+	}
+	return 0;
+}
+
+// ospfs_apply_options(o, rdonly)
+//	Puts parsed mount options into effect for a mount or remount that can
+//	no longer fail; 'rdonly' is nonzero if the result is read-only.  Also
+//	turns on the image features the options ask for.
+
+static void
+ospfs_apply_options(const struct ospfs_mount_opts *o, int rdonly)
+{
+	ospfs_alloc_policy = o->alloc;
+	ospfs_da_window = o->prealloc;
+	ospfs_ra_max = o->readahead;
+	ospfs_lookup_max = o->lookup_cache;
+	if (!ospfs_lookup_max)
+		ospfs_lookup_purge();
+	ospfs_dirindex = o->dirindex;
+	if (!ospfs_dirindex)
+		ospfs_diridx_shrink(INT_MAX);
+	if (o->mem_budget != ospfs_mem_budget)
+		ospfs_set_mem_budget(o->mem_budget);
+	ospfs_inline_enable = o->inline_data;
+	ospfs_rdonly = rdonly;
+
+	if (ospfs_inline_enable && !rdonly
+	    && !(ospfs_super->os_feature_incompat & OSPFS_FEATURE_INCOMPAT_INLINE)) {
+		ospfs_super->os_feature_incompat |= OSPFS_FEATURE_INCOMPAT_INLINE;
+		eprintk("OSPFS: inline data turned on\n");
+	}
+}
+
+// ospfs_remount_fs(sb, flags, data)
+//	Linux calls this to change the options of the mounted file system,
+//	and, since OSPFS has a single superblock, on every mount after the
+//	first.
+
+static int
+ospfs_remount_fs(struct super_block *sb, int *flags, char *data)
+{
+	struct ospfs_mount_opts o;
+	int r;
+
+	if ((r = ospfs_parse_options(data, &o)) < 0
+	    || (r = ospfs_check_features(*flags & MS_RDONLY)) < 0)
+		return r;
+	ospfs_apply_options(&o, *flags & MS_RDONLY);
+	// Pick up orphan reclamation that a read-only mount put off
+	if ((sb->s_flags & MS_RDONLY) && !(*flags & MS_RDONLY)
+	    && ospfs_super->os_orphan)
+		ospfs_queue_reclaim();
+	return 0;
+}
+
+// ospfs_show_options(seq, mnt)
+//	Lists the settings in force for /proc/mounts.
+
+static int
+ospfs_show_options(struct seq_file *seq, struct vfsmount *mnt)
+{
+	seq_printf(seq, ",alloc=%s,prealloc=%u,readahead=%u,lookup_cache=%u,%s,mem_budget=%lu",
+		   ospfs_alloc_names[ospfs_alloc_policy], ospfs_da_window,
+		   ospfs_ra_max, ospfs_lookup_max,
+		   ospfs_dirindex ? "dirindex" : "nodirindex", ospfs_mem_budget);
+	if (ospfs_super->os_feature_incompat & OSPFS_FEATURE_INCOMPAT_INLINE)
+		seq_printf(seq, ",inline_data");
+	return 0;
+}
+
+
 // Define the file system operations structures mentioned above.
 
 static struct file_system_type ospfs_fs_type = {
@@ -1611,11 +6320,21 @@ static struct file_system_type ospfs_fs_type = {
 };
 
 static struct inode_operations ospfs_reg_inode_ops = {
-	.setattr	= ospfs_notify_change
+	.setattr	= ospfs_notify_change,
+	.fallocate	= ospfs_fallocate,
+	.fiemap		= ospfs_fiemap,
+	.setxattr	= ospfs_setxattr,
+	.getxattr	= ospfs_getxattr,
+	.listxattr	= ospfs_listxattr,
+	.removexattr	= ospfs_removexattr
 };
 
 static struct file_operations ospfs_reg_file_ops = {
-	.llseek		= generic_file_llseek,
+	.llseek		= ospfs_llseek,
+	.open		= ospfs_open,
+	.release	= ospfs_release,
+	.fsync		= ospfs_fsync,
+	.unlocked_ioctl	= ospfs_file_ioctl,
 	.read		= ospfs_read,
 	.write		= ospfs_write
 };
@@ -1625,12 +6344,19 @@ static struct inode_operations ospfs_dir_inode_ops = {
 	.link		= ospfs_link,
 	.unlink		= ospfs_unlink,
 	.create		= ospfs_create,
-	.symlink	= ospfs_symlink
+	.symlink	= ospfs_symlink,
+	.setxattr	= ospfs_setxattr,
+	.getxattr	= ospfs_getxattr,
+	.listxattr	= ospfs_listxattr,
+	.removexattr	= ospfs_removexattr
 };
 
 static struct file_operations ospfs_dir_file_ops = {
+	.open		= ospfs_open,
+	.release	= ospfs_release,
 	.read		= generic_read_dir,
-	.readdir	= ospfs_dir_readdir
+	.readdir	= ospfs_dir_readdir,
+	.unlocked_ioctl	= ospfs_dir_ioctl
 };
 
 static struct inode_operations ospfs_symlink_inode_ops = {
@@ -1643,20 +6369,230 @@ static struct dentry_operations ospfs_dentry_ops = {
 };
 
 static struct super_operations ospfs_superblock_ops = {
+	.put_super	= ospfs_put_super,
+	.sync_fs	= ospfs_sync_fs,
+	.statfs		= ospfs_statfs,
+	.remount_fs	= ospfs_remount_fs,
+	.show_options	= ospfs_show_options
+};
+
+static struct file_operations ospfs_trace_file_ops = {
+	.owner		= THIS_MODULE,
+	.read		= ospfs_trace_read
 };
 
 
+/*****************************************************************************
+ * IMAGE BACKING
+ *
+ *   The image built into the module, 'ospfs_data', is init data: at load
+ *   time it is copied into 2MB chunks, and the kernel frees it once the
+ *   module is loaded, so only one copy of the image stays resident.
+ *
+ *   If the 'hugepages' parameter is set (the default), each chunk is one
+ *   high-order page allocation, physically contiguous memory from the
+ *   kernel's direct map.  These are not hugetlbfs or transparent huge
+ *   pages, and nothing checks how they are mapped: only where the direct
+ *   map itself uses 2MB pages (usual on x86-64, but not promised) does a
+ *   chunk cost one TLB entry instead of 512, so that random accesses all
+ *   over a big image (inodes, the bitmap, indirect blocks) miss in the
+ *   TLB less.  If the parameter is off, or any chunk can't be had, the
+ *   chunks come from vmalloc, which maps them with 4KB pages.  The
+ *   'backing' parameter says which happened.
+ *
+ *   Only blocks within a chunk are adjacent in memory.  The inode table
+ *   is indexed as an array, though, so if it crosses chunks its pages
+ *   are mapped a second time, consecutively, with vmap.
+ */
+
+static bool ospfs_hugepages = 1;
+module_param_named(hugepages, ospfs_hugepages, bool, 0444);
+MODULE_PARM_DESC(hugepages, "Copy the image into physically contiguous 2MB chunks");
+
+static char *ospfs_backing = "vmalloc";
+module_param_named(backing, ospfs_backing, charp, 0444);
+MODULE_PARM_DESC(backing, "Where the image lives: 'hugepage' (contiguous) or 'vmalloc' chunks");
+
+static uint32_t ospfs_nchunks;
+static int ospfs_chunks_vmalloc;	// Nonzero if chunks came from vmalloc
+static void *ospfs_inode_map;		// The inode table's vmap, if any
+
+static uint32_t
+ospfs_chunk_size(uint32_t c)
+{
+	return MIN(ospfs_length - c * OSPFS_CHUNK_SIZE, OSPFS_CHUNK_SIZE);
+}
+
+static void
+ospfs_free_chunks(void)
+{
+	uint32_t c;
+	for (c = 0; c < ospfs_nchunks; c++) {
+		if (!ospfs_chunks[c])
+			continue;
+		if (ospfs_chunks_vmalloc)
+			vfree(ospfs_chunks[c]);
+		else
+			free_pages((unsigned long) ospfs_chunks[c], get_order(ospfs_chunk_size(c)));
+		ospfs_chunks[c] = NULL;
+	}
+}
+
+static void
+ospfs_destroy_image(void)
+{
+	if (ospfs_inode_map)
+		vunmap(ospfs_inode_map);
+	ospfs_inode_map = NULL;
+	if (ospfs_chunks)
+		ospfs_free_chunks();
+	kfree(ospfs_chunks);
+	ospfs_chunks = NULL;
+	ospfs_chunks_vmalloc = 0;
+}
+
+// ospfs_map_inode_table()
+//	Sets 'ospfs_inode_table'.  A table within one chunk is used in place;
+//	one that crosses chunks has its pages mapped again, consecutively.
+
+static int
+ospfs_map_inode_table(void)
+{
+	uint32_t first = ospfs_super->os_firstinob;
+	uint32_t last = first + ospfs_size2nblocks(ospfs_super->os_ninodes * OSPFS_INODESIZE) - 1;
+	size_t start = ((size_t) first * OSPFS_BLKSIZE) & PAGE_MASK;
+	size_t end = (size_t) (last + 1) * OSPFS_BLKSIZE;
+	uint32_t i, npages = (end - start + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	struct page **pages;
+
+	if (first >> OSPFS_CHUNK_SHIFT == last >> OSPFS_CHUNK_SHIFT) {
+		ospfs_inode_table = ospfs_block(first);
+		return 0;
+	}
+
+	// Chunks are page aligned, so no page straddles two of them
+	if (!(pages = kmalloc(npages * sizeof(*pages), GFP_KERNEL)))
+		return -ENOMEM;
+	for (i = 0; i < npages; i++) {
+		void *addr = ospfs_block((start + (size_t) i * PAGE_SIZE) / OSPFS_BLKSIZE);
+		pages[i] = ospfs_chunks_vmalloc ? vmalloc_to_page(addr) : virt_to_page(addr);
+	}
+	ospfs_inode_map = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+	kfree(pages);
+	if (!ospfs_inode_map)
+		return -ENOMEM;
+	ospfs_inode_table = (ospfs_inode_t *) ((uint8_t *) ospfs_inode_map
+					       + (size_t) first * OSPFS_BLKSIZE % PAGE_SIZE);
+	return 0;
+}
+
+static int __init
+ospfs_init_image(void)
+{
+	uint32_t c;
+	int r;
+
+	ospfs_nchunks = (ospfs_length + OSPFS_CHUNK_SIZE - 1) / OSPFS_CHUNK_SIZE;
+	if (!(ospfs_chunks = kcalloc(ospfs_nchunks, sizeof(*ospfs_chunks), GFP_KERNEL)))
+		return -ENOMEM;
+
+	if (ospfs_hugepages) {
+		for (c = 0; c < ospfs_nchunks; c++) {
+			unsigned long addr = __get_free_pages(GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY,
+							      get_order(ospfs_chunk_size(c)));
+			if (!addr)
+				break;
+			ospfs_chunks[c] = (uint8_t *) addr;
+		}
+		if (c == ospfs_nchunks)
+			ospfs_backing = "hugepage";
+		else {
+			eprintk("OSPFS: no memory for 2MB chunks, using vmalloc\n");
+			ospfs_free_chunks();
+		}
+	}
+	if (!ospfs_chunks[0]) {
+		ospfs_chunks_vmalloc = 1;
+		for (c = 0; c < ospfs_nchunks; c++)
+			if (!(ospfs_chunks[c] = vmalloc(ospfs_chunk_size(c)))) {
+				ospfs_destroy_image();
+				return -ENOMEM;
+			}
+	}
+	for (c = 0; c < ospfs_nchunks; c++)
+		memcpy(ospfs_chunks[c], ospfs_data + c * OSPFS_CHUNK_SIZE, ospfs_chunk_size(c));
+
+	ospfs_super = ospfs_block(1);
+	if ((r = ospfs_map_inode_table()) < 0) {
+		ospfs_destroy_image();
+		return r;
+	}
+	eprintk("OSPFS: %u-block image in %u %s chunk(s)\n",
+		ospfs_length / OSPFS_BLKSIZE, ospfs_nchunks, ospfs_backing);
+	return 0;
+}
+
+
 // Functions used to hook the module into the kernel!
 
+static struct proc_dir_entry *ospfs_proc_dir;
+
 static int __init init_ospfs_fs(void)
 {
+	int r;
+
+	// Both inode layouts must fill their slot, with the times in one place
+	BUILD_BUG_ON(sizeof(ospfs_inode_t) != OSPFS_INODESIZE);
+	BUILD_BUG_ON(sizeof(ospfs_symlink_inode_t) != OSPFS_INODESIZE);
+	BUILD_BUG_ON(offsetof(ospfs_inode_t, oi_atime) != OSPFS_INODE_TIMES);
+	BUILD_BUG_ON(offsetof(ospfs_symlink_inode_t, oi_atime) != OSPFS_INODE_TIMES);
+
 	eprintk("Loading ospfs module...\n");
-	return register_filesystem(&ospfs_fs_type);
+	ospfs_trace_epoch = ktime_get();
+	if ((r = ospfs_init_image()) < 0)
+		return r;
+	if ((r = ospfs_init_caches()) < 0) {
+		ospfs_destroy_image();
+		return r;
+	}
+	ospfs_proc_dir = proc_mkdir("fs/ospfs", NULL);
+	ospfs_wq = create_singlethread_workqueue("ospfs_reclaim");
+	if (!ospfs_proc_dir || !ospfs_wq
+	    || !proc_create("trace", S_IRUSR, ospfs_proc_dir, &ospfs_trace_file_ops)) {
+		r = -ENOMEM;
+		goto fail;
+	}
+
+	register_shrinker(&ospfs_shrinker);
+	if ((r = register_filesystem(&ospfs_fs_type)) < 0) {
+		unregister_shrinker(&ospfs_shrinker);
+		goto fail;
+	}
+	return 0;
+
+    fail:
+	if (ospfs_wq)
+		destroy_workqueue(ospfs_wq);
+	ospfs_destroy_caches();
+	if (ospfs_proc_dir) {
+		remove_proc_entry("trace", ospfs_proc_dir);
+		remove_proc_entry("fs/ospfs", NULL);
+	}
+	ospfs_destroy_image();
+	return r;
 }
 
 static void __exit exit_ospfs_fs(void)
 {
 	unregister_filesystem(&ospfs_fs_type);
+	remove_proc_entry("trace", ospfs_proc_dir);
+	remove_proc_entry("fs/ospfs", NULL);
+	unregister_shrinker(&ospfs_shrinker);
+	destroy_workqueue(ospfs_wq);
+	ospfs_lookup_purge();
+	ospfs_diridx_shrink(INT_MAX);
+	ospfs_destroy_caches();
+	ospfs_destroy_image();
 	eprintk("Unloading ospfs module\n");
 }
 
@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "ospfs.h"
+
+/****************************************************************************
+ * ospfsrandread
+ *
+ *   Measures random-read latency on a mounted OSPFS.  Each read is one
+ *   block-aligned OSPFS_BLKSIZE pread of a random block of a random file
+ *   (files are weighted by size), so successive reads land all over the
+ *   image and stress the TLB and caches rather than the copy loop.
+ *
+ *   To compare the module's image backings (see IMAGE BACKING in
+ *   ospfsmod.c), run the same command with the module loaded with
+ *   hugepages=0 and then with hugepages=1:
+ *
+ *	insmod ospfs.ko hugepages=0; mount ...; ospfsrandread /mnt/ospfs
+ *	umount ...; rmmod ospfs
+ *	insmod ospfs.ko hugepages=1; mount ...; ospfsrandread /mnt/ospfs
+ *
+ *   The report gives the backing the module says it used, then the mean,
+ *   median and tail latencies and the read rate.  The first few reads
+ *   only warm up and are not counted.
+ *
+ ****************************************************************************/
+
+struct Benchfile {
+	int fd;
+	uint32_t nblocks;
+};
+
+struct Benchfile *files;
+int nfiles;
+uint64_t totalblocks;
+
+int
+addfile(const char *name, const struct stat *st, int flag, struct FTW *ftw)
+{
+	int fd;
+	if (flag != FTW_F || !S_ISREG(st->st_mode) || st->st_size < OSPFS_BLKSIZE)
+		return 0;
+	if ((fd = open(name, O_RDONLY)) < 0) {
+		perror(name);
+		return 0;
+	}
+	files = realloc(files, (nfiles + 1) * sizeof(*files));
+	if (!files) {
+		perror("realloc");
+		exit(1);
+	}
+	files[nfiles].fd = fd;
+	files[nfiles].nblocks = st->st_size / OSPFS_BLKSIZE;
+	totalblocks += files[nfiles].nblocks;
+	nfiles++;
+	return 0;
+}
+
+// Pick a random block; files are weighted by their size.
+void
+pick(int *f, uint32_t *b)
+{
+	uint64_t r = (((uint64_t) rand() << 31) ^ rand()) % totalblocks;
+	int i;
+	for (i = 0; r >= files[i].nblocks; i++)
+		r -= files[i].nblocks;
+	*f = i;
+	*b = r;
+}
+
+int
+cmpu64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+uint64_t
+nsec(const struct timespec *t)
+{
+	return (uint64_t) t->tv_sec * 1000000000 + t->tv_nsec;
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "Usage: ospfsrandread [-n READS] [-s SEED] PATH...\n\
+  Reads READS random blocks (default 100000) from the regular files\n\
+  under each PATH and reports per-read latency.\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned long nreads = 100000, warmup, i;
+	unsigned int seed = 1;
+	char buf[OSPFS_BLKSIZE], backing[32] = "unknown";
+	uint64_t *lat, sum = 0;
+	struct timespec t0, t1, start, end;
+	double secs;
+	char *s;
+	FILE *p;
+
+    option:
+	if (argc > 2 && argv[1][0] == '-' && argv[1][1] && !argv[1][2]) {
+		switch (argv[1][1]) {
+		case 'n':
+			nreads = strtoul(argv[2], &s, 0);
+			break;
+		case 's':
+			seed = strtoul(argv[2], &s, 0);
+			break;
+		default:
+			usage();
+		}
+		if (*s || nreads == 0)
+			usage();
+		argc -= 2, argv += 2;
+		goto option;
+	}
+	if (argc < 2)
+		usage();
+
+	for (i = 1; i < (unsigned long) argc; i++)
+		if (nftw(argv[i], addfile, 16, FTW_PHYS) < 0) {
+			perror(argv[i]);
+			exit(1);
+		}
+	if (nfiles == 0) {
+		fprintf(stderr, "ospfsrandread: no files of at least one block\n");
+		exit(1);
+	}
+	if ((p = fopen("/sys/module/ospfs/parameters/backing", "r"))) {
+		if (fscanf(p, "%31s", backing) != 1)
+			strcpy(backing, "unknown");
+		fclose(p);
+	}
+
+	if (!(lat = malloc(nreads * sizeof(*lat)))) {
+		perror("malloc");
+		exit(1);
+	}
+	srand(seed);
+	warmup = nreads / 10;
+
+	for (i = 0; i < warmup + nreads; i++) {
+		int f;
+		uint32_t b;
+		pick(&f, &b);
+		if (i == warmup)
+			clock_gettime(CLOCK_MONOTONIC, &start);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (pread(files[f].fd, buf, sizeof(buf), (off_t) b * OSPFS_BLKSIZE) < 0) {
+			perror("pread");
+			exit(1);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if (i >= warmup) {
+			lat[i - warmup] = nsec(&t1) - nsec(&t0);
+			sum += lat[i - warmup];
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (nsec(&end) - nsec(&start)) / 1e9;
+
+	qsort(lat, nreads, sizeof(*lat), cmpu64);
+	printf("backing            %s\n", backing);
+	printf("files              %d (%" PRIu64 " blocks)\n", nfiles, totalblocks);
+	printf("reads              %lu\n", nreads);
+	printf("latency (ns)       mean %.0f, p50 %" PRIu64 ", p90 %" PRIu64
+	       ", p99 %" PRIu64 ", p99.9 %" PRIu64 ", max %" PRIu64 "\n",
+	       (double) sum / nreads, lat[nreads / 2], lat[nreads * 9 / 10],
+	       lat[nreads * 99 / 100], lat[nreads * 999 / 1000], lat[nreads - 1]);
+	printf("rate               %.0f reads/s\n", secs > 0 ? nreads / secs : 0.0);
+	return 0;
+}
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "ospfsimg.h"
+
+/****************************************************************************
+ * ospfsreceive
+ *
+ *   Applies a send stream from ospfssend (see SEND STREAMS in ospfsimg.h)
+ *   to an image.  An incremental stream is only applied if the image
+ *   matches the stream's base; a full stream replaces the image, creating
+ *   it if need be.
+ *
+ *   The stream is applied to a copy of the image as it is read, a batch
+ *   of blocks at a time, so it is never held in memory.  The copy only
+ *   replaces the image once the stream has ended properly and the copy's
+ *   digest matches the one the sender computed.  So a truncated or
+ *   corrupt stream leaves the image alone.
+ *
+ ****************************************************************************/
+
+// The copy the stream is applied to, removed on failure
+char *tmpname;
+
+void
+die(void)
+{
+	if (tmpname)
+		unlink(tmpname);
+	exit(1);
+}
+
+void
+fail(const char *what)
+{
+	perror(what);
+	die();
+}
+
+void
+xread(FILE *in, void *data, size_t n)
+{
+	if (fread(data, 1, n, in) != n) {
+		fprintf(stderr, "ospfsreceive: %s\n",
+			ferror(in) ? strerror(errno) : "stream is truncated");
+		die();
+	}
+}
+
+// Writes a copy of 'img' to 'fd', as the file the stream is applied to.
+void
+copyimage(struct ospfs_image *img, int fd)
+{
+	size_t n = (size_t) img->super->os_nblocks * OSPFS_BLKSIZE, off;
+	ssize_t w;
+
+	for (off = 0; off < n; off += w)
+		if ((w = write(fd, img->data + off, n - off)) <= 0)
+			fail(tmpname);
+}
+
+// Reads the stream's extents and writes each to 'fd' as it comes, a
+// batch of blocks at a time.  Returns the number of blocks written and
+// sets '*nextents'.
+uint64_t
+applyextents(FILE *in, const struct ospfs_send_header *h, int fd, uint64_t *nextents)
+{
+	static uint8_t buf[64 * OSPFS_BLKSIZE];
+	struct ospfs_send_extent e;
+	uint64_t nblocks = 0;
+	uint32_t n;
+
+	for (*nextents = 0; ; (*nextents)++) {
+		xread(in, &e, sizeof(e));
+		if (e.ose_count == 0)
+			return nblocks;
+		if (e.ose_start >= h->osh_nblocks || e.ose_count > h->osh_nblocks - e.ose_start) {
+			fprintf(stderr, "ospfsreceive: extent %u+%u is out of range\n",
+				e.ose_start, e.ose_count);
+			die();
+		}
+		for (; e.ose_count; e.ose_start += n, e.ose_count -= n) {
+			n = e.ose_count < 64 ? e.ose_count : 64;
+			xread(in, buf, (size_t) n * OSPFS_BLKSIZE);
+			if (pwrite(fd, buf, (size_t) n * OSPFS_BLKSIZE,
+				   (off_t) e.ose_start * OSPFS_BLKSIZE) != (ssize_t) n * OSPFS_BLKSIZE)
+				fail(tmpname);
+			nblocks += n;
+		}
+	}
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "Usage: ospfsreceive [-f STREAM] IMAGE\n\
+  Applies the ospfssend stream STREAM (default standard input) to IMAGE.\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct ospfs_send_header h;
+	struct ospfs_image *img = NULL;
+	const char *inname = NULL;
+	uint8_t digest[16];
+	uint64_t nblocks, nextents;
+	FILE *in = stdin;
+	struct stat st;
+	mode_t mode;
+	int fd;
+
+    option:
+	if (argc > 2 && strcmp(argv[1], "-f") == 0) {
+		inname = argv[2];
+		argc -= 2, argv += 2;
+		goto option;
+	}
+	if (argc != 2)
+		usage();
+	if (inname && !(in = fopen(inname, "r"))) {
+		perror(inname);
+		exit(1);
+	}
+
+	xread(in, &h, sizeof(h));
+	if (memcmp(h.osh_magic, OSPFS_SEND_MAGIC, sizeof(h.osh_magic)) != 0
+	    || h.osh_version != OSPFS_SEND_VERSION || h.osh_nblocks < 2) {
+		fprintf(stderr, "ospfsreceive: not an OSPFS send stream\n");
+		exit(1);
+	}
+
+	// An incremental stream only makes sense against its base
+	if (!(h.osh_flags & OSPFS_SEND_FULL)) {
+		if (!(img = ospfsimg_open(argv[1], 0))) {
+			fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+			exit(1);
+		}
+		if (img->super->os_nblocks != h.osh_nblocks
+		    || img->super->os_ninodes != h.osh_ninodes) {
+			fprintf(stderr, "ospfsreceive: %s has different geometry\n", argv[1]);
+			exit(1);
+		}
+		ospfsimg_digest(img, digest);
+		if (memcmp(digest, h.osh_base, sizeof(digest)) != 0) {
+			fprintf(stderr, "ospfsreceive: %s is not the stream's base image\n", argv[1]);
+			exit(1);
+		}
+	}
+
+	// The copy is made next to the image, so it can be renamed over it,
+	// and keeps the image's permissions
+	if (stat(argv[1], &st) == 0)
+		mode = st.st_mode & 07777;
+	else if (errno == ENOENT && (h.osh_flags & OSPFS_SEND_FULL)) {
+		mode = umask(0);
+		umask(mode);
+		mode = 0666 & ~mode;
+	} else
+		fail(argv[1]);
+	if (!(tmpname = malloc(strlen(argv[1]) + 8))) {
+		perror("malloc");
+		exit(1);
+	}
+	sprintf(tmpname, "%s.XXXXXX", argv[1]);
+	if ((fd = mkstemp(tmpname)) < 0) {
+		tmpname = NULL;
+		fail(argv[1]);
+	}
+	if (fchmod(fd, mode) < 0)
+		fail(tmpname);
+	if (img) {
+		copyimage(img, fd);
+		ospfsimg_close(img);
+	}
+
+	// A full stream's image is exactly as big as the sender's
+	if (ftruncate(fd, (off_t) h.osh_nblocks * OSPFS_BLKSIZE) < 0)
+		fail(tmpname);
+	nblocks = applyextents(in, &h, fd, &nextents);
+	if (fsync(fd) < 0 || close(fd) < 0)
+		fail(tmpname);
+
+	if (!(img = ospfsimg_open(tmpname, 0))) {
+		fprintf(stderr, "ospfsreceive: received image is not valid\n");
+		die();
+	}
+	ospfsimg_digest(img, digest);
+	ospfsimg_close(img);
+	if (memcmp(digest, h.osh_result, sizeof(digest)) != 0) {
+		fprintf(stderr, "ospfsreceive: stream does not produce the sent image; %s left alone\n", argv[1]);
+		die();
+	}
+	if (rename(tmpname, argv[1]) < 0)
+		fail(argv[1]);
+	fprintf(stderr, "ospfsreceive: applied %" PRIu64 " blocks in %" PRIu64 " extents\n",
+		nblocks, nextents);
+	return 0;
+}
@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "ospfsimg.h"
+
+/****************************************************************************
+ * ospfssend
+ *
+ *   Writes a send stream (see SEND STREAMS in ospfsimg.h) that turns
+ *   image BASE into image NEW, for ospfsreceive to apply elsewhere.  BASE
+ *   is typically a copy of NEW kept from the previous replication, so the
+ *   stream is only as big as what changed since:
+ *
+ *	ospfssend -b fs.img.last fs.img | ssh mirror ospfsreceive fs.img
+ *	cp fs.img fs.img.last
+ *
+ *   Without -b the stream is full: it carries every live block, and
+ *   ospfsreceive can build a new image from it.
+ *
+ ****************************************************************************/
+
+struct ospfs_image *base, *img;
+FILE *out;
+uint64_t nsent, nextents;
+
+void
+xwrite(const void *data, size_t n)
+{
+	if (fwrite(data, 1, n, out) != n) {
+		perror("ospfssend: write");
+		exit(1);
+	}
+}
+
+// Returns nonzero if block 'b' of the new image must be sent.
+int
+changed(uint32_t b)
+{
+	if (!ospfsimg_live(img, b))
+		return 0;
+	return !base || !ospfsimg_live(base, b)
+		|| memcmp(ospfsimg_block(base, b), ospfsimg_block(img, b), OSPFS_BLKSIZE) != 0;
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "Usage: ospfssend [-b BASE] [-o STREAM] NEW\n\
+  Writes a stream of the blocks that turn image BASE into image NEW (all\n\
+  of NEW's blocks without -b) to STREAM or standard output.\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct ospfs_send_header h;
+	struct ospfs_send_extent e;
+	const char *basename = NULL, *outname = NULL;
+	uint32_t b, start, nblocks;
+
+    option:
+	if (argc > 2 && argv[1][0] == '-' && argv[1][1] && !argv[1][2]) {
+		switch (argv[1][1]) {
+		case 'b':
+			basename = argv[2];
+			break;
+		case 'o':
+			outname = argv[2];
+			break;
+		default:
+			usage();
+		}
+		argc -= 2, argv += 2;
+		goto option;
+	}
+	if (argc != 2)
+		usage();
+
+	if (!(img = ospfsimg_open(argv[1], 0))) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		exit(1);
+	}
+	if (basename && !(base = ospfsimg_open(basename, 0))) {
+		fprintf(stderr, "%s: %s\n", basename, strerror(errno));
+		exit(1);
+	}
+	nblocks = img->super->os_nblocks;
+	if (base && (base->super->os_nblocks != nblocks
+		     || base->super->os_ninodes != img->super->os_ninodes)) {
+		fprintf(stderr, "ospfssend: %s and %s have different geometry\n",
+			basename, argv[1]);
+		exit(1);
+	}
+	if (!outname)
+		out = stdout;
+	else if (!(out = fopen(outname, "w"))) {
+		perror(outname);
+		exit(1);
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.osh_magic, OSPFS_SEND_MAGIC, sizeof(h.osh_magic));
+	h.osh_version = OSPFS_SEND_VERSION;
+	h.osh_flags = base ? 0 : OSPFS_SEND_FULL;
+	h.osh_nblocks = nblocks;
+	h.osh_ninodes = img->super->os_ninodes;
+	if (base)
+		ospfsimg_digest(base, h.osh_base);
+	ospfsimg_digest(img, h.osh_result);
+	xwrite(&h, sizeof(h));
+
+	// One extent per run of changed blocks
+	for (b = 0; b < nblocks; ) {
+		if (!changed(b)) {
+			b++;
+			continue;
+		}
+		for (start = b; b < nblocks && changed(b); b++)
+			/* do nothing */;
+		e.ose_start = start;
+		e.ose_count = b - start;
+		xwrite(&e, sizeof(e));
+		xwrite(ospfsimg_block(img, start), (size_t) e.ose_count * OSPFS_BLKSIZE);
+		nsent += e.ose_count;
+		nextents++;
+	}
+	e.ose_start = e.ose_count = 0;
+	xwrite(&e, sizeof(e));
+	if (fflush(out) != 0 || (outname && fclose(out) != 0)) {
+		perror("ospfssend: write");
+		exit(1);
+	}
+
+	fprintf(stderr, "ospfssend: %" PRIu64 " of %u blocks in %" PRIu64 " extents (%s)\n",
+		nsent, nblocks, nextents, base ? "incremental" : "full");
+	if (base)
+		ospfsimg_close(base);
+	ospfsimg_close(img);
+	return 0;
+}
@@ -0,0 +1,396 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ospfs.h"
+
+/****************************************************************************
+ * ospfstrace
+ *
+ *   Prints and replays OSPFS workload traces.  A trace is the binary stream
+ *   of 'struct ospfs_trace_rec's read from /proc/fs/ospfs/trace (see
+ *   ospfs.h).
+ *
+ *   Replay runs the traced operations against a mounted OSPFS directory,
+ *   normally a freshly mounted copy of the image the trace was taken on.
+ *   Traces contain no names or contents, so files created by the trace get
+ *   synthetic names ("t<ino>", "t<ino>.<n>" for extra links) and written
+ *   data is a fixed pattern.  Inodes the trace uses but did not create are
+ *   found by scanning the replay directory, which works because a fresh
+ *   mount of the same image assigns the same inode numbers.
+ *
+ ****************************************************************************/
+
+#define nelem(x)	(sizeof(x) / sizeof((x)[0]))
+
+static const char *opnames[OSPFS_TRACE_NOPS] = {
+	"?", "create", "unlink", "link", "symlink",
+	"open", "read", "write", "truncate", "readdir"
+};
+
+// Per-inode replay state: the names the inode currently has, and a
+// file descriptor opened on first read or write.
+struct Replayino {
+	char **names;
+	int nnames;
+	int nlinks_made;
+	int fd;
+};
+
+struct Replayino *inos;
+uint32_t ninos;
+
+unsigned long opcount[OSPFS_TRACE_NOPS];
+unsigned long opfail[OSPFS_TRACE_NOPS];
+int verbose = 0;
+
+char iobuf[1 << 16];
+
+struct Replayino *
+getino(uint32_t ino)
+{
+	if (ino >= ninos) {
+		uint32_t n = ninos ? ninos : 64;
+		while (n <= ino)
+			n *= 2;
+		inos = realloc(inos, n * sizeof(*inos));
+		if (!inos) {
+			perror("realloc");
+			abort();
+		}
+		memset(inos + ninos, 0, (n - ninos) * sizeof(*inos));
+		while (ninos < n)
+			inos[ninos++].fd = -1;
+	}
+	return &inos[ino];
+}
+
+void
+addname(uint32_t ino, const char *path)
+{
+	struct Replayino *ri = getino(ino);
+	ri->names = realloc(ri->names, (ri->nnames + 1) * sizeof(char *));
+	if (!ri->names || !(ri->names[ri->nnames] = strdup(path))) {
+		perror("malloc");
+		abort();
+	}
+	ri->nnames++;
+}
+
+// Return the first name of 'ino', or NULL if it has none.
+const char *
+inopath(uint32_t ino)
+{
+	struct Replayino *ri = getino(ino);
+	return ri->nnames ? ri->names[0] : NULL;
+}
+
+// Forget the name of 'ino' that lives in directory 'dir' (or any name, if
+// no name matches) and return it.  The caller frees the result.
+char *
+removename(uint32_t ino, uint32_t dir)
+{
+	struct Replayino *ri = getino(ino);
+	const char *dirpath = inopath(dir);
+	size_t dirlen = dirpath ? strlen(dirpath) : 0;
+	char *name;
+	int i;
+
+	if (ri->nnames == 0)
+		return NULL;
+	for (i = ri->nnames - 1; i > 0; i--)
+		if (dirpath && strncmp(ri->names[i], dirpath, dirlen) == 0
+		    && ri->names[i][dirlen] == '/'
+		    && !strchr(ri->names[i] + dirlen + 1, '/'))
+			break;
+	name = ri->names[i];
+	memmove(&ri->names[i], &ri->names[i + 1], (ri->nnames - i - 1) * sizeof(char *));
+	ri->nnames--;
+	return name;
+}
+
+void
+closeino(uint32_t ino)
+{
+	struct Replayino *ri = getino(ino);
+	if (ri->fd >= 0) {
+		close(ri->fd);
+		ri->fd = -1;
+	}
+}
+
+int
+inofd(uint32_t ino)
+{
+	struct Replayino *ri = getino(ino);
+	if (ri->fd < 0 && ri->nnames)
+		ri->fd = open(ri->names[0], O_RDWR);
+	return ri->fd;
+}
+
+int
+scanone(const char *path, const struct stat *s, int flag, struct FTW *ftw)
+{
+	if (s->st_ino > 0 && s->st_ino < UINT32_MAX)
+		addname(s->st_ino, path);
+	return 0;
+}
+
+// Replays a single record.  Returns 0 on success, -1 on failure.
+int
+replay(const ospfs_trace_rec_t *r)
+{
+	char path[PATH_MAX];
+	const char *dirpath;
+	char *name;
+	ssize_t n;
+	int fd;
+
+	switch (r->otr_op) {
+	case OSPFS_TRACE_CREATE:
+		if (!(dirpath = inopath(r->otr_dir)))
+			return -1;
+		snprintf(path, sizeof(path), "%s/t%u", dirpath, r->otr_ino);
+		fd = open(path, O_CREAT | O_EXCL | O_WRONLY, (mode_t) r->otr_off & 0777);
+		if (fd < 0)
+			return -1;
+		close(fd);
+		addname(r->otr_ino, path);
+		return 0;
+
+	case OSPFS_TRACE_SYMLINK: {
+		char target[OSPFS_MAXSYMLINKLEN + 1];
+		size_t len = r->otr_off < OSPFS_MAXSYMLINKLEN ? r->otr_off : OSPFS_MAXSYMLINKLEN;
+		if (!(dirpath = inopath(r->otr_dir)))
+			return -1;
+		memset(target, 'x', len);
+		target[len] = '\0';
+		snprintf(path, sizeof(path), "%s/t%u", dirpath, r->otr_ino);
+		if (symlink(target, path) < 0)
+			return -1;
+		addname(r->otr_ino, path);
+		return 0;
+	}
+
+	case OSPFS_TRACE_LINK:
+		if (!(dirpath = inopath(r->otr_dir)) || !inopath(r->otr_ino))
+			return -1;
+		snprintf(path, sizeof(path), "%s/t%u.%d", dirpath, r->otr_ino,
+			 ++getino(r->otr_ino)->nlinks_made);
+		if (link(inopath(r->otr_ino), path) < 0)
+			return -1;
+		addname(r->otr_ino, path);
+		return 0;
+
+	case OSPFS_TRACE_UNLINK:
+		if (!(name = removename(r->otr_ino, r->otr_dir)))
+			return -1;
+		if (getino(r->otr_ino)->nnames == 0)
+			closeino(r->otr_ino);
+		fd = unlink(name);
+		free(name);
+		return fd;
+
+	case OSPFS_TRACE_OPEN:
+		if (!inopath(r->otr_ino))
+			return -1;
+		fd = open(inopath(r->otr_ino), (int) r->otr_off & (O_ACCMODE | O_DIRECTORY));
+		if (fd < 0)
+			return -1;
+		close(fd);
+		return 0;
+
+	case OSPFS_TRACE_READ:
+	case OSPFS_TRACE_WRITE: {
+		uint64_t off = r->otr_off;
+		uint32_t left = r->otr_len;
+		if ((fd = inofd(r->otr_ino)) < 0)
+			return -1;
+		while (left > 0) {
+			size_t chunk = left < sizeof(iobuf) ? left : sizeof(iobuf);
+			if (r->otr_op == OSPFS_TRACE_READ)
+				n = pread(fd, iobuf, chunk, off);
+			else
+				n = pwrite(fd, iobuf, chunk, off);
+			if (n <= 0)
+				return n < 0 ? -1 : 0;
+			off += n;
+			left -= n;
+		}
+		return 0;
+	}
+
+	case OSPFS_TRACE_TRUNCATE:
+		if (!inopath(r->otr_ino))
+			return -1;
+		return truncate(inopath(r->otr_ino), r->otr_off);
+
+	case OSPFS_TRACE_READDIR: {
+		DIR *dir;
+		// Continuations of a listing are part of the first call
+		if (r->otr_off != 0)
+			return 0;
+		if (!inopath(r->otr_ino) || !(dir = opendir(inopath(r->otr_ino))))
+			return -1;
+		while (readdir(dir) != NULL)
+			/* do nothing */;
+		closedir(dir);
+		return 0;
+	}
+
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+sleep_until(uint64_t when)
+{
+	uint64_t t = now_ns();
+	struct timespec ts;
+	if (when <= t)
+		return;
+	ts.tv_sec = (when - t) / 1000000000;
+	ts.tv_nsec = (when - t) % 1000000000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		/* do nothing */;
+}
+
+FILE *
+opentrace(const char *name)
+{
+	FILE *f = strcmp(name, "-") == 0 ? stdin : fopen(name, "rb");
+	if (!f) {
+		perror(name);
+		exit(1);
+	}
+	return f;
+}
+
+const char *
+opname(uint32_t op)
+{
+	return op < OSPFS_TRACE_NOPS ? opnames[op] : "?";
+}
+
+int
+dump(const char *tracename)
+{
+	FILE *f = opentrace(tracename);
+	ospfs_trace_rec_t r;
+
+	while (fread(&r, sizeof(r), 1, f) == 1)
+		printf("%" PRIu64 ".%09" PRIu64 " %-8s ino %u dir %u off %" PRIu64 " len %u\n",
+		       r.otr_time / 1000000000, r.otr_time % 1000000000,
+		       opname(r.otr_op), r.otr_ino, r.otr_dir, r.otr_off, r.otr_len);
+	return 0;
+}
+
+int
+replaytrace(const char *tracename, const char *root, int timed)
+{
+	FILE *f = opentrace(tracename);
+	ospfs_trace_rec_t r;
+	uint64_t start = 0, first = 0, nrec = 0, nfail = 0;
+	struct stat s;
+	uint32_t op;
+
+	// The root directory is always OSPFS_ROOT_INO; everything else that
+	// already exists is found by inode number.
+	if (stat(root, &s) < 0 || !S_ISDIR(s.st_mode)) {
+		fprintf(stderr, "%s: not a directory\n", root);
+		return 1;
+	}
+	addname(OSPFS_ROOT_INO, root);
+	if (nftw(root, scanone, 16, FTW_PHYS) < 0) {
+		perror(root);
+		return 1;
+	}
+
+	memset(iobuf, 0xA5, sizeof(iobuf));
+	while (fread(&r, sizeof(r), 1, f) == 1) {
+		if (nrec++ == 0) {
+			start = now_ns();
+			first = r.otr_time;
+		}
+		if (timed)
+			sleep_until(start + (r.otr_time - first));
+
+		op = r.otr_op < OSPFS_TRACE_NOPS ? r.otr_op : 0;
+		opcount[op]++;
+		if (replay(&r) < 0) {
+			opfail[op]++;
+			nfail++;
+			if (verbose)
+				fprintf(stderr, "record %" PRIu64 ": %s ino %u: %s\n",
+					nrec - 1, opname(r.otr_op), r.otr_ino, strerror(errno));
+		}
+	}
+
+	printf("replayed %" PRIu64 " records in %.3f s (%" PRIu64 " failed)\n",
+	       nrec, nrec ? (now_ns() - start) / 1e9 : 0.0, nfail);
+	for (op = 1; op < OSPFS_TRACE_NOPS; op++)
+		if (opcount[op])
+			printf("  %-8s %10lu  (%lu failed)\n", opnames[op], opcount[op], opfail[op]);
+	return nfail ? 2 : 0;
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "Usage: ospfstrace dump TRACE\n\
+       ospfstrace replay [-t] [-V] TRACE DIR\n\
+  \"dump\" prints a trace read from /proc/fs/ospfs/trace.\n\
+  \"replay\" runs a trace against the OSPFS mounted at DIR.\n\
+  \"-t\" means keep the original timing instead of running flat out.\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int timed = 0;
+
+	if (argc < 2)
+		usage();
+	if (strcmp(argv[1], "dump") == 0) {
+		if (argc != 3)
+			usage();
+		return dump(argv[2]);
+	} else if (strcmp(argv[1], "replay") == 0) {
+		argc--, argv++;
+	    option:
+		if (argc > 1 && strcmp(argv[1], "-t") == 0) {
+			argc--, argv++, timed = 1;
+			goto option;
+		}
+		if (argc > 1 && strcmp(argv[1], "-V") == 0) {
+			argc--, argv++, verbose = 1;
+			goto option;
+		}
+		if (argc != 3)
+			usage();
+		return replaytrace(argv[1], argv[2], timed);
+	} else
+		usage();
+	return 0;
+}